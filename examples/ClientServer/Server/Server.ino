@@ -1,14 +1,11 @@
 #include <ESP8266WiFi.h>
 #include <ESPAsyncTCP.h>
 #include <DNSServer.h>
-#include <vector>
 
 #include "config.h"
 
 static DNSServer DNS;
 
-static std::vector<AsyncClient*> clients; // a list to hold all clients
-
  /* clients events */
 static void handleError(void* arg, AsyncClient* client, int8_t error) {
 	Serial.printf("\n connection error %s from client %s \n", client->errorToString(error), client->remoteIP().toString().c_str());
@@ -38,10 +35,10 @@ static void handleTimeOut(void* arg, AsyncClient* client, uint32_t time) {
 
 /* server events */
 static void handleNewClient(void* arg, AsyncClient* client) {
-	Serial.printf("\n new client has been connected to server, ip: %s", client->remoteIP().toString().c_str());
+	AsyncServer* server = reinterpret_cast<AsyncServer*>(arg);
+	Serial.printf("\n new client has been connected to server, ip: %s, clients: %u", client->remoteIP().toString().c_str(), server->clientCount());
 
-	// add to list
-	clients.push_back(client);
+	// the server keeps track of its clients, see forEachClient() and closeAll()
 	
 	// register events
 	client->onData(&handleData, NULL);
@@ -27,7 +27,6 @@ AsyncPrinter::AsyncPrinter()
   , _data_arg(NULL)
   , _close_cb(NULL)
   , _close_arg(NULL)
-  , _tx_buffer(NULL)
   , _tx_buffer_size(TCP_MSS)
   , next(NULL)
 {}
@@ -38,15 +37,10 @@ AsyncPrinter::AsyncPrinter(AsyncClient *client, size_t txBufLen)
   , _data_arg(NULL)
   , _close_cb(NULL)
   , _close_arg(NULL)
-  , _tx_buffer(NULL)
   , _tx_buffer_size(txBufLen)
   , next(NULL)
 {
   _attachCallbacks();
-  _tx_buffer = new (std::nothrow) cbuf(_tx_buffer_size);
-  if(_tx_buffer == NULL) {
-    panic(); //What should we do?
-  }
 }
 
 AsyncPrinter::~AsyncPrinter(){
@@ -99,16 +93,6 @@ int AsyncPrinter::connect(const char *host, uint16_t port){
 
 void AsyncPrinter::_onConnect(AsyncClient *c){
   (void)c;
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
-  _tx_buffer = new (std::nothrow) cbuf(_tx_buffer_size);
-  if(_tx_buffer) {
-    panic();
-  }
-
   _attachCallbacks();
 }
 
@@ -120,15 +104,6 @@ AsyncPrinter & AsyncPrinter::operator=(const AsyncPrinter &other){
     _client = NULL;
   }
   _tx_buffer_size = other._tx_buffer_size;
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
-  _tx_buffer = new (std::nothrow) cbuf(other._tx_buffer_size);
-  if(_tx_buffer == NULL) {
-    panic();
-  }
 
   _client = other._client;
   _attachCallbacks();
@@ -140,24 +115,25 @@ size_t AsyncPrinter::write(uint8_t data){
 }
 
 size_t AsyncPrinter::write(const uint8_t *data, size_t len){
-  if(_tx_buffer == NULL || !connected())
+  if(!connected())
     return 0;
-  size_t toWrite = 0;
-  size_t toSend = len;
-  while(_tx_buffer->room() < toSend){
-    toWrite = _tx_buffer->room();
-    _tx_buffer->write((const char*)data, toWrite);
-    while(connected() && !_client->canSend())
+  size_t written = 0;
+  while(written < len){
+    size_t queued = _client->queued();
+    if(queued >= _tx_buffer_size){
       delay(0);
-    if(!connected())
-      return 0; // or len - toSend;
-    _sendBuffer();
-    toSend -= toWrite;
+      if(!connected())
+        return 0; // or written;
+      continue;
+    }
+    size_t toWrite = _tx_buffer_size - queued;
+    if(toWrite > len - written)
+      toWrite = len - written;
+    size_t w = _client->enqueue((const char*)(data + written), toWrite);
+    if(w == 0)
+      return written;
+    written += w;
   }
-  _tx_buffer->write((const char*)(data+(len - toSend)), toSend);
-  while(connected() && !_client->canSend()) delay(0);
-  if(!connected()) return 0; // or len - toSend;
-  _sendBuffer();
   return len;
 }
 
@@ -170,24 +146,6 @@ void AsyncPrinter::close(){
     _client->close(true);
 }
 
-size_t AsyncPrinter::_sendBuffer(){
-  size_t available = _tx_buffer->available();
-  if(!connected() || !_client->canSend() || available == 0)
-    return 0;
-  size_t sendable = _client->space();
-  if(sendable < available)
-    available= sendable;
-  char *out = new (std::nothrow) char[available];
-  if (out == NULL) {
-    panic(); // Connection should be aborted instead
-  }
-
-  _tx_buffer->read(out, available);
-  size_t sent = _client->write(out, available);
-  delete out;
-  return sent;
-}
-
 void AsyncPrinter::_onData(void *data, size_t len){
   if(_data_cb)
     _data_cb(_data_arg, this, (uint8_t*)data, len);
@@ -197,18 +155,11 @@ void AsyncPrinter::_on_close(){
   if(_client != NULL){
     _client = NULL;
   }
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
   if(_close_cb)
     _close_cb(_close_arg, this);
 }
 
 void AsyncPrinter::_attachCallbacks(){
-  _client->onPoll([](void *obj, AsyncClient* c){ (void)c; ((AsyncPrinter*)(obj))->_sendBuffer(); }, this);
-  _client->onAck([](void *obj, AsyncClient* c, size_t len, uint32_t time){  (void)c; (void)len; (void)time; ((AsyncPrinter*)(obj))->_sendBuffer(); }, this);
   _client->onDisconnect([](void *obj, AsyncClient* c){ ((AsyncPrinter*)(obj))->_on_close(); delete c; }, this);
   _client->onData([](void *obj, AsyncClient* c, void *data, size_t len){ (void)c; ((AsyncPrinter*)(obj))->_onData(data, len); }, this);
 }
@@ -24,7 +24,6 @@
 
 #include "Arduino.h"
 #include "ESPAsyncTCP.h"
-#include "cbuf.h"
 
 class AsyncPrinter;
 
@@ -38,7 +37,6 @@ class AsyncPrinter: public Print {
     void *_data_arg;
     ApCloseHandler _close_cb;
     void *_close_arg;
-    cbuf *_tx_buffer;
     size_t _tx_buffer_size;
 
     void _onConnect(AsyncClient *c);
@@ -64,7 +62,6 @@ class AsyncPrinter: public Print {
     bool connected();
     void close();
 
-    size_t _sendBuffer();
     void _onData(void *data, size_t len);
     void _on_close();
     void _attachCallbacks();
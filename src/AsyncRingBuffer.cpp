@@ -0,0 +1,180 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "AsyncRingBuffer.h"
+
+AsyncRingBuffer::AsyncRingBuffer(size_t capacity)
+  : _buf(NULL)
+  , _size(0)
+  , _head(0)
+  , _len(0)
+{
+  if(capacity)
+    resize(capacity);
+}
+
+AsyncRingBuffer::~AsyncRingBuffer(){
+  free(_buf);
+}
+
+/*
+  Move to a new allocation of the given size, readable data ends up at the
+  start of it. Shrinking to zero releases the storage.
+*/
+bool AsyncRingBuffer::resize(size_t capacity){
+  if(capacity < _len)
+    return false;
+  if(capacity == _size)
+    return true;
+  char *buf = NULL;
+  if(capacity){
+    buf = (char*)malloc(capacity);
+    if(buf == NULL)
+      return false;
+    peek(buf, _len);
+  }
+  free(_buf);
+  _buf = buf;
+  _size = capacity;
+  _head = 0;
+  return true;
+}
+
+/*
+  Rotate the storage so the readable data starts at offset 0. Only does
+  work when the data wraps around the end.
+*/
+void AsyncRingBuffer::linearize(){
+  if(_head + _len <= _size)
+    return;
+  std::rotate(_buf, _buf + _head, _buf + _size);
+  _head = 0;
+}
+
+bool AsyncRingBuffer::reserve(size_t room){
+  if(room <= this->room())
+    return true;
+  size_t capacity = _size ? _size : room;
+  while(capacity - _len < room)
+    capacity *= 2;
+  return resize(capacity);
+}
+
+size_t AsyncRingBuffer::readSpans(AsyncRingSpan spans[2]) const {
+  if(_len == 0)
+    return 0;
+  size_t first = _size - _head;
+  if(first >= _len){
+    spans[0].data = _buf + _head;
+    spans[0].len = _len;
+    return 1;
+  }
+  spans[0].data = _buf + _head;
+  spans[0].len = first;
+  spans[1].data = _buf;
+  spans[1].len = _len - first;
+  return 2;
+}
+
+size_t AsyncRingBuffer::writeSpans(AsyncRingSpan spans[2]) const {
+  size_t free_len = _size - _len;
+  if(free_len == 0)
+    return 0;
+  size_t tail = _head + _len;
+  if(tail >= _size)
+    tail -= _size;
+  size_t first = _size - tail;
+  if(first >= free_len){
+    spans[0].data = _buf + tail;
+    spans[0].len = free_len;
+    return 1;
+  }
+  spans[0].data = _buf + tail;
+  spans[0].len = first;
+  spans[1].data = _buf;
+  spans[1].len = free_len - first;
+  return 2;
+}
+
+void AsyncRingBuffer::consume(size_t len){
+  if(len >= _len){
+    _head = 0;
+    _len = 0;
+    return;
+  }
+  _head += len;
+  if(_head >= _size)
+    _head -= _size;
+  _len -= len;
+}
+
+void AsyncRingBuffer::commit(size_t len){
+  if(len > room())
+    len = room();
+  _len += len;
+}
+
+size_t AsyncRingBuffer::write(const char *data, size_t len){
+  AsyncRingSpan spans[2];
+  size_t n = writeSpans(spans);
+  size_t done = 0;
+  for(size_t i = 0; i < n && done < len; i++){
+    size_t c = (spans[i].len < len - done) ? spans[i].len : len - done;
+    memcpy(spans[i].data, data + done, c);
+    done += c;
+  }
+  _len += done;
+  return done;
+}
+
+size_t AsyncRingBuffer::peek(char *dst, size_t len) const {
+  AsyncRingSpan spans[2];
+  size_t n = readSpans(spans);
+  size_t done = 0;
+  for(size_t i = 0; i < n && done < len; i++){
+    size_t c = (spans[i].len < len - done) ? spans[i].len : len - done;
+    memcpy(dst + done, spans[i].data, c);
+    done += c;
+  }
+  return done;
+}
+
+size_t AsyncRingBuffer::read(char *dst, size_t len){
+  size_t done = peek(dst, len);
+  consume(done);
+  return done;
+}
+
+int AsyncRingBuffer::peek() const {
+  if(_len == 0)
+    return -1;
+  return (uint8_t)_buf[_head];
+}
+
+int AsyncRingBuffer::read(){
+  int c = peek();
+  if(c >= 0)
+    consume(1);
+  return c;
+}
@@ -0,0 +1,78 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ASYNCRINGBUFFER_H_
+#define ASYNCRINGBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Contiguous region of an AsyncRingBuffer.
+struct AsyncRingSpan {
+  char *data;
+  size_t len;
+};
+
+/*
+  Byte ring buffer that hands out its readable and writable regions as at
+  most two contiguous spans. Producers copy (or receive) straight into
+  writeSpans() and commit(), consumers pass readSpans() on (e.g. to
+  tcp_write()) and consume(), so no intermediate array is needed.
+  The storage is a single allocation, made on first use.
+*/
+class AsyncRingBuffer {
+  private:
+    char *_buf;
+    size_t _size;
+    size_t _head;   // read position
+    size_t _len;    // readable bytes
+
+    AsyncRingBuffer(const AsyncRingBuffer &);
+    AsyncRingBuffer &operator=(const AsyncRingBuffer &);
+
+  public:
+    AsyncRingBuffer(size_t capacity = 0);
+    ~AsyncRingBuffer();
+
+    bool resize(size_t capacity);   // never drops data, fails below available()
+    bool reserve(size_t room);      // grow (doubling) until room() >= room
+    void clear(){ _head = 0; _len = 0; }
+    void linearize();               // make the readable data a single span, in place
+
+    size_t capacity() const { return _size; }
+    size_t available() const { return _len; }
+    size_t room() const { return _size - _len; }
+    bool empty() const { return _len == 0; }
+    bool full() const { return _len == _size; }
+
+    size_t readSpans(AsyncRingSpan spans[2]) const;   // returns the number of spans filled
+    size_t writeSpans(AsyncRingSpan spans[2]) const;
+    void consume(size_t len);   // drop len bytes from the read side
+    void commit(size_t len);    // make len bytes written into writeSpans() readable
+
+    size_t write(const char *data, size_t len);
+    size_t peek(char *dst, size_t len) const;
+    size_t read(char *dst, size_t len);
+    int peek() const;
+    int read();
+};
+
+#endif /* ASYNCRINGBUFFER_H_ */
@@ -0,0 +1,84 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include "AsyncTCPStats.h"
+
+void AsyncHistogram::reset(){
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+  min = 0;
+  max = 0;
+  sum = 0;
+}
+
+void AsyncHistogram::add(uint32_t value){
+  size_t bucket = value ? (32 - __builtin_clz(value)) : 0;
+  if(bucket >= ASYNC_HISTOGRAM_BUCKETS)
+    bucket = ASYNC_HISTOGRAM_BUCKETS - 1;
+  buckets[bucket]++;
+  if(!count || value < min)
+    min = value;
+  if(value > max)
+    max = value;
+  count++;
+  sum += value;
+}
+
+void AsyncHistogram::merge(const AsyncHistogram &other){
+  if(!other.count)
+    return;
+  for(size_t i = 0; i < ASYNC_HISTOGRAM_BUCKETS; i++)
+    buckets[i] += other.buckets[i];
+  if(!count || other.min < min)
+    min = other.min;
+  if(other.max > max)
+    max = other.max;
+  count += other.count;
+  sum += other.sum;
+}
+
+uint32_t AsyncHistogram::bucketLimit(size_t bucket){
+  if(bucket == 0)
+    return 0;
+  if(bucket >= ASYNC_HISTOGRAM_BUCKETS - 1 || bucket >= 32)
+    return UINT32_MAX;
+  return (1UL << bucket) - 1;
+}
+
+uint32_t AsyncHistogram::percentile(uint8_t pct) const {
+  if(!count)
+    return 0;
+  if(pct > 100)
+    pct = 100;
+  uint64_t target = ((uint64_t)count * pct + 99) / 100;
+  if(!target)
+    target = 1;
+  uint64_t seen = 0;
+  for(size_t i = 0; i < ASYNC_HISTOGRAM_BUCKETS; i++){
+    seen += buckets[i];
+    if(seen >= target){
+      uint32_t limit = bucketLimit(i);
+      return (limit > max) ? max : limit;
+    }
+  }
+  return max;
+}
@@ -0,0 +1,68 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ASYNCTCPSTATS_H_
+#define ASYNCTCPSTATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ASYNC_HISTOGRAM_BUCKETS
+#define ASYNC_HISTOGRAM_BUCKETS 16
+#endif
+
+/*
+  Fixed log2 histogram of millisecond samples. Bucket 0 counts zeros,
+  bucket i counts [2^(i-1), 2^i), the last bucket everything above.
+  Recording is a count-leading-zeros and an increment, so it is cheap
+  enough to run on every ack.
+*/
+class AsyncHistogram {
+  public:
+    uint32_t buckets[ASYNC_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+
+    AsyncHistogram(){ reset(); }
+    void reset();
+    void add(uint32_t value);
+    void merge(const AsyncHistogram &other);
+
+    uint32_t mean() const { return count ? (uint32_t)(sum / count) : 0; }
+    // Upper bound of the bucket holding the given percentile (0-100),
+    // clamped to the observed max.
+    uint32_t percentile(uint8_t pct) const;
+    static uint32_t bucketLimit(size_t bucket);
+};
+
+// Timing statistics collected by AsyncClient and AsyncServer, all in ms.
+struct AsyncTCPStats {
+  AsyncHistogram ack;   // time from send to ack, per acked segment run
+  AsyncHistogram rtt;   // smoothed RTT estimate of the pcb (sa)
+  AsyncHistogram rto;   // retransmission timeout of the pcb
+
+  void reset(){ ack.reset(); rtt.reset(); rto.reset(); }
+  void merge(const AsyncTCPStats &other){ ack.merge(other.ack); rtt.merge(other.rtt); rto.merge(other.rto); }
+};
+
+#endif /* ASYNCTCPSTATS_H_ */
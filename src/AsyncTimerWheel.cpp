@@ -0,0 +1,202 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "Arduino.h"
+#include "AsyncTimerWheel.h"
+extern "C"{
+  #include "osapi.h"
+}
+
+AsyncTimer *AsyncTimerWheel::_slots[ASYNC_TIMER_LEVELS][ASYNC_TIMER_SLOTS];
+uint32_t AsyncTimerWheel::_now = 0;
+uint32_t AsyncTimerWheel::_last_ms = 0;
+size_t AsyncTimerWheel::_count = 0;
+uint32_t AsyncTimerWheel::_wake = 0;
+bool AsyncTimerWheel::_running = false;
+static os_timer_t _wheel_timer;
+
+AsyncTimer::AsyncTimer(AsyncTimerFn fn, void *arg)
+  : _next(NULL)
+  , _pprev(NULL)
+  , _expires(0)
+  , _fn(fn)
+  , _arg(arg)
+{}
+
+void AsyncTimer::arm(uint32_t ms){
+  AsyncTimerWheel::remove(this);
+  AsyncTimerWheel::add(this, ms);
+}
+
+void AsyncTimer::cancel(){
+  AsyncTimerWheel::remove(this);
+}
+
+uint32_t AsyncTimer::remaining() const {
+  return AsyncTimerWheel::remaining(this);
+}
+
+/*
+  File a timer in the lowest level whose span covers its distance. Level n
+  is indexed by bits [6n, 6n+6) of the expiry tick, so the slot comes up (and
+  is cascaded) no later than the timer is due. Anything beyond the last
+  level waits in its farthest slot and is filed again from there.
+*/
+void AsyncTimerWheel::_insert(AsyncTimer *t){
+  uint32_t delta = t->_expires - _now;
+  uint32_t when = t->_expires;
+  size_t level = 0;
+  while(level < ASYNC_TIMER_LEVELS - 1 && delta >= ((uint32_t)1 << (ASYNC_TIMER_BITS * (level + 1))))
+    level++;
+  if(delta >= ((uint32_t)1 << (ASYNC_TIMER_BITS * ASYNC_TIMER_LEVELS)))
+    when = _now + ((uint32_t)1 << (ASYNC_TIMER_BITS * ASYNC_TIMER_LEVELS)) - 1;
+  AsyncTimer **head = &_slots[level][(when >> (ASYNC_TIMER_BITS * level)) & (ASYNC_TIMER_SLOTS - 1)];
+  t->_next = *head;
+  if(t->_next)
+    t->_next->_pprev = &t->_next;
+  *head = t;
+  t->_pprev = head;
+}
+
+void AsyncTimerWheel::_cascade(size_t level){
+  AsyncTimer **head = &_slots[level][(_now >> (ASYNC_TIMER_BITS * level)) & (ASYNC_TIMER_SLOTS - 1)];
+  AsyncTimer *t = *head;
+  *head = NULL;
+  while(t){
+    AsyncTimer *next = t->_next;
+    _insert(t);
+    t = next;
+  }
+}
+
+void AsyncTimerWheel::_tick(){
+  _now++;
+  if((_now & (ASYNC_TIMER_SLOTS - 1)) == 0){
+    // Higher levels first, what they hand down may be due for the next one.
+    size_t top = 1;
+    while(top < ASYNC_TIMER_LEVELS - 1 && ((_now >> (ASYNC_TIMER_BITS * top)) & (ASYNC_TIMER_SLOTS - 1)) == 0)
+      top++;
+    for(size_t level = top; level > 0; level--)
+      _cascade(level);
+  }
+  // Everything in this slot is due now; a callback can only arm timers for
+  // later ticks, so the loop ends.
+  AsyncTimer **head = &_slots[0][_now & (ASYNC_TIMER_SLOTS - 1)];
+  while(*head){
+    AsyncTimer *t = *head;
+    remove(t);
+    t->_fn(t, t->_arg);
+  }
+}
+
+/*
+  First tick after _now with work filed for it: the next busy slot of level
+  0, or the next slot of a higher level that has timers to cascade. The
+  ticks before it are empty and can be skipped.
+*/
+uint32_t AsyncTimerWheel::_nextTick(){
+  uint32_t next = _now + ((uint32_t)1 << (ASYNC_TIMER_BITS * ASYNC_TIMER_LEVELS));
+  for(size_t level = 0; level < ASYNC_TIMER_LEVELS; level++){
+    size_t shift = ASYNC_TIMER_BITS * level;
+    for(uint32_t k = 1; k <= ASYNC_TIMER_SLOTS; k++){
+      uint32_t slot = (_now >> shift) + k;
+      if(_slots[level][slot & (ASYNC_TIMER_SLOTS - 1)]){
+        if((int32_t)((slot << shift) - next) < 0)
+          next = slot << shift;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+// Arm the one-shot os_timer for the given tick, or for the end of the wheel
+// for a timer parked beyond it.
+void AsyncTimerWheel::_wakeAt(uint32_t tick){
+  uint32_t span = (uint32_t)1 << (ASYNC_TIMER_BITS * ASYNC_TIMER_LEVELS);
+  if(tick - _now >= span)
+    tick = _now + span - 1;
+  uint32_t ms = (tick - _now) * ASYNC_TIMER_TICK;
+  uint32_t elapsed = millis() - _last_ms;
+  _wake = tick;
+  os_timer_arm(&_wheel_timer, (ms > elapsed) ? (ms - elapsed) : 0, false);
+}
+
+void AsyncTimerWheel::_s_run(void *arg){
+  (void)arg;
+  uint32_t now = millis();
+  while(now - _last_ms >= ASYNC_TIMER_TICK){
+    uint32_t behind = (now - _last_ms) / ASYNC_TIMER_TICK - 1;
+    if(behind){
+      uint32_t skip = _nextTick() - _now - 1;
+      if(skip > behind)
+        skip = behind;
+      _now += skip;
+      _last_ms += skip * ASYNC_TIMER_TICK;
+    }
+    _last_ms += ASYNC_TIMER_TICK;
+    _tick();
+  }
+  if(_count == 0)
+    _running = false;
+  else
+    _wakeAt(_nextTick());
+}
+
+void AsyncTimerWheel::add(AsyncTimer *t, uint32_t ms){
+  bool idle = !_running;
+  if(idle){
+    _last_ms = millis();
+    os_timer_setfn(&_wheel_timer, &_s_run, NULL);
+    _running = true;
+  }
+  // Count from _last_ms, the time of the current tick, so it never fires early.
+  uint32_t elapsed = millis() - _last_ms;
+  uint32_t ticks = ms / ASYNC_TIMER_TICK + (ms % ASYNC_TIMER_TICK + elapsed + ASYNC_TIMER_TICK - 1) / ASYNC_TIMER_TICK;
+  if(ticks == 0)
+    ticks = 1;
+  t->_expires = _now + ticks;
+  _insert(t);
+  _count++;
+  // Waking at the expiry is enough, _s_run() does any cascade due before it.
+  // Inside _s_run() _wake is already behind and the re-arm is left to it.
+  if(idle || (int32_t)(t->_expires - _wake) < 0)
+    _wakeAt(t->_expires);
+}
+
+void AsyncTimerWheel::remove(AsyncTimer *t){
+  if(t->_pprev == NULL)
+    return;
+  *t->_pprev = t->_next;
+  if(t->_next)
+    t->_next->_pprev = t->_pprev;
+  t->_next = NULL;
+  t->_pprev = NULL;
+  _count--;
+}
+
+uint32_t AsyncTimerWheel::remaining(const AsyncTimer *t){
+  if(t->_pprev == NULL)
+    return 0;
+  uint32_t ms = (t->_expires - _now) * ASYNC_TIMER_TICK;
+  uint32_t elapsed = millis() - _last_ms;
+  return (ms > elapsed) ? (ms - elapsed) : 0;
+}
@@ -0,0 +1,103 @@
+/*
+  Asynchronous TCP library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ASYNCTIMERWHEEL_H_
+#define ASYNCTIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ASYNC_TIMER_TICK
+#define ASYNC_TIMER_TICK 10   // ms per tick of the timer wheel
+#endif
+
+class AsyncTimer;
+typedef void (*AsyncTimerFn)(AsyncTimer *timer, void *arg);
+
+/*
+  One-shot timer, meant to be embedded in the object it times. Arming and
+  cancelling unlink/link it in a wheel slot, so both are O(1) whatever the
+  number of timers. The callback runs from the system timer, never early,
+  and at most one tick late.
+*/
+class AsyncTimer {
+  private:
+    friend class AsyncTimerWheel;
+    AsyncTimer *_next;
+    AsyncTimer **_pprev;    // link pointing at us, NULL while not armed
+    uint32_t _expires;      // wheel tick
+    AsyncTimerFn _fn;
+    void *_arg;
+
+    AsyncTimer(const AsyncTimer &);
+    AsyncTimer &operator=(const AsyncTimer &);
+
+  public:
+    AsyncTimer(AsyncTimerFn fn, void *arg);
+    ~AsyncTimer(){ cancel(); }
+
+    void arm(uint32_t ms);  // (re)start, fires after at least ms
+    void cancel();
+    bool armed() const { return _pprev != NULL; }
+    uint32_t remaining() const; // ms until it fires, 0 when not armed
+};
+
+/*
+  Hierarchical timer wheel shared by all AsyncTimers: ASYNC_TIMER_LEVELS
+  levels of 64 slots, each level's slot spanning a whole turn of the level
+  below, so with the default 10 ms tick it covers 0.64 s, 41 s and 43 min
+  before timers are parked in the last level and re-filed. Timers are
+  cascaded down a level as their slot comes up. The wheel advances from a
+  one-shot os_timer armed for the next tick that has a slot to run or
+  cascade, so armed timers far off do not wake the CPU every tick, and the
+  empty ticks in between are skipped without looking at the idle timers.
+*/
+#define ASYNC_TIMER_LEVELS 3
+#define ASYNC_TIMER_BITS 6
+#define ASYNC_TIMER_SLOTS (1 << ASYNC_TIMER_BITS)
+
+class AsyncTimerWheel {
+  private:
+    static AsyncTimer *_slots[ASYNC_TIMER_LEVELS][ASYNC_TIMER_SLOTS];
+    static uint32_t _now;       // last processed tick
+    static uint32_t _last_ms;   // millis() of _now
+    static uint32_t _wake;      // tick the os_timer is armed for
+    static size_t _count;
+    static bool _running;
+
+    static void _insert(AsyncTimer *t);
+    static void _cascade(size_t level);
+    static void _tick();
+    static uint32_t _nextTick();
+    static void _wakeAt(uint32_t tick);
+    static void _s_run(void *arg);
+
+  protected:
+    friend class AsyncTimer;
+    static void add(AsyncTimer *t, uint32_t ms);
+    static void remove(AsyncTimer *t);
+    static uint32_t remaining(const AsyncTimer *t);
+
+  public:
+    static size_t armed(){ return _count; }
+};
+
+#endif /* ASYNCTIMERWHEEL_H_ */
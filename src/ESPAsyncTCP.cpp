@@ -83,6 +83,10 @@ extern "C"{
 }
 #include <tcp_axtls.h>
 
+#ifndef DEBUG_MORE
+static_assert(sizeof(AsyncClient) <= ASYNC_CLIENT_FOOTPRINT_MAX, "AsyncClient outgrew ASYNC_CLIENT_FOOTPRINT_MAX, see async_config.h");
+#endif
+
 /*
   Async Client Error Return Tracker
 */
@@ -91,13 +95,25 @@ extern "C"{
 
 ACErrorTracker::ACErrorTracker(AsyncClient *c):
     _client(c)
-  , _close_error(ERR_OK)
-  , _errored(EE_OK)
-#ifdef DEBUG_MORE
-  , _error_event_cb(NULL)
-  , _error_event_cb_arg(NULL)
-#endif
-{}
+  , _state(&c->_errorState)
+  , _outer(c->_trackers)
+{
+  c->_trackers = this;
+}
+
+// Guards nest strictly (they are stack objects), so a live one is always
+// the innermost of its client.
+ACErrorTracker::~ACErrorTracker(){
+  if(_client)
+    _client->_trackers = _outer;
+}
+
+// Called for each live guard by ~AsyncClient().
+void ACErrorTracker::_detach(){
+  _saved = *_state;
+  _state = &_saved;
+  _client = NULL;
+}
 
 #ifdef DEBUG_MORE
 /**
@@ -105,28 +121,28 @@ ACErrorTracker::ACErrorTracker(AsyncClient *c):
  * errored out connections. Used from AsyncServer.
  */
 void ACErrorTracker::onErrorEvent(AsNotifyHandler cb, void *arg) {
-  _error_event_cb = cb;
-  _error_event_cb_arg = arg;
+  _state->error_event_cb = cb;
+  _state->error_event_cb_arg = arg;
 }
 #endif
 
-void ACErrorTracker::setCloseError(err_t e) {
+void ACErrorState::setCloseError(err_t e) {
   if (e != ERR_OK)
-    ASYNC_TCP_DEBUG("setCloseError() to: %s(%ld)\n", _client->errorToString(e), e);
-  if(_errored == EE_OK)
-    _close_error = e;
+    ASYNC_TCP_DEBUG("setCloseError() to: %s(%ld)\n", AsyncClient::errorToString(e), e);
+  if(errored == EE_OK)
+    close_error = e;
 }
 /**
  * Called mainly by callback routines, called when err is not ERR_OK.
  * This prevents the possiblity of aborting an already errored out
  * connection.
  */
-void ACErrorTracker::setErrored(size_t errorEvent){
-  if(EE_OK == _errored)
-    _errored = errorEvent;
+void ACErrorState::setErrored(size_t errorEvent){
+  if(EE_OK == errored)
+    errored = errorEvent;
 #ifdef DEBUG_MORE
-  if (_error_event_cb)
-    _error_event_cb(_error_event_cb_arg, errorEvent);
+  if (error_event_cb)
+    error_event_cb(error_event_cb_arg, errorEvent);
 #endif
 }
 /**
@@ -134,12 +150,311 @@ void ACErrorTracker::setErrored(size_t errorEvent){
  * reporting. ERR_ABRT is only reported/returned once; thereafter ERR_OK
  * is always returned.
  */
-err_t ACErrorTracker::getCallbackCloseError(void){
-  if (EE_OK != _errored)
+err_t ACErrorState::getCallbackCloseError(void){
+  if (EE_OK != errored)
     return ERR_OK;
-  if (ERR_ABRT == _close_error)
+  if (ERR_ABRT == close_error)
     setErrored(EE_ABORTED);
-  return _close_error;
+  return close_error;
+}
+
+/*
+  Token bucket for send pacing
+*/
+// A burst of 0 picks half a second worth of data, which is how much the send
+// queue needs to keep going between two _poll() calls.
+void AsyncTokenBucket::configure(uint32_t rate, uint32_t burst){
+  _rate = rate;
+  if(burst == 0)
+    burst = rate / 2;
+  if(burst < TCP_MSS)
+    burst = TCP_MSS;
+  _burst = burst;
+  _tokens = burst;
+  _stamp = millis();
+}
+
+size_t AsyncTokenBucket::available(uint32_t now){
+  if(_rate == 0)
+    return SIZE_MAX;
+  uint32_t elapsed = now - _stamp;
+  uint64_t earned = ((uint64_t)elapsed * _rate) / 1000;
+  if(earned){
+    // Only move the stamp by the time that was paid out, so slow rates
+    // still add up when we are called often.
+    if(earned >= _burst - _tokens){
+      _tokens = _burst;
+      _stamp = now;
+    } else {
+      _tokens += earned;
+      _stamp += (uint32_t)((earned * 1000) / _rate);
+    }
+  }
+  return _tokens;
+}
+
+void AsyncTokenBucket::take(size_t len){
+  if(_rate == 0)
+    return;
+  _tokens = (len < _tokens) ? (_tokens - len) : 0;
+}
+
+/*
+  Send scheduler
+*/
+size_t AsyncSendScheduler::_budget = 0;
+size_t AsyncSendScheduler::_inflight = 0;
+bool AsyncSendScheduler::_running = false;
+AsyncClient *AsyncSendScheduler::_head[AC_PRIO_CLASSES] = { NULL };
+AsyncClient *AsyncSendScheduler::_tail[AC_PRIO_CLASSES] = { NULL };
+
+// PBUF_FLAG_PUSH is only set on the last pbuf of a chain.
+static inline u8_t _chainFlags(pbuf *pb){
+  while(pb->next)
+    pb = pb->next;
+  return pb->flags;
+}
+
+static inline uint8_t _tcpPrio(uint8_t cls){
+  return (cls == AC_PRIO_CONTROL) ? TCP_PRIO_MAX : TCP_PRIO_MIN;
+}
+
+void AsyncSendScheduler::setBudget(size_t bytes){
+  _budget = bytes;
+  if(bytes)
+    return;
+  // Disabled: every waiting connection goes back to draining itself.
+  for(size_t cls = 0; cls < AC_PRIO_CLASSES; cls++){
+    while(_head[cls]){
+      AsyncClient *c = _head[cls];
+      detach(c);
+      ACErrorTracker errorTracker(c);
+      c->_drainQueue();
+    }
+  }
+}
+
+void AsyncSendScheduler::activate(AsyncClient *c){
+  if(c->_sched_active)
+    return;
+  ac_client_tx *tx = c->_tx;  // there is a queue, so there is send state
+  uint8_t cls = c->_prio_class;
+  c->_sched_active = true;
+  tx->sched_next = NULL;
+  tx->sched_prev = _tail[cls];
+  if(_tail[cls])
+    _tail[cls]->_tx->sched_next = c;
+  else
+    _head[cls] = c;
+  _tail[cls] = c;
+}
+
+void AsyncSendScheduler::detach(AsyncClient *c){
+  if(!c->_sched_active)
+    return;
+  ac_client_tx *tx = c->_tx;
+  uint8_t cls = c->_prio_class;
+  if(tx->sched_prev)
+    tx->sched_prev->_tx->sched_next = tx->sched_next;
+  else
+    _head[cls] = tx->sched_next;
+  if(tx->sched_next)
+    tx->sched_next->_tx->sched_prev = tx->sched_prev;
+  else
+    _tail[cls] = tx->sched_prev;
+  tx->sched_prev = NULL;
+  tx->sched_next = NULL;
+  c->_sched_active = false;
+}
+
+void AsyncSendScheduler::release(size_t len){
+  _inflight = (len < _inflight) ? (_inflight - len) : 0;
+}
+
+/*
+  Deficit round robin: a connection earns weight * ASYNC_SCHED_QUANTUM per
+  turn and may drain that much of its queue, bounded by the budget left.
+  What it could not use is kept for its next turn, but never more than one
+  quantum, so a connection held back by its window does not burst once the
+  window opens. Connections that could not send (no window, paced) leave
+  the round and rejoin from their own _sent()/_poll().
+*/
+void AsyncSendScheduler::run(){
+  if(_running)
+    return;
+  _running = true;
+  for(int cls = AC_PRIO_CLASSES - 1; cls >= 0; cls--){
+    while(_head[cls] && _inflight < _budget){
+      AsyncClient *c = _head[cls];
+      detach(c);
+      ac_client_tx *tx = c->_tx;
+      uint32_t quantum = (uint32_t)ASYNC_SCHED_QUANTUM * c->_weight;
+      tx->deficit += quantum;
+      if(tx->deficit > quantum)
+        tx->deficit = quantum;
+      size_t limit = _budget - _inflight;
+      if(limit > tx->deficit)
+        limit = tx->deficit;
+      uint32_t start = tx->added_total;
+      ACErrorTracker errorTracker(c);
+      size_t sent = c->_drainQueue(limit);
+      if(!errorTracker.hasClient())
+        continue;
+      // the budget counts stream bytes, which on SSL include record overhead
+      size_t wire = tx->added_total - start;
+      _inflight += wire;
+      c->_schedSent(wire);
+      tx->deficit -= sent;
+      if(c->_queueEmpty() || sent == 0)
+        tx->deficit = 0;
+      else
+        activate(c);
+    }
+  }
+  _running = false;
+}
+
+/*
+  Client pool
+*/
+#define AC_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+AsyncClientPool *AsyncClientPool::_pools = NULL;
+const char *AsyncClientPool::_lo = NULL;
+const char *AsyncClientPool::_hi = NULL;
+
+AsyncClientPool::AsyncClientPool(size_t capacity)
+  : _mem(NULL)
+  , _state(NULL)
+  , _free(NULL)
+  , _capacity(0)
+  , _slot_size(AC_ALIGN(sizeof(AsyncClient)))
+  , _used(0)
+  , _high_water(0)
+  , _misses(0)
+  , _orphan(false)
+  , _next(NULL)
+{
+  _mem = (char*)malloc(capacity * _slot_size + capacity);
+  if(_mem){
+    _state = (uint8_t*)(_mem + capacity * _slot_size);
+    memset(_state, 0, capacity);
+    _capacity = capacity;
+    for(size_t i = capacity; i > 0; i--){
+      *(void**)_slot(i - 1) = _free;
+      _free = _slot(i - 1);
+    }
+  }
+}
+
+AsyncClientPool::~AsyncClientPool(){
+  AsyncClientPool **link = &_pools;
+  while(*link && *link != this)
+    link = &(*link)->_next;
+  if(*link)
+    *link = _next;
+  ::free(_mem);
+  _span();
+}
+
+AsyncClientPool *AsyncClientPool::make(size_t capacity){
+  AsyncClientPool *pool = new (std::nothrow) AsyncClientPool(capacity);
+  if(pool && !pool->_mem){
+    delete pool;
+    return NULL;
+  }
+  if(pool){
+    pool->_next = _pools;
+    _pools = pool;
+    _span();
+  }
+  return pool;
+}
+
+void AsyncClientPool::_span(){
+  _lo = NULL;
+  _hi = NULL;
+  for(AsyncClientPool *pool = _pools; pool != NULL; pool = pool->_next){
+    const char *end = pool->_mem + pool->_capacity * pool->_slot_size;
+    if(!_lo || pool->_mem < _lo)
+      _lo = pool->_mem;
+    if(!_hi || end > _hi)
+      _hi = end;
+  }
+}
+
+void AsyncClientPool::destroy(){
+  if(_used)
+    _orphan = true;
+  else
+    delete this;
+}
+
+AsyncClientPool *AsyncClientPool::_find(const void *p, size_t *index){
+  for(AsyncClientPool *pool = _pools; pool != NULL; pool = pool->_next){
+    const char *c = (const char*)p;
+    if(c >= pool->_mem && c < pool->_mem + pool->_capacity * pool->_slot_size){
+      *index = (c - pool->_mem) / pool->_slot_size;
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+void AsyncClientPool::_clear(size_t index){
+  if(!_state[index])
+    return;
+  _state[index] = 0;
+  *(void**)_slot(index) = _free;
+  _free = _slot(index);
+  _used--;
+  if(_orphan && _used == 0)
+    delete this;
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+AsyncClient *AsyncClientPool::create(tcp_pcb *pcb, SSL_CTX *ssl_ctx){
+#else
+AsyncClient *AsyncClientPool::create(tcp_pcb *pcb){
+#endif
+  void *slot = _free;
+  if(!slot){
+    _misses++;
+    return NULL;
+  }
+  _free = *(void**)slot;
+  _state[((char*)slot - _mem) / _slot_size] = 1;
+  if(++_used > _high_water)
+    _high_water = _used;
+#if ASYNC_TCP_SSL_ENABLED
+  return new (slot) AsyncClient(pcb, ssl_ctx);
+#else
+  return new (slot) AsyncClient(pcb);
+#endif
+}
+
+bool AsyncClientPool::release(void *p){
+  if((const char*)p < _lo || (const char*)p >= _hi)
+    return false;
+  size_t index;
+  AsyncClientPool *pool = _find(p, &index);
+  if(!pool)
+    return false;
+  pool->_clear(index);
+  return true;
+}
+
+void *AsyncClient::operator new(size_t size){
+  return ::operator new(size);
+}
+
+void *AsyncClient::operator new(size_t size, const std::nothrow_t &tag) noexcept {
+  return ::operator new(size, tag);
+}
+
+void AsyncClient::operator delete(void *p){
+  if(!AsyncClientPool::release(p))
+    ::operator delete(p);
 }
 
 /*
@@ -149,6 +464,17 @@ err_t ACErrorTracker::getCallbackCloseError(void){
 static size_t _connectionCount=0;
 #endif
 
+// Release record for a fragment queued with addv(). "end" is the value
+// ac_client_tx::acked_total must reach before the fragment is no longer referenced.
+struct ac_release_item {
+    uint32_t end;
+    AcReleaseHandler cb;
+    void *arg;
+    const char *data;
+    size_t len;
+    struct ac_release_item *next;
+};
+
 #if ASYNC_TCP_SSL_ENABLED
 AsyncClient::AsyncClient(tcp_pcb* pcb, SSL_CTX * ssl_ctx):
 #else
@@ -164,36 +490,56 @@ AsyncClient::AsyncClient(tcp_pcb* pcb):
   , _error_cb_arg(0)
   , _recv_cb(0)
   , _recv_cb_arg(0)
-  , _pb_cb(0)
-  , _pb_cb_arg(0)
-  , _timeout_cb(0)
-  , _timeout_cb_arg(0)
-  , _poll_cb(0)
-  , _poll_cb_arg(0)
-  , _pcb_busy(false)
-#if ASYNC_TCP_SSL_ENABLED
-  , _pcb_secure(false)
-  , _handshake_done(true)
-#endif
+  , _ext(NULL)
+  , _tx(NULL)
+  , _handlers(NULL)
+  , _handlers_arg(NULL)
   , _pcb_sent_at(0)
-  , _close_pcb(false)
-  , _ack_pcb(true)
+  , _pcb_sent_end(0)
   , _tx_unacked_len(0)
   , _tx_acked_len(0)
   , _rx_ack_len(0)
   , _rx_last_packet(0)
   , _rx_since_timeout(0)
   , _ack_timeout(ASYNC_MAX_ACK_TIME)
+  , _stats(NULL)
+  , _server(NULL)
+  , _srv_prev(NULL)
+  , _srv_next(NULL)
+  , _trackers(NULL)
+  , _timer(&_s_timer, this)
   , _connect_port(0)
   , _recv_pbuf_flags(0)
-  , _errorTracker(NULL)
+  , _prio_class(AC_PRIO_NORMAL)
+  , _weight(1)
+  , _writable_armed(false)
+  , _pcb_busy(false)
+#if ASYNC_TCP_SSL_ENABLED
+  , _pcb_secure(false)
+  , _handshake_done(true)
+#endif
+  , _close_pcb(false)
+  , _ack_pcb(true)
+  , _cork(false)
+  , _sched_active(false)
   , prev(NULL)
   , next(NULL)
 {
+  // set up first, a failed TLS setup below records its close error here
+  _errorState.close_error = ERR_OK;
+  _errorState.errored = EE_OK;
+#if DEBUG_ESP_ASYNC_TCP
+  _errorState.connectionId = ++_connectionCount;
+#endif
+#ifdef DEBUG_MORE
+  _errorState.error_event_cb = NULL;
+  _errorState.error_event_cb_arg = NULL;
+#endif
+
   _pcb = pcb;
   if(_pcb){
     _rx_last_packet = millis();
-    tcp_setprio(_pcb, TCP_PRIO_MIN);
+    tcp_setprio(_pcb, _tcpPrio(_prio_class));
     tcp_arg(_pcb, this);
     tcp_recv(_pcb, &_s_recv);
     tcp_sent(_pcb, &_s_sent);
@@ -214,19 +560,85 @@ AsyncClient::AsyncClient(tcp_pcb* pcb):
       _handshake_done = false;
     }
 #endif
+    _armTimeouts();
   }
-
-  _errorTracker = std::make_shared<ACErrorTracker>(this);
-#if DEBUG_ESP_ASYNC_TCP
-  _errorTracker->setConnectionId(++_connectionCount);
-#endif
 }
 
 AsyncClient::~AsyncClient(){
   if(_pcb)
     _close();
+  _releaseFragments(true);
+  _clearQueue();
+  _freeHold();
+  _serverDetach();
+  if(_tx)
+    delete _tx->bucket;
+  delete _stats;
+
+  for(ACErrorTracker *t = _trackers; t != NULL; t = t->_outer)
+    t->_detach();
+  delete _ext;
+  delete _tx;
+}
+
+/*
+  Returns the side table for the rarely used callbacks, allocating it when
+  create is set. Clearing a callback that was never set allocates nothing.
+*/
+ac_client_ext *AsyncClient::_extend(bool create){
+  if(_ext || !create)
+    return _ext;
+  _ext = new (std::nothrow) ac_client_ext();
+  if(_ext){
+    _ext->writable_low = ASYNC_WRITABLE_LOW;
+    _ext->writable_high = ASYNC_WRITABLE_HIGH;
+  } else {
+    ASYNC_TCP_DEBUG("_extend[%u]: out of memory for callbacks\n", getConnectionId());
+  }
+  return _ext;
+}
 
-  _errorTracker->clearClient();
+/*
+  Same for the send side state. The release records count bytes from here
+  on, so what is already in flight is owed to the ack counter first.
+*/
+ac_client_tx *AsyncClient::_txState(bool create){
+  if(_tx || !create)
+    return _tx;
+  _tx = new (std::nothrow) ac_client_tx();
+  if(_tx){
+    _tx->acked_total = 0 - _tx_unacked_len;
+#if ASYNC_TCP_SSL_ENABLED
+    // acks of a secure connection count records, handshake included
+    if(_pcb && _pcb_secure)
+      _tx->acked_total = 0 - (_pcb->snd_lbb - _pcb->lastack);
+#endif
+  } else {
+    ASYNC_TCP_DEBUG("_txState[%u]: out of memory for the send state\n", getConnectionId());
+  }
+  return _tx;
+}
+
+/*
+  SyncClient and AsyncTCPbuffer dispatch the callbacks they would otherwise
+  keep in the side table through a table of their own, with owner handed to
+  the hooks through _handlers_arg. Fails when the client already has a
+  table, i.e. it is an AsyncClientT; the caller falls back to onPacket() and
+  friends then.
+*/
+bool AsyncClient::_bindHandlers(const AcHandlerTable *table, void *owner){
+  if(_handlers && _handlers != table)
+    return false;
+  _handlers = table;
+  _handlers_arg = owner;
+  return true;
+}
+
+void AsyncClient::_unbindHandlers(const AcHandlerTable *table){
+  if(_handlers != table)
+    return;
+  _handlers = NULL;
+  _handlers_arg = NULL;
 }
 
 inline void clearTcpCallbacks(tcp_pcb* pcb){
@@ -257,7 +669,7 @@ bool AsyncClient::connect(IPAddress ip, uint16_t port){
     return false;
   }
 
-  tcp_setprio(pcb, TCP_PRIO_MIN);
+  tcp_setprio(pcb, _tcpPrio(_prio_class));
 #if ASYNC_TCP_SSL_ENABLED
   _pcb_secure = secure;
   _handshake_done = !secure;
@@ -297,14 +709,16 @@ AsyncClient& AsyncClient::operator=(const AsyncClient& other){
     ASYNC_TCP_DEBUG("operator=[%u]: Abandoned _pcb(0x%" PRIXPTR ") forced close.\n", getConnectionId(), uintptr_t(_pcb));
     _close();
   }
-  _errorTracker = other._errorTracker;
+  _errorState = other._errorState;
 
   // I am confused when "other._pcb" falls out of scope the destructor will
   // close it? TODO: Look to see where this is used and how it might work.
   _pcb = other._pcb;
+  if(_tx)
+    _tx->mark_count = 0;
   if (_pcb) {
     _rx_last_packet = millis();
-    tcp_setprio(_pcb, TCP_PRIO_MIN);
+    tcp_setprio(_pcb, _tcpPrio(_prio_class));
     tcp_arg(_pcb, this);
     tcp_recv(_pcb, &_s_recv);
     tcp_sent(_pcb, &_s_sent);
@@ -323,6 +737,7 @@ AsyncClient& AsyncClient::operator=(const AsyncClient& other){
       _handshake_done = true;
     }
 #endif
+    _armTimeouts();
   }
   return *this;
 }
@@ -345,9 +760,18 @@ void AsyncClient::abort(){
   // 6) Callbacks to _recv() or _connected() with err set, will result in _pcb
   //    set to NULL. Thus, preventing possible calls later to tcp_abort().
   if(_pcb) {
+    // tcp_abort() reports ERR_ABRT to _s_error(), whose onDisconnect handler
+    // may delete this client.
+    ACErrorTracker errorTracker(this);
     tcp_abort(_pcb);
+    if(!errorTracker.hasClient())
+      return;
     _pcb = NULL;
     setCloseError(ERR_ABRT);
+    _releaseFragments(true);
+    _clearQueue();
+    _freeHold();
+    _serverDetach();
   }
   return;
 }
@@ -389,6 +813,14 @@ size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags) {
   return will_send;
 }
 
+size_t AsyncClient::writev(const AcSendFragment *frags, size_t count, uint8_t apiflags) {
+  size_t will_send = addv(frags, count, apiflags);
+
+  if(!will_send || !send())
+    return 0;
+  return will_send;
+}
+
 size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
   if(!_pcb || size == 0 || data == NULL)
     return 0;
@@ -397,9 +829,12 @@ size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
     return 0;
 #if ASYNC_TCP_SSL_ENABLED
   if(_pcb_secure){
+    uint32_t end = _pcb->snd_lbb;
     int sent = tcp_ssl_write(_pcb, (uint8_t*)data, size);
     if(sent >= 0){
       _tx_unacked_len += sent;
+      if(_tx)
+        _tx->added_total += _pcb->snd_lbb - end;
       return sent;
     }
     _close();
@@ -407,24 +842,608 @@ size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
   }
 #endif
   size_t will_send = (room < size) ? room : size;
+  if(_cork)
+    apiflags |= ASYNC_WRITE_FLAG_MORE;
   err_t err = tcp_write(_pcb, data, will_send, apiflags);
   if(err != ERR_OK) {
     ASYNC_TCP_DEBUG("_add[%u]: tcp_write() returned err: %s(%ld)\n", getConnectionId(), errorToString(err), err);
     return 0;
   }
   _tx_unacked_len += will_send;
+  if(_tx){
+    _tx->added_total += will_send;
+    if(_cork)
+      _tx->cork_pending += will_send;
+  }
   return will_send;
 }
 
+/*
+  Queue several fragments with one call. Fragments are written back to back
+  with ASYNC_WRITE_FLAG_MORE on all but the last one, so the whole set goes
+  out with a single send(). Nothing is queued unless all fragments fit in
+  space(). A fragment's release handler is called from _sent() once the acked
+  byte count covers it, or when the connection goes away. If tcp_write()
+  fails part way, the return value only covers the fragments that were
+  queued; the release handlers of the others are not called.
+*/
+size_t AsyncClient::addv(const AcSendFragment *frags, size_t count, uint8_t apiflags) {
+  if(!_pcb || frags == NULL || count == 0)
+    return 0;
+  size_t total = 0;
+  size_t last = 0;
+  bool release = false;
+  for(size_t i = 0; i < count; i++){
+    total += frags[i].len;
+    if(frags[i].len)
+      last = i;
+    if(frags[i].release)
+      release = true;
+  }
+  if(total == 0 || total > space())
+    return 0;
+#if ASYNC_TCP_SSL_ENABLED
+  if(_pcb_secure){
+    // tcp_ssl_write() encrypts into its own buffer, nothing stays referenced.
+    size_t sent = 0;
+    for(size_t i = 0; i < count; i++){
+      const AcSendFragment &f = frags[i];
+      if(f.len){
+        uint32_t end = _pcb->snd_lbb;
+        int w = tcp_ssl_write(_pcb, (uint8_t*)f.data, f.len);
+        if(w < 0){
+          _close();
+          return 0;
+        }
+        _tx_unacked_len += w;
+        if(_tx)
+          _tx->added_total += _pcb->snd_lbb - end;
+        sent += w;
+      }
+      if(f.release)
+        f.release(f.release_arg, f.data, f.len);
+    }
+    return sent;
+  }
+#endif
+  // Allocate the release records first, so we never queue data we could not track.
+  if(release && !_txState(true))
+    return 0;
+  ac_release_item *head = NULL;
+  ac_release_item *tail = NULL;
+  uint32_t end = _tx ? _tx->added_total : 0;
+  for(size_t i = 0; i < count; i++){
+    end += frags[i].len;
+    if(!frags[i].release)
+      continue;
+    ac_release_item *item = new (std::nothrow) ac_release_item;
+    if(item == NULL){
+      ASYNC_TCP_DEBUG("addv[%u]: out of memory for release records\n", getConnectionId());
+      while(head){
+        item = head;
+        head = head->next;
+        delete item;
+      }
+      return 0;
+    }
+    item->end = end;
+    item->cb = frags[i].release;
+    item->arg = frags[i].release_arg;
+    item->data = frags[i].data;
+    item->len = frags[i].len;
+    item->next = NULL;
+    if(tail)
+      tail->next = item;
+    else
+      head = item;
+    tail = item;
+  }
+
+  size_t queued = 0;
+  for(size_t i = 0; i < count; i++){
+    const AcSendFragment &f = frags[i];
+    if(f.len == 0)
+      continue;
+    uint8_t flags = apiflags | f.flags;
+    if(i != last || _cork)
+      flags |= ASYNC_WRITE_FLAG_MORE;
+    err_t err = tcp_write(_pcb, f.data, f.len, flags);
+    if(err != ERR_OK){
+      ASYNC_TCP_DEBUG("addv[%u]: tcp_write() returned err: %s(%ld)\n", getConnectionId(), errorToString(err), err);
+      break;
+    }
+    queued += f.len;
+  }
+  _tx_unacked_len += queued;
+  if(!_tx)
+    return queued;
+  _tx->added_total += queued;
+  if(_cork)
+    _tx->cork_pending += queued;
+
+  // Drop the records of fragments that did not make it into the stack.
+  ac_release_item **link = &head;
+  while(*link && (int32_t)(_tx->added_total - (*link)->end) >= 0)
+    link = &(*link)->next;
+  while(*link){
+    ac_release_item *item = *link;
+    *link = item->next;
+    delete item;
+  }
+  if(head){
+    if(_tx->release_tail)
+      _tx->release_tail->next = head;
+    else
+      _tx->release_head = head;
+    for(tail = head; tail->next; tail = tail->next);
+    _tx->release_tail = tail;
+  }
+  return queued;
+}
+
+/*
+  Call the release handlers of all fragments covered by the acked byte count,
+  or of every pending fragment when the connection is gone. The due records
+  are unlinked before any handler runs, since a handler may delete us.
+*/
+void AsyncClient::_releaseFragments(bool all){
+  if(!_tx)
+    return;
+  ac_release_item *due = _tx->release_head;
+  ac_release_item *prev = NULL;
+  ac_release_item *item = _tx->release_head;
+  while(item && (all || (int32_t)(_tx->acked_total - item->end) >= 0)){
+    prev = item;
+    item = item->next;
+  }
+  if(prev == NULL)
+    return;
+  prev->next = NULL;
+  _tx->release_head = item;
+  if(item == NULL)
+    _tx->release_tail = NULL;
+  while(due){
+    item = due;
+    due = due->next;
+    item->cb(item->arg, item->data, item->len);
+    delete item;
+  }
+}
+
+/*
+  Queue data without regard to space(). Whatever fits is handed to the stack
+  right away, the rest is copied into the send queue ring and drained from
+  _sent() and _poll() as the peer acks. Returns the number of bytes accepted,
+  which is less than size only when the ring could not grow.
+*/
+size_t AsyncClient::enqueue(const char* data, size_t size) {
+  if(!_pcb || size == 0 || data == NULL)
+    return 0;
+  // add() closes a secure connection whose write fails, and the discard
+  // callback may delete us.
+  ACErrorTracker errorTracker(this);
+  size_t accepted = 0;
+  if(_queueEmpty() && !AsyncSendScheduler::enabled()){
+    size_t room = _txAllowance(space());
+    if(room){
+      accepted = add(data, (room < size) ? room : size, ASYNC_WRITE_FLAG_COPY);
+      if(!errorTracker.hasClient() || !_pcb)
+        return 0;
+      _txTake(accepted);
+    }
+  }
+  if(accepted < size){
+    size_t want = size - accepted;
+    if(!_reserveQueue(want)){
+      ASYNC_TCP_DEBUG("enqueue[%u]: could not grow queue, %u bytes dropped\n", getConnectionId(), want - (_tx ? _tx->txq.room() : 0));
+    }
+    if(_tx){
+      size_t w = _tx->txq.write(data + accepted, want);
+      _tx->txq_in += w;
+      accepted += w;
+    }
+  }
+  if(!_queueEmpty()){
+    _kickQueue();
+    if(!errorTracker.hasClient())
+      return accepted;
+  } else if(accepted)
+    send();
+  _armWritable();
+  return accepted;
+}
+
+// Make room for len more bytes in the send queue.
+bool AsyncClient::_reserveQueue(size_t len){
+  if(!_txState(true))
+    return false;
+  AsyncRingBuffer &txq = _tx->txq;
+  if(txq.capacity() == 0)
+    txq.resize(ASYNC_TX_QUEUE_SIZE);
+  return txq.reserve(len);
+}
+
+/*
+  Queue len bytes at data by reference, behind whatever is queued already.
+  The data has to stay valid until release is called, which happens once
+  the peer has acked all of it (on secure connections once it is
+  encrypted) or the connection goes away, however the queue is drained.
+  Fails without calling release when out of memory.
+*/
+bool AsyncClient::_enqueueRef(const char* data, size_t len, AcReleaseHandler release, void* arg){
+  if(!_pcb || len == 0 || !_txState(true))
+    return false;
+  ac_release_item *item = new (std::nothrow) ac_release_item;
+  if(item == NULL){
+    ASYNC_TCP_DEBUG("_enqueueRef[%u]: out of memory\n", getConnectionId());
+    return false;
+  }
+  item->end = _tx->txq_in;  // the ring bytes ahead of it, see _drainQueue()
+  item->cb = release;
+  item->arg = arg;
+  item->data = data;
+  item->len = len;
+  item->next = NULL;
+  if(_tx->ref_tail)
+    _tx->ref_tail->next = item;
+  else
+    _tx->ref_head = item;
+  _tx->ref_tail = item;
+  _tx->ref_bytes += len;
+  ACErrorTracker errorTracker(this);
+  _kickQueue();
+  if(errorTracker.hasClient())
+    _armWritable();
+  return true;
+}
+
+/*
+  Hand as much of the send queue to the stack as space() allows and push it
+  out with one send(). Ring bytes go straight from the ring spans; a queued
+  reference goes as soon as the ring bytes queued ahead of it are out.
+*/
+size_t AsyncClient::_drainQueue(size_t limit) {
+  if(_queueEmpty())
+    return 0;
+  ACErrorTracker errorTracker(this);
+  size_t allowance = _txAllowance(space());
+  if(allowance > limit)
+    allowance = limit;
+  size_t sent = 0;
+  while(sent < allowance && _pcb && !_queueEmpty()){
+    size_t w;
+    if(_tx->ref_head && _tx->ref_head->end == _tx->txq_out)
+      w = _drainRef(allowance - sent);
+    else
+      w = _drainRing(allowance - sent);
+    if(!errorTracker.hasClient())
+      return 0;
+    if(w == 0)
+      break;
+    sent += w;
+  }
+  if(sent && _pcb){
+    _txTake(sent);
+    send();
+  }
+  return sent;
+}
+
+// Ring part of _drainQueue(), up to the next queued reference.
+size_t AsyncClient::_drainRing(size_t limit) {
+  ACErrorTracker errorTracker(this);
+  AsyncRingBuffer &txq = _tx->txq;
+  size_t avail = txq.available();
+  if(_tx->ref_head && _tx->ref_head->end - _tx->txq_out < avail)
+    avail = _tx->ref_head->end - _tx->txq_out;
+  if(limit > avail)
+    limit = avail;
+  size_t sent = 0;
+  AsyncRingSpan spans[2];
+  size_t count = txq.readSpans(spans);
+  for(size_t i = 0; i < count && _pcb; i++){
+    size_t room = space();
+    if(room > limit - sent)
+      room = limit - sent;
+    if(!room)
+      break;
+    size_t n = (spans[i].len < room) ? spans[i].len : room;
+    uint8_t flags = ASYNC_WRITE_FLAG_COPY;
+    if(n < queued() - sent && n < room)
+      flags |= ASYNC_WRITE_FLAG_MORE;
+    size_t w = add(spans[i].data, n, flags);
+    if(!errorTracker.hasClient())
+      return 0;
+    sent += w;
+    if(w != spans[i].len)
+      break;
+  }
+  if(sent){
+    txq.consume(sent);
+    _tx->txq_out += sent;
+  }
+  return sent;
+}
+
+/*
+  Reference part of _drainQueue(). Once all of the head reference is in the
+  stack it moves to the release records, to be released on the ack that
+  covers it like an addv() fragment.
+*/
+size_t AsyncClient::_drainRef(size_t limit) {
+  ACErrorTracker errorTracker(this);
+  ac_release_item *item = _tx->ref_head;
+  size_t n = item->len - _tx->ref_off;
+  if(n > limit)
+    n = limit;
+  uint8_t flags = 0;
+  if(n < queued())
+    flags |= ASYNC_WRITE_FLAG_MORE;
+  size_t w = add(item->data + _tx->ref_off, n, flags);
+  if(!errorTracker.hasClient() || w == 0)
+    return 0;
+  _tx->ref_off += w;
+  _tx->ref_bytes -= w;
+  if(_tx->ref_off < item->len)
+    return w;
+  _tx->ref_off = 0;
+  _tx->ref_head = item->next;
+  if(_tx->ref_head == NULL)
+    _tx->ref_tail = NULL;
+  item->next = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+  if(_pcb_secure){
+    // encrypted into the SSL buffer, nothing stays referenced
+    item->cb(item->arg, item->data, item->len);
+    delete item;
+    return errorTracker.hasClient() ? w : 0;
+  }
+#endif
+  item->end = _tx->added_total;
+  if(_tx->release_tail)
+    _tx->release_tail->next = item;
+  else
+    _tx->release_head = item;
+  _tx->release_tail = item;
+  return w;
+}
+
+/*
+  Pacing of the send queue. The client's own bucket and the one shared by all
+  clients of its AsyncServer both have to have tokens. They are refilled from
+  millis() whenever the queue is drained, i.e. from _sent() and _poll().
+*/
+size_t AsyncClient::_txAllowance(size_t room){
+  AsyncTokenBucket *buckets[2] = { _tx ? _tx->bucket : NULL, _server ? _server->_rate_bucket : NULL };
+  if(!buckets[0] && !buckets[1])
+    return room;
+  uint32_t now = millis();
+  for(AsyncTokenBucket *b : buckets){
+    if(!b)
+      continue;
+    size_t a = b->available(now);
+    if(a < room)
+      room = a;
+  }
+  return room;
+}
+
+void AsyncClient::_txTake(size_t len){
+  if(_tx && _tx->bucket)
+    _tx->bucket->take(len);
+  if(_server && _server->_rate_bucket)
+    _server->_rate_bucket->take(len);
+}
+
+void AsyncClient::setRateLimit(uint32_t bytesPerSec, uint32_t burst){
+  if(bytesPerSec == 0){
+    if(_tx){
+      delete _tx->bucket;
+      _tx->bucket = NULL;
+    }
+    return;
+  }
+  if(!_txState(true))
+    return;
+  if(_tx->bucket == NULL){
+    _tx->bucket = new (std::nothrow) AsyncTokenBucket();
+    if(_tx->bucket == NULL)
+      return;
+  }
+  _tx->bucket->configure(bytesPerSec, burst);
+}
+
+bool AsyncClient::setStats(bool enable){
+  if(!enable){
+    delete _stats;
+    _stats = NULL;
+    return true;
+  }
+  if(_stats == NULL)
+    _stats = new (std::nothrow) AsyncTCPStats();
+  return _stats != NULL;
+}
+
+bool AsyncClient::getStats(AsyncTCPStats &out, bool reset){
+  if(_stats == NULL)
+    return false;
+  out = *_stats;
+  if(reset)
+    _stats->reset();
+  return true;
+}
+
+/*
+  Called from _sent() for every ack. The pcb keeps sa scaled by 8 and both
+  sa and rto in slow timer ticks; sa stays 0 until the first RTT sample.
+*/
+void AsyncClient::_recordStats(uint32_t ackTime){
+  AsyncTCPStats *all[2] = { _stats, _server ? _server->_stats : NULL };
+  if(!all[0] && !all[1])
+    return;
+  uint32_t rtt = 0, rto = 0;
+  if(_pcb){
+    if(_pcb->sa > 0)
+      rtt = (uint32_t)(_pcb->sa >> 3) * TCP_SLOW_INTERVAL;
+    if(_pcb->rto > 0)
+      rto = (uint32_t)_pcb->rto * TCP_SLOW_INTERVAL;
+  }
+  for(AsyncTCPStats *s : all){
+    if(!s)
+      continue;
+    s->ack.add(ackTime);
+    if(rtt)
+      s->rtt.add(rtt);
+    if(rto)
+      s->rto.add(rto);
+  }
+}
+
+void AsyncClient::_clearQueue() {
+  if(!_tx)
+    return;
+  _tx->txq.clear();
+  _tx->txq.resize(0);
+  _tx->txq_out = _tx->txq_in;
+  ac_release_item *due = _tx->ref_head;
+  _tx->ref_head = NULL;
+  _tx->ref_tail = NULL;
+  _tx->ref_off = 0;
+  _tx->ref_bytes = 0;
+  _schedDetach();
+  while(due){
+    ac_release_item *item = due;
+    due = due->next;
+    item->cb(item->arg, item->data, item->len);
+    delete item;
+  }
+}
+
+// Drain the send queue, through the scheduler when one is configured.
+void AsyncClient::_kickQueue() {
+  if(AsyncSendScheduler::enabled()){
+    AsyncSendScheduler::activate(this);
+    AsyncSendScheduler::run();
+  } else {
+    _drainQueue();
+  }
+}
+
+void AsyncClient::_schedDetach() {
+  if(!_tx)
+    return;
+  AsyncSendScheduler::detach(this);
+  size_t freed = _tx->sched_inflight;
+  AsyncSendScheduler::release(freed);
+  _tx->sched_inflight = 0;
+  _tx->sched_span_count = 0;
+  _tx->deficit = 0;
+  // nobody else may get an ack to run the connections waiting for this budget
+  if(freed)
+    AsyncSendScheduler::run();
+}
+
+/*
+  Remember where the bytes the scheduler just drained sit in the stream, so
+  that only their acks give budget back; bytes written with add() and
+  write() in between are not the scheduler's.
+*/
+void AsyncClient::_schedSent(size_t len){
+  if(!len)
+    return;
+  ac_client_tx *tx = _tx;
+  tx->sched_inflight += len;
+  if(tx->sched_span_count){
+    ac_sched_span &last = tx->sched_spans[(tx->sched_span_head + tx->sched_span_count - 1) % ASYNC_SCHED_SPANS];
+    if(last.end + len == tx->added_total || tx->sched_span_count == ASYNC_SCHED_SPANS){
+      last.end = tx->added_total;
+      last.len += len;
+      return;
+    }
+  }
+  ac_sched_span &span = tx->sched_spans[(tx->sched_span_head + tx->sched_span_count) % ASYNC_SCHED_SPANS];
+  span.end = tx->added_total;
+  span.len = len;
+  tx->sched_span_count++;
+}
+
+// Scheduler bytes covered by the acks so far, taken off sched_inflight.
+size_t AsyncClient::_schedAcked(){
+  ac_client_tx *tx = _tx;
+  size_t done = 0;
+  while(tx->sched_span_count){
+    ac_sched_span &span = tx->sched_spans[tx->sched_span_head];
+    uint32_t start = span.end - span.len;
+    if((int32_t)(tx->acked_total - start) <= 0)
+      break;
+    uint32_t n = tx->acked_total - start;
+    if(n > span.len)
+      n = span.len;
+    span.len -= n;
+    done += n;
+    if(span.len)
+      break;
+    tx->sched_span_head = (tx->sched_span_head + 1) % ASYNC_SCHED_SPANS;
+    tx->sched_span_count--;
+  }
+  if(done > tx->sched_inflight)
+    done = tx->sched_inflight;
+  tx->sched_inflight -= done;
+  return done;
+}
+
+void AsyncClient::setPriority(acPriority_t cls, uint8_t weight){
+  if(cls >= AC_PRIO_CLASSES)
+    cls = AC_PRIO_NORMAL;
+  bool active = _sched_active;
+  AsyncSendScheduler::detach(this);
+  _prio_class = cls;
+  _weight = weight ? weight : 1;
+  if(active)
+    AsyncSendScheduler::activate(this);
+  if(_pcb)
+    tcp_setprio(_pcb, _tcpPrio(_prio_class));
+}
+
 bool AsyncClient::send(){
 #if ASYNC_TCP_SSL_ENABLED
-  if(_pcb_secure)
+  if(_pcb_secure){
+    // tcp_ssl_write() has sent it already
+    _armWritable();
     return true;
+  }
 #endif
+  if(_cork && _tx->cork_pending < getMss()){
+    // Held back until a full segment is queued, the callback returns or,
+    // queued from loop(), the timer fires on the next tick.
+    if(_tx->cork_pending){
+      _tx->cork_saved++;
+      if(!_timer.armed() || _timer.remaining())
+        _timer.arm(0);
+    }
+    return true;
+  }
+  return _output();
+}
+
+bool AsyncClient::_output(){
+  if(_tx)
+    _tx->cork_pending = 0;
   err_t err = tcp_output(_pcb);
   if(err == ERR_OK){
-    _pcb_busy = true;
-    _pcb_sent_at = millis();
+    uint32_t now = millis();
+    if(!_pcb_busy){
+      _pcb_sent_at = now;
+      _pcb_sent_end = _pcb->snd_lbb;
+      if(_tx)
+        _tx->mark_count = 0;
+      _pcb_busy = true;
+      if(_ack_timeout)
+        _armTimeouts();
+    } else {
+      _markSent(now);
+    }
+    _armWritable();
     return true;
   }
 
@@ -432,6 +1451,98 @@ bool AsyncClient::send(){
   return false;
 }
 
+/*
+  While one send is in flight, _pcb_sent_at and _pcb_sent_end time it. A
+  tcp_output() that follows before it is acked moves to marks in the send
+  state: each leaves one at the end of the sequence space buffered so far,
+  and _sent() retires the marks the cumulative ack has passed, so the oldest
+  remaining one is the send time of the oldest unacked byte. Sequence
+  numbers are taken from the pcb, which also covers SSL records.
+*/
+void AsyncClient::_markSent(uint32_t now){
+  uint32_t end = _pcb->snd_lbb;
+  if(end == _pcb_sent_end)
+    return;
+  ac_client_tx *tx = _tx;
+  if(!tx || !tx->mark_count){
+    if((int32_t)(_pcb->lastack - _pcb_sent_end) >= 0){
+      // the earlier send is acked, this one is alone in flight
+      _pcb_sent_at = now;
+      _pcb_sent_end = end;
+      return;
+    }
+    tx = _txState(true);
+    if(!tx){
+      // the extra bytes are timed from the earlier send
+      _pcb_sent_end = end;
+      return;
+    }
+    tx->mark_head = 0;
+    tx->marks[0].end = _pcb_sent_end;
+    tx->marks[0].time = _pcb_sent_at;
+    tx->mark_count = 1;
+  }
+  _pcb_sent_end = end;
+  if(tx->mark_count == ASYNC_SEND_MARKS){
+    // out of marks: the extra bytes are timed from an earlier send
+    tx->marks[(tx->mark_head + tx->mark_count - 1) % ASYNC_SEND_MARKS].end = end;
+    return;
+  }
+  ac_send_mark &mark = tx->marks[(tx->mark_head + tx->mark_count) % ASYNC_SEND_MARKS];
+  mark.end = end;
+  mark.time = now;
+  tx->mark_count++;
+}
+
+/*
+  Retire acked marks, returns the send time of the oldest data just acked.
+  Once the ack has passed everything timed, what is still in the stack was
+  queued after the last tcp_output() (corked, or sent by lwIP on its own
+  from this ack), so its clock starts now.
+*/
+uint32_t AsyncClient::_ackMarks(){
+  ac_client_tx *tx = _tx;
+  uint32_t sentAt = _pcb_sent_at;
+  if(tx && tx->mark_count){
+    sentAt = tx->marks[tx->mark_head].time;
+    uint32_t acked = _pcb ? _pcb->lastack : _pcb_sent_end;
+    while(tx->mark_count && (int32_t)(acked - tx->marks[tx->mark_head].end) >= 0){
+      tx->mark_head = (tx->mark_head + 1) % ASYNC_SEND_MARKS;
+      tx->mark_count--;
+    }
+    if(tx->mark_count){
+      _pcb_sent_at = tx->marks[tx->mark_head].time;
+      return sentAt;
+    }
+  }
+  if(_pcb && (int32_t)(_pcb->lastack - _pcb_sent_end) >= 0 && tcp_sndbuf(_pcb) < TCP_SND_BUF)
+    _pcb_sent_at = millis();
+  return sentAt;
+}
+
+/*
+  In cork mode add() marks everything with ASYNC_WRITE_FLAG_MORE and send()
+  only calls tcp_output() once a full MSS is pending. Whatever is left goes
+  out when the lwIP callback that queued it returns, from the connection's
+  timer on the next tick when it was queued outside a callback, or on
+  flush(). Turning cork mode off flushes.
+*/
+void AsyncClient::setCork(bool cork){
+  if(cork && !_txState(true))
+    return;
+  _cork = cork;
+  if(!cork)
+    _flushCork();
+}
+
+bool AsyncClient::flush(){
+  if(!_pcb)
+    return false;
+  if(!_tx || !_tx->cork_pending)
+    return true;
+  return _output();
+}
+
 size_t AsyncClient::ack(size_t len){
   if(len > _rx_ack_len)
     len = _rx_ack_len;
@@ -441,9 +1552,55 @@ size_t AsyncClient::ack(size_t len){
   return len;
 }
 
+/*
+  Receive budget: with a limit set, data handed to onData()/onDataVec() counts
+  as held until the application consume()s it. The window is reopened for
+  delivered data only while the held total stays within the limit, the rest
+  is withheld until consume() brings it back under, so a fast sender is
+  throttled by TCP itself. tcp_axtls acks SSL records on its own, so this
+  only applies to plain connections.
+*/
+void AsyncClient::_recved(tcp_pcb* pcb, size_t len){
+  if(!_ext || !_ext->rx_limit){
+    tcp_recved(pcb, len);
+    return;
+  }
+  _ext->rx_held += len;
+  size_t over = (_ext->rx_held > _ext->rx_limit) ? (_ext->rx_held - _ext->rx_limit) : 0;
+  size_t withhold = (over < len) ? over : len;
+  _ext->rx_withheld += withhold;
+  if(len > withhold)
+    tcp_recved(pcb, len - withhold);
+}
+
+size_t AsyncClient::consume(size_t len){
+  if(!_ext)
+    return 0;
+  if(len > _ext->rx_held)
+    len = _ext->rx_held;
+  _ext->rx_held -= len;
+  size_t keep = (_ext->rx_held > _ext->rx_limit) ? (_ext->rx_held - _ext->rx_limit) : 0;
+  if(_ext->rx_withheld > keep){
+    size_t release = _ext->rx_withheld - keep;
+    _ext->rx_withheld = keep;
+    if(_pcb)
+      tcp_recved(_pcb, release);
+  }
+  return len;
+}
+
+void AsyncClient::setRxBufferLimit(size_t bytes){
+  if(!_extend(bytes != 0))
+    return;
+  _ext->rx_limit = bytes;
+  if(!bytes)
+    _ext->rx_held = 0;
+  consume(0);
+}
+
 // Private Callbacks
 
-void AsyncClient::_connected(std::shared_ptr<ACErrorTracker>& errorTracker, void* pcb, err_t err){
+void AsyncClient::_connected(ACErrorTracker& errorTracker, void* pcb, err_t err){
   //(void)err; // LWIP v1.4 appears to always call with ERR_OK
   // Documentation for 2.1.0 also says:
   //   "err	- An unused error code, always ERR_OK currently ;-)"
@@ -451,14 +1608,14 @@ void AsyncClient::_connected(std::shared_ptr<ACErrorTracker>& errorTracker, void
   // Based on that wording and emoji lets just handle it now.
   // After all, the API does allow for an err != ERR_OK.
   if(NULL == pcb || ERR_OK != err) {
-    ASYNC_TCP_DEBUG("_connected[%u]:%s err: %s(%ld)\n", errorTracker->getConnectionId(), ((NULL == pcb) ? " NULL == pcb!," : ""), errorToString(err), err);
-    errorTracker->setCloseError(err);
-    errorTracker->setErrored(EE_CONNECTED_CB);
+    ASYNC_TCP_DEBUG("_connected[%u]:%s err: %s(%ld)\n", errorTracker.getConnectionId(), ((NULL == pcb) ? " NULL == pcb!," : ""), errorToString(err), err);
+    errorTracker.setCloseError(err);
+    errorTracker.setErrored(EE_CONNECTED_CB);
     _pcb = reinterpret_cast<tcp_pcb*>(pcb);
     if (_pcb)
       clearTcpCallbacks(_pcb);
     _pcb = NULL;
-    _error(err);
+    _error(errorTracker, err);
     return;
   }
 
@@ -466,10 +1623,11 @@ void AsyncClient::_connected(std::shared_ptr<ACErrorTracker>& errorTracker, void
   if(_pcb){
     _pcb_busy = false;
     _rx_last_packet = millis();
-    tcp_setprio(_pcb, TCP_PRIO_MIN);
+    tcp_setprio(_pcb, _tcpPrio(_prio_class));
     tcp_recv(_pcb, &_s_recv);
     tcp_sent(_pcb, &_s_sent);
     tcp_poll(_pcb, &_s_poll, 1);
+    _armTimeouts();
 #if ASYNC_TCP_SSL_ENABLED
     if(_pcb_secure){
       if(tcp_ssl_new_client(_pcb) < 0){
@@ -482,12 +1640,11 @@ void AsyncClient::_connected(std::shared_ptr<ACErrorTracker>& errorTracker, void
       tcp_ssl_err(_pcb, &_s_ssl_error);
     }
   }
-  if(!_pcb_secure && _connect_cb)
+  if(!_pcb_secure)
 #else
   }
-  if(_connect_cb)
 #endif
-    _connect_cb(_connect_cb_arg, this);
+    _connectCb();
   return;
 }
 
@@ -508,13 +1665,16 @@ void AsyncClient::_close(){
       abort();
     }
     _pcb = NULL;
-    if(_discard_cb)
-      _discard_cb(_discard_cb_arg, this);
+    _releaseFragments(true);
+    _clearQueue();
+    _freeHold();
+    _serverDetach();
+    _discardCb();
   }
   return;
 }
 
-void AsyncClient::_error(err_t err) {
+void AsyncClient::_error(ACErrorTracker& errorTracker, err_t err) {
   ASYNC_TCP_DEBUG("_error[%u]:%s err: %s(%ld)\n", getConnectionId(), ((NULL == _pcb) ? " NULL == _pcb!," : ""), errorToString(err), err);
   if(_pcb){
 #if ASYNC_TCP_SSL_ENABLED
@@ -526,20 +1686,24 @@ void AsyncClient::_error(err_t err) {
     // made to set to NULL other callbacks.
     _pcb = NULL;
   }
-  if(_error_cb)
-    _error_cb(_error_cb_arg, this, err);
-  if(_discard_cb)
-    _discard_cb(_discard_cb_arg, this);
+  _releaseFragments(true);
+  _clearQueue();
+  _freeHold();
+  _serverDetach();
+  _errorCb(err);
+  // onError may have deleted us
+  if(!errorTracker.hasClient())
+    return;
+  _discardCb();
 }
 
 #if ASYNC_TCP_SSL_ENABLED
 void AsyncClient::_ssl_error(int8_t err){
-  if(_error_cb)
-    _error_cb(_error_cb_arg, this, err+64);
+  _errorCb(err+64);
 }
 #endif
 
-void AsyncClient::_sent(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb* pcb, uint16_t len) {
+void AsyncClient::_sent(ACErrorTracker& errorTracker, tcp_pcb* pcb, uint16_t len) {
   (void)pcb;
 #if ASYNC_TCP_SSL_ENABLED
   if (_pcb_secure && !_handshake_done)
@@ -548,29 +1712,62 @@ void AsyncClient::_sent(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb*
   _rx_last_packet = millis();
   _tx_unacked_len -= len;
   _tx_acked_len += len;
-  ASYNC_TCP_DEBUG("_sent[%u]: %4u, unacked=%4u, acked=%4u, space=%4u\n", errorTracker->getConnectionId(), len, _tx_unacked_len, _tx_acked_len, space());
-  if(_tx_unacked_len == 0){
-    _pcb_busy = false;
-    errorTracker->setCloseError(ERR_OK);
-    if(_sent_cb) {
-      _sent_cb(_sent_cb_arg, this, _tx_acked_len, (millis() - _pcb_sent_at));
-      if(!errorTracker->hasClient())
+  if(_tx)
+    _tx->acked_total += len;
+  uint32_t ackTime = millis() - _ackMarks();
+  _recordStats(ackTime);
+  ASYNC_TCP_DEBUG("_sent[%u]: %4u, unacked=%4u, acked=%4u, space=%4u\n", errorTracker.getConnectionId(), len, _tx_unacked_len, _tx_acked_len, space());
+  if(_tx && _tx->release_head){
+    _releaseFragments(false);
+    if(!errorTracker.hasClient())
+      return;
+  }
+  if(_tx && _tx->sched_inflight){
+    AsyncSendScheduler::release(_schedAcked());
+    if(_queueEmpty()){
+      AsyncSendScheduler::run();
+      if(!errorTracker.hasClient())
         return;
     }
+  }
+  if(!_queueEmpty()){
+    _kickQueue();
+    if(!errorTracker.hasClient())
+      return;
+  }
+  if(_hasProgressCb()){
+    _progressCb(len, ackTime);
+    if(!errorTracker.hasClient())
+      return;
+  }
+  if(_writable_armed && outstanding() <= _writableLow()){
+    _writable_armed = false;
+    if(_hasWritableCb()){
+      _writableCb();
+      if(!errorTracker.hasClient())
+        return;
+    }
+  }
+  if(_tx_unacked_len == 0){
+    _pcb_busy = false;
+    errorTracker.setCloseError(ERR_OK);
+    _ackCb(_tx_acked_len, ackTime);
+    if(!errorTracker.hasClient())
+      return;
     _tx_acked_len = 0;
   }
   return;
 }
 
-void AsyncClient::_recv(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb* pcb, pbuf* pb, err_t err) {
+void AsyncClient::_recv(ACErrorTracker& errorTracker, tcp_pcb* pcb, pbuf* pb, err_t err) {
   // While lwIP v1.4 appears to always call with ERR_OK, 2.x lwIP may present
   // a non-ERR_OK value.
   // https://www.nongnu.org/lwip/2_1_x/tcp_8h.html#a780cfac08b02c66948ab94ea974202e8
   if(NULL == pcb || ERR_OK != err){
-    ASYNC_TCP_DEBUG("_recv[%u]:%s err: %s(%ld)\n", errorTracker->getConnectionId(), ((NULL == pcb) ? " NULL == pcb!," : ""), errorToString(err), err);
+    ASYNC_TCP_DEBUG("_recv[%u]:%s err: %s(%ld)\n", errorTracker.getConnectionId(), ((NULL == pcb) ? " NULL == pcb!," : ""), errorToString(err), err);
     ASYNC_TCP_ASSERT(ERR_ABRT != err);
-    errorTracker->setCloseError(err);
-    errorTracker->setErrored(EE_RECV_CB);
+    errorTracker.setCloseError(err);
+    errorTracker.setErrored(EE_RECV_CB);
     _pcb = pcb;
     if(_pcb)
       clearTcpCallbacks(_pcb);
@@ -596,17 +1793,22 @@ void AsyncClient::_recv(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb*
     // the client sketch must always test that the connection is still up
     // at loop() entry and after the return of any function call, that may
     // have done a delay() or yield().
-    _error(err);
+    _error(errorTracker, err);
     return;
   }
 
   if(pb == NULL){
-    ASYNC_TCP_DEBUG("_recv[%u]: pb == NULL! Closing... %ld\n", errorTracker->getConnectionId(), err);
+    ASYNC_TCP_DEBUG("_recv[%u]: pb == NULL! Closing... %ld\n", errorTracker.getConnectionId(), err);
+    if(_ext && _ext->rx_hold){
+      _deliverRecv(errorTracker, pcb, _holdRecv(NULL, true));
+      if(!errorTracker.hasClient())
+        return;
+    }
     _close();
     return;
   }
   _rx_last_packet = millis();
-  errorTracker->setCloseError(ERR_OK);
+  errorTracker.setCloseError(ERR_OK);
 #if ASYNC_TCP_SSL_ENABLED
   if(_pcb_secure){
     ASYNC_TCP_DEBUG("_recv[%u]: %d\n", getConnectionId(), pb->tot_len);
@@ -619,12 +1821,69 @@ void AsyncClient::_recv(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb*
     }
     return;
   }
-#endif
+#endif
+  // Held data goes first even once coalescing is off, or the stream reorders.
+  if(_ext && (_ext->rx_coalesce_bytes || _ext->rx_hold)){
+    pb = _holdRecv(pb, false);
+    if(pb == NULL)
+      return;
+  }
+  _deliverRecv(errorTracker, pcb, pb);
+  return;
+}
+
+/*
+  Hand a whole pbuf chain to onDataVec() as views into the payloads and
+  account for it with one tcp_recved() (or one _rx_ack_len update when the
+  callback asked for ackLater()).
+*/
+void AsyncClient::_recvVec(ACErrorTracker& errorTracker, tcp_pcb* pcb, pbuf* pb){
+  AcDataVec vec[ASYNC_RX_VEC_MAX];
+  size_t total = pb->tot_len;
+  _ack_pcb = true;
+  _recv_pbuf_flags = _chainFlags(pb);
+  ASYNC_TCP_DEBUG("_recv[%u]: vec %d\n", errorTracker.getConnectionId(), total);
+  for(pbuf *b = pb; b != NULL && errorTracker.hasClient();){
+    size_t count = 0;
+    size_t len = 0;
+    while(b != NULL && count < ASYNC_RX_VEC_MAX){
+      vec[count].data = (char*)b->payload;
+      vec[count].len = b->len;
+      len += b->len;
+      count++;
+      b = b->next;
+    }
+    _vecCb(vec, count, len);
+  }
+  if(errorTracker.hasClient()){
+    if(!_ack_pcb)
+      _rx_ack_len += total;
+    else
+      _recved(pcb, total);
+  }
+  pbuf_free(pb);
+}
+
+/*
+  Hand received data to the application: the chain callback, one onPacket()
+  or onData() call per pbuf, or one onDataVec() call for the chain.
+*/
+void AsyncClient::_deliverRecv(ACErrorTracker& errorTracker, tcp_pcb* pcb, pbuf* pb) {
+  if(_hasChainCb()){
+    ASYNC_TCP_DEBUG("_recv[%u]: chain %d\n", errorTracker.getConnectionId(), pb->tot_len);
+    _recv_pbuf_flags = _chainFlags(pb);
+    _chainCb(pb);
+    return;
+  }
+  if(_hasVecCb() && !_hasPacketCb()){
+    _recvVec(errorTracker, pcb, pb);
+    return;
+  }
   while(pb != NULL){
     // IF this callback function returns ERR_OK or ERR_ABRT
     // then it is assummed we freed the pbufs.
     // https://www.nongnu.org/lwip/2_1_x/group__tcp__raw.html#ga8afd0b316a87a5eeff4726dc95006ed0
-    if(!errorTracker->hasClient()){
+    if(!errorTracker.hasClient()){
       while(pb != NULL){
         pbuf *b = pb;
         pb = b->next;
@@ -638,64 +1897,208 @@ void AsyncClient::_recv(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb*
     pbuf *b = pb;
     pb = b->next;
     b->next = NULL;
-    ASYNC_TCP_DEBUG("_recv[%u]: %d%s\n", errorTracker->getConnectionId(), b->len, (b->flags&PBUF_FLAG_PUSH)?", PBUF_FLAG_PUSH":"");
-    if(_pb_cb){
-      _pb_cb(_pb_cb_arg, this, b);
+    ASYNC_TCP_DEBUG("_recv[%u]: %d%s\n", errorTracker.getConnectionId(), b->len, (b->flags&PBUF_FLAG_PUSH)?", PBUF_FLAG_PUSH":"");
+    if(_hasPacketCb()){
+      _packetCb(b);
     } else {
-      if(_recv_cb){
+      if(_hasDataCb()){
         _recv_pbuf_flags = b->flags;
-        _recv_cb(_recv_cb_arg, this, b->payload, b->len);
+        _dataCb(b->payload, b->len);
       }
-      if(errorTracker->hasClient()){
+      if(errorTracker.hasClient()){
         if(!_ack_pcb)
           _rx_ack_len += b->len;
         else
-          tcp_recved(pcb, b->len);
+          _recved(pcb, b->len);
       }
       pbuf_free(b);
     }
   }
-  return;
 }
 
-void AsyncClient::_poll(std::shared_ptr<ACErrorTracker>& errorTracker, tcp_pcb* pcb){
+/*
+  Receive coalescing: segments are held as pbuf references until one carries
+  PSH, rx_coalesce_bytes are held, or rx_coalesce_ms have passed (0 means
+  no time limit; run from _timeouts()). onData() then gets them as one pbuf,
+  onDataVec() as one chain. Turning coalescing off, or setting onPacket()
+  or onPacketChain(), releases what is held.
+*/
+pbuf* AsyncClient::_holdRecv(pbuf* pb, bool flush){
+  ac_client_ext *ext = _ext;  // set, receive coalescing is on or data is held
+  if(pb){
+    if(ext->rx_hold){
+      pbuf_cat(ext->rx_hold, pb);
+    } else {
+      ext->rx_hold = pb;
+      ext->rx_hold_since = millis();
+      _armTimeouts();
+    }
+  }
+  if(!ext->rx_hold)
+    return NULL;
+  u8_t flags = _chainFlags(ext->rx_hold);
+  if(!flush && !(flags & PBUF_FLAG_PUSH) && ext->rx_hold->tot_len < ext->rx_coalesce_bytes && !_holdExpired(millis()))
+    return NULL;
+  pb = ext->rx_hold;
+  ext->rx_hold = NULL;
+  if(pb->next && !_hasVecCb()){
+    // pbuf_coalesce() hands back the chain untouched if it cannot allocate
+    pb = pbuf_coalesce(pb, PBUF_RAW);
+    if(!pb->next)
+      pb->flags |= (flags & PBUF_FLAG_PUSH);
+  }
+  return pb;
+}
+
+bool AsyncClient::_holdExpired(uint32_t now){
+  if(!_ext->rx_coalesce_bytes || _hasChainCb() || _hasPacketCb())
+    return true;
+  return _ext->rx_coalesce_ms && (now - _ext->rx_hold_since) >= _ext->rx_coalesce_ms;
+}
+
+void AsyncClient::_serverDetach(){
+  if(!_server)
+    return;
+  if(_srv_prev)
+    _srv_prev->_srv_next = _srv_next;
+  else
+    _server->_clients = _srv_next;
+  if(_srv_next)
+    _srv_next->_srv_prev = _srv_prev;
+  for(as_client_walk *w = _server->_walks; w != NULL; w = w->outer){
+    if(w->next == this)
+      w->next = _srv_next;
+  }
+#if ASYNC_TCP_SSL_ENABLED
+  if(_pcb_secure)
+    _server->_kickPending();
+#endif
+  _server->_client_count--;
+  _server = NULL;
+  _srv_prev = NULL;
+  _srv_next = NULL;
+}
+
+void AsyncClient::_freeHold(){
+  if(_ext && _ext->rx_hold){
+    pbuf_free(_ext->rx_hold);
+    _ext->rx_hold = NULL;
+  }
+}
+
+/*
+  Held segments are not given back to the window until they are delivered,
+  so a limit the window cannot reach would never be met by a peer that is
+  window limited and sends no PSH: bytes is kept a segment short of TCP_WND.
+*/
+void AsyncClient::setRecvCoalesce(size_t bytes, uint32_t ms){
+  size_t max = (TCP_WND > 2 * TCP_MSS) ? TCP_WND - TCP_MSS : TCP_WND / 2;
+  if(bytes > max)
+    bytes = max;
+  if(!_extend(bytes != 0))
+    return;
+  _ext->rx_coalesce_bytes = bytes;
+  _ext->rx_coalesce_ms = ms;
+  if(_ext->rx_hold)
+    _armTimeouts();
+}
+
+void AsyncClient::_poll(ACErrorTracker& errorTracker, tcp_pcb* pcb){
   (void)pcb;
-  errorTracker->setCloseError(ERR_OK);
+  errorTracker.setCloseError(ERR_OK);
 
   // Close requested
   if(_close_pcb){
-    ASYNC_TCP_DEBUG("_poll[%u]: Process _close_pcb.\n", errorTracker->getConnectionId() );
+    ASYNC_TCP_DEBUG("_poll[%u]: Process _close_pcb.\n", errorTracker.getConnectionId() );
     _close_pcb = false;
     _close();
     return;
   }
+  if(!_queueEmpty()){
+    _kickQueue();
+    if(!errorTracker.hasClient())
+      return;
+  }
+  // Timeouts are run from _timer, see _timeouts().
+  _pollCb();
+  return;
+}
+
+/*
+  Per-connection deadlines run from an AsyncTimer rather than the 500 ms
+  lwIP poll, so they have millisecond resolution and a connection with
+  nothing pending is not looked at. _armTimeouts() only ever pulls the
+  timer in; deadlines that moved out (acks, new data) are found here when
+  it fires and re-armed.
+*/
+void AsyncClient::_armTimeouts(){
+  if(!_pcb){
+    _timer.cancel();
+    return;
+  }
+  uint32_t now = millis();
+  uint32_t wait = UINT32_MAX;
+  auto due = [now, &wait](uint32_t since, uint32_t timeout){
+    uint32_t left = ((now - since) >= timeout) ? 0 : timeout - (now - since);
+    if(left < wait)
+      wait = left;
+  };
+  if(_tx && _tx->cork_pending)
+    wait = 0;
+  if(_ext && _ext->rx_hold){
+    if(_holdExpired(now))
+      wait = 0;
+    else if(_ext->rx_coalesce_ms)
+      due(_ext->rx_hold_since, _ext->rx_coalesce_ms);
+  }
+  if(_pcb_busy && _ack_timeout)
+    due(_pcb_sent_at, _ack_timeout);
+  if(_rx_since_timeout)
+    due(_rx_last_packet, _rx_since_timeout);
+#if ASYNC_TCP_SSL_ENABLED
+  if(_pcb_secure && !_handshake_done)
+    due(_rx_last_packet, ASYNC_SSL_HANDSHAKE_TIMEOUT);
+#endif
+  if(wait == UINT32_MAX)
+    _timer.cancel();
+  else if(!_timer.armed() || wait < _timer.remaining())
+    _timer.arm(wait);
+}
+
+void AsyncClient::_timeouts(ACErrorTracker& errorTracker){
+  if(!_pcb)
+    return;
   uint32_t now = millis();
 
+  // Coalescing time limit
+  if(_ext && _ext->rx_hold && _holdExpired(now)){
+    _deliverRecv(errorTracker, _pcb, _holdRecv(NULL, true));
+    if(!errorTracker.hasClient() || !_pcb)
+      return;
+  }
+
   // ACK Timeout
   if(_pcb_busy && _ack_timeout && (now - _pcb_sent_at) >= _ack_timeout){
     _pcb_busy = false;
-    if(_timeout_cb)
-      _timeout_cb(_timeout_cb_arg, this, (now - _pcb_sent_at));
-    return;
+    _timeoutCb(now - _pcb_sent_at);
+    if(!errorTracker.hasClient() || !_pcb)
+      return;
   }
   // RX Timeout
-  if(_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000)){
-    ASYNC_TCP_DEBUG("_poll[%u]: RX Timeout.\n", errorTracker->getConnectionId() );
+  if(_rx_since_timeout && (now - _rx_last_packet) >= _rx_since_timeout){
+    ASYNC_TCP_DEBUG("_timeouts[%u]: RX Timeout.\n", errorTracker.getConnectionId() );
     _close();
     return;
   }
 #if ASYNC_TCP_SSL_ENABLED
   // SSL Handshake Timeout
-  if(_pcb_secure && !_handshake_done && (now - _rx_last_packet) >= 2000){
-    ASYNC_TCP_DEBUG("_poll[%u]: SSL Handshake Timeout.\n", errorTracker->getConnectionId() );
+  if(_pcb_secure && !_handshake_done && (now - _rx_last_packet) >= ASYNC_SSL_HANDSHAKE_TIMEOUT){
+    ASYNC_TCP_DEBUG("_timeouts[%u]: SSL Handshake Timeout.\n", errorTracker.getConnectionId() );
     _close();
     return;
   }
 #endif
-  // Everything is fine
-  if(_poll_cb)
-    _poll_cb(_poll_cb_arg, this);
-  return;
+  _armTimeouts();
 }
 
 #if LWIP_VERSION_MAJOR == 1
@@ -710,10 +2113,8 @@ void AsyncClient::_dns_found(const ip_addr *ipaddr){
     connect(ipaddr, _connect_port);
 #endif
   } else {
-    if(_error_cb)
-      _error_cb(_error_cb_arg, this, -55);
-    if(_discard_cb)
-      _discard_cb(_discard_cb_arg, this);
+    _errorCb(-55);
+    _discardCb();
   }
 }
 
@@ -729,46 +2130,67 @@ void AsyncClient::_s_dns_found(const char *name, const ip_addr *ipaddr, void *ar
 
 err_t AsyncClient::_s_poll(void *arg, struct tcp_pcb *tpcb) {
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  std::shared_ptr<ACErrorTracker>errorTracker = c->getACErrorTracker();
+  ACErrorTracker errorTracker(c);
   c->_poll(errorTracker, tpcb);
-  return errorTracker->getCallbackCloseError();
+  if(errorTracker.hasClient())
+    c->_flushCork();
+  return errorTracker.getCallbackCloseError();
 }
 
 err_t AsyncClient::_s_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err) {
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  auto errorTracker = c->getACErrorTracker();
+  ACErrorTracker errorTracker(c);
   c->_recv(errorTracker, tpcb, pb, err);
-  return errorTracker->getCallbackCloseError();
+  if(errorTracker.hasClient())
+    c->_flushCork();
+  return errorTracker.getCallbackCloseError();
 }
 
 void AsyncClient::_s_error(void *arg, err_t err) {
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  auto errorTracker = c->getACErrorTracker();
-  errorTracker->setCloseError(err);
-  errorTracker->setErrored(EE_ERROR_CB);
-  c->_error(err);
+  ACErrorTracker errorTracker(c);
+  errorTracker.setCloseError(err);
+  errorTracker.setErrored(EE_ERROR_CB);
+  c->_error(errorTracker, err);
 }
 
 err_t AsyncClient::_s_sent(void *arg, struct tcp_pcb *tpcb, uint16_t len) {
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  auto errorTracker = c->getACErrorTracker();
+  ACErrorTracker errorTracker(c);
   c->_sent(errorTracker, tpcb, len);
-  return errorTracker->getCallbackCloseError();
+  if(errorTracker.hasClient())
+    c->_flushCork();
+  return errorTracker.getCallbackCloseError();
 }
 
 err_t AsyncClient::_s_connected(void* arg, void* tpcb, err_t err){
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  auto errorTracker = c->getACErrorTracker();
+  ACErrorTracker errorTracker(c);
   c->_connected(errorTracker, tpcb, err);
-  return errorTracker->getCallbackCloseError();
+  if(errorTracker.hasClient())
+    c->_flushCork();
+  return errorTracker.getCallbackCloseError();
+}
+
+void AsyncClient::_s_timer(AsyncTimer *timer, void *arg){
+  (void)timer;
+  AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
+  ACErrorTracker errorTracker(c);
+  c->_timeouts(errorTracker);
+  if(errorTracker.hasClient())
+    c->_flushCork();
 }
 
 #if ASYNC_TCP_SSL_ENABLED
 void AsyncClient::_s_data(void *arg, struct tcp_pcb *tcp, uint8_t * data, size_t len){
   (void)tcp;
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  if(c->_recv_cb)
-    c->_recv_cb(c->_recv_cb_arg, c, data, len);
+  if(c->_hasVecCb()){
+    AcDataVec vec = { (char*)data, len };
+    c->_vecCb(&vec, 1, len);
+  } else {
+    c->_dataCb(data, len);
+  }
 }
 
 void AsyncClient::_s_handshake(void *arg, struct tcp_pcb *tcp, SSL *ssl){
@@ -776,16 +2198,17 @@ void AsyncClient::_s_handshake(void *arg, struct tcp_pcb *tcp, SSL *ssl){
   (void)ssl;
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
   c->_handshake_done = true;
-  if(c->_connect_cb)
-    c->_connect_cb(c->_connect_cb_arg, c);
+  if(c->_server)
+    c->_server->_kickPending();
+  c->_connectCb();
 }
 
 void AsyncClient::_s_ssl_error(void *arg, struct tcp_pcb *tcp, int8_t err){
   (void)tcp;
 #ifdef DEBUG_ESP_ASYNC_TCP
   AsyncClient *c = reinterpret_cast<AsyncClient*>(arg);
-  auto errorTracker = c->getACErrorTracker();
-  ASYNC_TCP_DEBUG("_ssl_error[%u] err = %d\n", errorTracker->getConnectionId(), err);
+  ACErrorTracker errorTracker(c);
+  ASYNC_TCP_DEBUG("_ssl_error[%u] err = %d\n", errorTracker.getConnectionId(), err);
 #endif
   reinterpret_cast<AsyncClient*>(arg)->_ssl_error(err);
 }
@@ -807,11 +2230,16 @@ AsyncClient & AsyncClient::operator+=(const AsyncClient &other) {
 }
 
 void AsyncClient::setRxTimeout(uint32_t timeout){
+  setRxTimeoutMs(timeout * 1000);
+}
+
+void AsyncClient::setRxTimeoutMs(uint32_t timeout){
   _rx_since_timeout = timeout;
+  _armTimeouts();
 }
 
 uint32_t AsyncClient::getRxTimeout(){
-  return _rx_since_timeout;
+  return _rx_since_timeout / 1000;
 }
 
 uint32_t AsyncClient::getAckTimeout(){
@@ -820,6 +2248,7 @@ uint32_t AsyncClient::getAckTimeout(){
 
 void AsyncClient::setAckTimeout(uint32_t timeout){
   _ack_timeout = timeout;
+  _armTimeouts();
 }
 
 void AsyncClient::setNoDelay(bool nodelay){
@@ -958,18 +2387,69 @@ void AsyncClient::onData(AcDataHandler cb, void* arg){
 }
 
 void AsyncClient::onPacket(AcPacketHandler cb, void* arg){
-  _pb_cb = cb;
-  _pb_cb_arg = arg;
+  if(!_extend((bool)cb))
+    return;
+  _ext->pb_cb = cb;
+  _ext->pb_cb_arg = arg;
+  if(_ext->rx_hold)
+    _armTimeouts();
+}
+
+void AsyncClient::onPacketChain(AcPacketHandler cb, void* arg){
+  if(!_extend((bool)cb))
+    return;
+  _ext->chain_cb = cb;
+  _ext->chain_cb_arg = arg;
+  if(_ext->rx_hold)
+    _armTimeouts();
+}
+
+void AsyncClient::onDataVec(AcDataVecHandler cb, void* arg){
+  if(!_extend((bool)cb))
+    return;
+  _ext->vec_cb = cb;
+  _ext->vec_cb_arg = arg;
 }
 
 void AsyncClient::onTimeout(AcTimeoutHandler cb, void* arg){
-  _timeout_cb = cb;
-  _timeout_cb_arg = arg;
+  if(!_extend((bool)cb))
+    return;
+  _ext->timeout_cb = cb;
+  _ext->timeout_cb_arg = arg;
 }
 
 void AsyncClient::onPoll(AcConnectHandler cb, void* arg){
-  _poll_cb = cb;
-  _poll_cb_arg = arg;
+  if(!_extend((bool)cb))
+    return;
+  _ext->poll_cb = cb;
+  _ext->poll_cb_arg = arg;
+}
+
+/*
+  Fires once outstanding() drops to low after it had reached high, so a
+  producer can top the pipe up while the rest of the window is still in
+  flight instead of waiting for onAck.
+*/
+void AsyncClient::onWritable(AcConnectHandler cb, void* arg, size_t low, size_t high){
+  if(high <= low)
+    high = low + 1;
+  _writable_armed = false;
+  if(!_extend(cb || low != ASYNC_WRITABLE_LOW || high != ASYNC_WRITABLE_HIGH)){
+    _armWritable();
+    return;
+  }
+  _ext->writable_cb = cb;
+  _ext->writable_cb_arg = arg;
+  _ext->writable_low = low;
+  _ext->writable_high = high;
+  _armWritable();
+}
+
+void AsyncClient::onProgress(AcAckHandler cb, void* arg){
+  if(!_extend((bool)cb))
+    return;
+  _ext->progress_cb = cb;
+  _ext->progress_cb_arg = arg;
 }
 
 
@@ -1004,6 +2484,15 @@ void AsyncClient::ackPacket(struct pbuf * pb){
   pbuf_free(pb);
 }
 
+void AsyncClient::ackPackets(struct pbuf * pb){
+  if(!pb){
+    return;
+  }
+  if(_pcb)
+    tcp_recved(_pcb, pb->tot_len);
+  pbuf_free(pb);
+}
+
 const char * AsyncClient::errorToString(err_t error) {
   switch (error) {
     case ERR_OK:         return "No error, everything OK";
@@ -1051,20 +2540,49 @@ const char * AsyncClient::stateToString(){
   Async TCP Server
 */
 struct pending_pcb {
+    AsyncServer * server;
     tcp_pcb* pcb;
     pbuf *pb;
+    bool throttled;   // counted in AsSslStats::throttled, lwIP retries are not
+    struct pending_pcb * prev;
     struct pending_pcb * next;
 };
 
+struct delayed_pcb {
+    AsyncServer * server;
+    tcp_pcb* pcb;
+    uint32_t since;
+    struct delayed_pcb * next;
+};
+
 AsyncServer::AsyncServer(IPAddress addr, uint16_t port)
   : _port(port)
   , _addr(addr)
   , _noDelay(false)
   , _pcb(0)
+  , _rate_bucket(NULL)
+  , _prio_class(AC_PRIO_NORMAL)
+  , _weight(1)
+  , _stats(NULL)
+  , _clients(NULL)
+  , _client_count(0)
+  , _walks(NULL)
+  , _max_clients(0)
+  , _max_per_ip(0)
+  , _min_heap(0)
+  , _admit_policy(AS_ADMIT_REFUSE)
+  , _admit_stats()
+  , _delayed(NULL)
+  , _pool_size(0)
+  , _pool(NULL)
   , _connect_cb(0)
   , _connect_cb_arg(0)
 #if ASYNC_TCP_SSL_ENABLED
   , _pending(NULL)
+  , _pending_tail(NULL)
+  , _max_handshakes(ASYNC_SSL_MAX_HANDSHAKES)
+  , _ssl_stats()
+  , _ssl_timer(&_s_pending_timer, this)
   , _ssl_ctx(NULL)
   , _file_cb(0)
   , _file_cb_arg(0)
@@ -1081,10 +2599,29 @@ AsyncServer::AsyncServer(uint16_t port)
   , _addr(IP_ANY_TYPE)
   , _noDelay(false)
   , _pcb(0)
+  , _rate_bucket(NULL)
+  , _prio_class(AC_PRIO_NORMAL)
+  , _weight(1)
+  , _stats(NULL)
+  , _clients(NULL)
+  , _client_count(0)
+  , _walks(NULL)
+  , _max_clients(0)
+  , _max_per_ip(0)
+  , _min_heap(0)
+  , _admit_policy(AS_ADMIT_REFUSE)
+  , _admit_stats()
+  , _delayed(NULL)
+  , _pool_size(0)
+  , _pool(NULL)
   , _connect_cb(0)
   , _connect_cb_arg(0)
 #if ASYNC_TCP_SSL_ENABLED
   , _pending(NULL)
+  , _pending_tail(NULL)
+  , _max_handshakes(ASYNC_SSL_MAX_HANDSHAKES)
+  , _ssl_stats()
+  , _ssl_timer(&_s_pending_timer, this)
   , _ssl_ctx(NULL)
   , _file_cb(0)
   , _file_cb_arg(0)
@@ -1098,6 +2635,20 @@ AsyncServer::AsyncServer(uint16_t port)
 
 AsyncServer::~AsyncServer(){
   end();
+  while(_clients){
+    AsyncClient *c = _clients;
+    _clients = c->_srv_next;
+    c->_server = NULL;
+    c->_srv_prev = NULL;
+    c->_srv_next = NULL;
+  }
+  _client_count = 0;
+  if(_pool){
+    _pool->destroy();
+    _pool = NULL;
+  }
+  delete _rate_bucket;
+  delete _stats;
 }
 
 void AsyncServer::onClient(AcConnectHandler cb, void* arg){
@@ -1116,13 +2667,16 @@ void AsyncServer::begin(){
   if(_pcb)
     return;
 
+  if(_pool_size && !_pool)
+    _pool = AsyncClientPool::make(_pool_size);
+
   int8_t err;
   tcp_pcb* pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
   if (!pcb){
     return;
   }
 
-  tcp_setprio(pcb, TCP_PRIO_MIN);
+  tcp_setprio(pcb, _tcpPrio(_prio_class));
   IPAddress local_addr;
   local_addr = _addr;
   err = tcp_bind(pcb, local_addr, _port);
@@ -1156,8 +2710,14 @@ void AsyncServer::beginSecure(const char *cert, const char *key, const char *pas
 #endif
 
 void AsyncServer::end(){
+  while(_delayed){
+    struct delayed_pcb * d = _delayed;
+    tcp_pcb * pcb = d->pcb;
+    _dropDelayed(d);
+    tcp_abort(pcb);
+  }
   if(_pcb){
-    //cleanup all connections?
+    // accepted clients stay connected, as they always have; see closeAll()
     tcp_arg(_pcb, NULL);
     tcp_accept(_pcb, NULL);
     if(tcp_close(_pcb) != ERR_OK){
@@ -1166,20 +2726,17 @@ void AsyncServer::end(){
     _pcb = NULL;
   }
 #if ASYNC_TCP_SSL_ENABLED
+  while(_pending){
+    tcp_pcb * pcb = _pending->pcb;
+    struct pbuf * kept = _dropPending(_pending);
+    if(kept)
+      pbuf_free(kept);
+    tcp_abort(pcb);
+  }
+  _ssl_timer.cancel();
   if(_ssl_ctx){
     ssl_ctx_free(_ssl_ctx);
     _ssl_ctx = NULL;
-    if(_pending){
-      struct pending_pcb * p;
-      while(_pending){
-        p = _pending;
-        _pending = _pending->next;
-        if(p->pb){
-          pbuf_free(p->pb);
-        }
-        free(p);
-      }
-    }
   }
 #endif
 }
@@ -1192,6 +2749,180 @@ bool AsyncServer::getNoDelay(){
   return _noDelay;
 }
 
+void AsyncServer::setRateLimit(uint32_t bytesPerSec, uint32_t burst){
+  if(!_rate_bucket){
+    if(bytesPerSec == 0)
+      return;
+    _rate_bucket = new (std::nothrow) AsyncTokenBucket();
+    if(!_rate_bucket)
+      return;
+  }
+  _rate_bucket->configure(bytesPerSec, burst);
+}
+
+// Clients come from the pool while it has free slots, else from the heap.
+AsyncClient *AsyncServer::_newClient(tcp_pcb* pcb){
+  AsyncClient *c = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+  if(_pool)
+    c = _pool->create(pcb, _ssl_ctx);
+  if(!c)
+    c = new (std::nothrow) AsyncClient(pcb, _ssl_ctx);
+#else
+  if(_pool)
+    c = _pool->create(pcb);
+  if(!c)
+    c = new (std::nothrow) AsyncClient(pcb);
+#endif
+  return c;
+}
+
+/*
+  Calls cb for every connected client. The walk stays valid whatever cb
+  does: closing or deleting the current or any other client, or starting
+  another walk. Clients accepted meanwhile are not visited.
+*/
+size_t AsyncServer::forEachClient(AcConnectHandler cb, void* arg){
+  if(!cb)
+    return 0;
+  as_client_walk walk = { _clients, _walks };
+  size_t count = 0;
+  _walks = &walk;
+  while(walk.next){
+    AsyncClient *c = walk.next;
+    walk.next = c->_srv_next;
+    cb(arg, c);
+    count++;
+  }
+  _walks = walk.outer;
+  return count;
+}
+
+size_t AsyncServer::closeAll(bool now){
+  return forEachClient([now](void *arg, AsyncClient *c){
+    (void)arg;
+    c->close(now);
+  });
+}
+
+size_t AsyncServer::abortIdle(uint32_t olderThan){
+  size_t count = 0;
+  uint32_t now = millis();
+  forEachClient([&count, now, olderThan](void *arg, AsyncClient *c){
+    (void)arg;
+    if((now - c->_rx_last_packet) >= olderThan){
+      count++;
+      c->abort();
+    }
+  });
+  return count;
+}
+
+/*
+  Broadcast payload, shared by every client it was queued to and freed by
+  the release handler of the last one to get it acked (or to go away).
+*/
+struct as_broadcast {
+    uint32_t refs;
+};
+
+static void _broadcastRelease(void *arg, const char *data, size_t len){
+  (void)data;
+  (void)len;
+  as_broadcast *b = reinterpret_cast<as_broadcast*>(arg);
+  if(--b->refs == 0)
+    ::free(b);
+}
+
+/*
+  Send the same data to every connected client. It is copied once and
+  queued to each connection by reference, behind whatever that connection
+  has queued already, so fan-out costs one payload however many clients
+  there are and however slowly they ack (secure clients still encrypt into
+  their own buffers as the data goes out). A client is lagging when it
+  still has data outstanding and the payload would take its outstanding()
+  past maxOutstanding (0 is no limit): it is skipped, or closed when
+  dropLagging is set. A client with nothing outstanding always gets the
+  payload. Returns the number of clients the data was queued to.
+*/
+size_t AsyncServer::broadcast(const char* data, size_t size, size_t maxOutstanding, bool dropLagging){
+  if(data == NULL || size == 0 || _clients == NULL)
+    return 0;
+  as_broadcast *b = (as_broadcast*)malloc(sizeof(as_broadcast) + size);
+  if(b == NULL){
+    ASYNC_TCP_DEBUG("broadcast: out of memory for %u bytes\n", size);
+    return 0;
+  }
+  b->refs = 1; // ours, dropped below
+  memcpy(b + 1, data, size);
+  const char *payload = (const char*)(b + 1);
+  size_t count = 0;
+  forEachClient([&](void *arg, AsyncClient *c){
+    (void)arg;
+    if(!c->connected())
+      return;
+    size_t outstanding = c->outstanding();
+    if(maxOutstanding && outstanding && outstanding + size > maxOutstanding){
+      if(dropLagging)
+        c->close(true);
+      return;
+    }
+    // Once queued the reference always gets its release call, even if the
+    // client goes away while the queue is kicked.
+    b->refs++;
+    if(!c->_enqueueRef(payload, size, &_broadcastRelease, b)){
+      b->refs--;
+      return;
+    }
+    count++;
+  });
+  _broadcastRelease(b, NULL, 0);
+  return count;
+}
+
+// Applied to every client this server creates.
+void AsyncServer::_setupClient(AsyncClient *c){
+  c->_server = this;
+  c->_srv_prev = NULL;
+  c->_srv_next = _clients;
+  if(_clients)
+    _clients->_srv_prev = c;
+  _clients = c;
+  _client_count++;
+  _admit_stats.accepted++;
+  c->setPriority((acPriority_t)_prio_class, _weight);
+}
+
+bool AsyncServer::setStats(bool enable){
+  if(!enable){
+    delete _stats;
+    _stats = NULL;
+    return true;
+  }
+  if(_stats == NULL)
+    _stats = new (std::nothrow) AsyncTCPStats();
+  return _stats != NULL;
+}
+
+bool AsyncServer::getStats(AsyncTCPStats &out, bool reset){
+  if(!_stats)
+    return false;
+  out = *_stats;
+  if(reset)
+    _stats->reset();
+  return true;
+}
+
+// Accepted pcbs inherit the priority of the listening pcb.
+void AsyncServer::setPriority(acPriority_t cls, uint8_t weight){
+  if(cls >= AC_PRIO_CLASSES)
+    cls = AC_PRIO_NORMAL;
+  _prio_class = cls;
+  _weight = weight ? weight : 1;
+  if(_pcb)
+    tcp_setprio(_pcb, _tcpPrio(_prio_class));
+}
+
 uint8_t AsyncServer::status(){
   if (!_pcb)
     return 0;
@@ -1213,6 +2944,19 @@ err_t AsyncServer::_accept(tcp_pcb* pcb, err_t err){
     return ERR_OK;
   }
 
+  if(_connect_cb && !_admissible(pcb)){
+    if(_admit_policy == AS_ADMIT_EVICT_IDLE && _evictIdle() && _admissible(pcb)){
+      _admit_stats.evicted++;
+    } else if(_admit_policy == AS_ADMIT_DELAY){
+      return _delay(pcb);
+    } else {
+      ASYNC_TCP_DEBUG("_accept: over limit, refused (%u clients)\n", _client_count);
+      _admit_stats.refused++;
+      tcp_abort(pcb);
+      return ERR_ABRT;
+    }
+  }
+
   if(_connect_cb){
 #if ASYNC_TCP_SSL_ENABLED
     if (_noDelay || _ssl_ctx)
@@ -1225,66 +2969,26 @@ err_t AsyncServer::_accept(tcp_pcb* pcb, err_t err){
 
 #if ASYNC_TCP_SSL_ENABLED
     if(_ssl_ctx){
-      if(tcp_ssl_has_client() || _pending){
-        struct pending_pcb * new_item = (struct pending_pcb*)malloc(sizeof(struct pending_pcb));
-        if(!new_item){
-          ASYNC_TCP_DEBUG("### malloc new pending failed!\n");
-          if(tcp_close(pcb) != ERR_OK){
-            tcp_abort(pcb);
-            return ERR_ABRT;
-          }
-          return ERR_OK;
-        }
-        //1 ASYNC_TCP_DEBUG("### put to wait: %d\n", _clients_waiting);
-        new_item->pcb = pcb;
-        new_item->pb = NULL;
-        new_item->next = NULL;
-        tcp_setprio(_pcb, TCP_PRIO_MIN);
-        tcp_arg(pcb, this);
-        tcp_poll(pcb, &_s_poll, 1);
-        tcp_recv(pcb, &_s_recv);
-
-        if(_pending == NULL){
-          _pending = new_item;
-        } else {
-          struct pending_pcb * p = _pending;
-          while(p->next != NULL)
-            p = p->next;
-          p->next = new_item;
-        }
-      } else {
-        AsyncClient *c = new (std::nothrow) AsyncClient(pcb, _ssl_ctx);
-        if(c){
-          ASYNC_TCP_DEBUG("_accept[%u]: SSL connected\n", c->getConnectionId());
-          c->onConnect([this](void * arg, AsyncClient *c){
-            (void)arg;
-            _connect_cb(_connect_cb_arg, c);
-          }, this);
-        } else {
-          ASYNC_TCP_DEBUG("_accept[_ssl_ctx]: new AsyncClient() failed, connection aborted!\n");
-          if(tcp_close(pcb) != ERR_OK){
-            tcp_abort(pcb);
-            return ERR_ABRT;
-          }
-        }
-      }
-      return ERR_OK;
+      if(_pending || tcp_ssl_server_handshakes() >= _max_handshakes)
+        return _queuePending(pcb);
+      return _startSecure(pcb, NULL);
     } else {
-      AsyncClient *c = new (std::nothrow) AsyncClient(pcb, NULL);
-#else
-      AsyncClient *c = new (std::nothrow) AsyncClient(pcb);
 #endif
+      AsyncClient *c = _newClient(pcb);
 
       if(c){
-        auto errorTracker = c->getACErrorTracker();
+        _setupClient(c);
+        ACErrorTracker errorTracker(c);
 #ifdef DEBUG_MORE
-        errorTracker->onErrorEvent(
+        errorTracker.onErrorEvent(
           [](void *obj, size_t ee){ ((AsyncServer*)(obj))->incEventCount(ee); },
           this);
 #endif
-        ASYNC_TCP_DEBUG("_accept[%u]: connected\n", errorTracker->getConnectionId());
+        ASYNC_TCP_DEBUG("_accept[%u]: connected\n", errorTracker.getConnectionId());
         _connect_cb(_connect_cb_arg, c);
-        return errorTracker->getCallbackCloseError();
+        if(errorTracker.hasClient())
+          c->_flushCork();
+        return errorTracker.getCallbackCloseError();
       } else {
         ASYNC_TCP_DEBUG("_accept: new AsyncClient() failed, connection aborted!\n");
         if(tcp_close(pcb) != ERR_OK){
@@ -1307,83 +3011,256 @@ err_t AsyncServer::_s_accept(void *arg, tcp_pcb* pcb, err_t err){
   return reinterpret_cast<AsyncServer*>(arg)->_accept(pcb, err);
 }
 
+/*
+  Admission control. A connection is admitted while the server is below
+  _max_clients, the remote address below _max_per_ip and the free heap above
+  _min_heap; any limit of 0 is off. Only clients with a live pcb count, and
+  secure connections waiting for a handshake slot, which are admitted already.
+*/
+bool AsyncServer::_admissible(tcp_pcb* pcb){
+  if(_min_heap && ESP.getFreeHeap() < _min_heap)
+    return false;
+  size_t total = _client_count;
 #if ASYNC_TCP_SSL_ENABLED
-err_t AsyncServer::_poll(tcp_pcb* pcb){
-  err_t err = ERR_OK;
-  if(!tcp_ssl_has_client() && _pending){
-    struct pending_pcb * p = _pending;
-    if(p->pcb == pcb){
-      _pending = _pending->next;
-    } else {
-      while(p->next && p->next->pcb != pcb) p = p->next;
-      if(!p->next) return 0;
-      struct pending_pcb * b = p->next;
-      p->next = b->next;
-      p = b;
+  total += _ssl_stats.depth;
+#endif
+  if(_max_clients && total >= _max_clients)
+    return false;
+  if(_max_per_ip){
+    size_t count = 0;
+    for(AsyncClient *c = _clients; c != NULL; c = c->_srv_next){
+      if(c->_pcb && ip_addr_cmp(&c->_pcb->remote_ip, &pcb->remote_ip) && ++count >= _max_per_ip)
+        return false;
     }
-    //1 ASYNC_TCP_DEBUG("### remove from wait: %d\n", _clients_waiting);
-    AsyncClient *c = new (std::nothrow) AsyncClient(pcb, _ssl_ctx);
-    if(c){
-      c->onConnect([this](void * arg, AsyncClient *c){
-        (void)arg;
-        _connect_cb(_connect_cb_arg, c);
-      }, this);
-      if(p->pb) {
-        auto errorTracker = c->getACErrorTracker();
-        c->_recv(errorTracker, pcb, p->pb, 0);
-        err = errorTracker->getCallbackCloseError();
-      }
+#if ASYNC_TCP_SSL_ENABLED
+    for(struct pending_pcb * p = _pending; p != NULL; p = p->next){
+      if(p->pcb && ip_addr_cmp(&p->pcb->remote_ip, &pcb->remote_ip) && ++count >= _max_per_ip)
+        return false;
     }
-    // Should there be error handling for when "new AsynClient" fails??
-    free(p);
+#endif
+  }
+  return true;
+}
+
+// Close the client that has been idle the longest with nothing left to send.
+bool AsyncServer::_evictIdle(){
+  AsyncClient *victim = NULL;
+  uint32_t now = millis();
+  for(AsyncClient *c = _clients; c != NULL; c = c->_srv_next){
+    if(!c->_pcb || c->outstanding())
+      continue;
+    if(victim == NULL || (now - c->_rx_last_packet) > (now - victim->_rx_last_packet))
+      victim = c;
+  }
+  if(victim == NULL)
+    return false;
+  ASYNC_TCP_DEBUG("_accept: evicting idle client 0x%" PRIXPTR "\n", uintptr_t(victim));
+  victim->close(true);
+  return true;
+}
+
+/*
+  Park a connection that is over the limit. Its pcb stays unaccepted (counted
+  against the listen backlog where lwIP has one), incoming data is refused so
+  lwIP keeps it, and its poll retries admission.
+*/
+err_t AsyncServer::_delay(tcp_pcb* pcb){
+  struct delayed_pcb * d = new (std::nothrow) delayed_pcb;
+  if(!d){
+    _admit_stats.refused++;
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  d->server = this;
+  d->pcb = pcb;
+  d->since = millis();
+  d->next = _delayed;
+  _delayed = d;
+  _admit_stats.delayed++;
+#if LWIP_VERSION_MAJOR != 1 && TCP_LISTEN_BACKLOG
+  tcp_backlog_delayed(pcb);
+#endif
+  tcp_arg(pcb, d);
+  tcp_recv(pcb, &_s_delayed_recv);
+  tcp_err(pcb, &_s_delayed_error);
+  tcp_poll(pcb, &_s_delayed_poll, 1);
+  return ERR_OK;
+}
+
+void AsyncServer::_dropDelayed(struct delayed_pcb * d){
+  struct delayed_pcb ** link = &_delayed;
+  while(*link && *link != d)
+    link = &(*link)->next;
+  if(*link)
+    *link = d->next;
+  if(d->pcb){
+    tcp_arg(d->pcb, NULL);
+    tcp_recv(d->pcb, NULL);
+    tcp_err(d->pcb, NULL);
+    tcp_poll(d->pcb, NULL, 0);
+#if LWIP_VERSION_MAJOR != 1 && TCP_LISTEN_BACKLOG
+    tcp_backlog_accepted(d->pcb);
+#endif
   }
-  return err;
+  delete d;
 }
 
-err_t AsyncServer::_recv(struct tcp_pcb *pcb, struct pbuf *pb, err_t err){
+err_t AsyncServer::_s_delayed_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err){
   (void)err;
-  if(!_pending)
-    return ERR_OK;
+  if(pb){
+    // keep it for the client we are about to create
+    return ERR_MEM;
+  }
+  // lwIP does not keep a refused FIN, the remote gave up while waiting
+  struct delayed_pcb * d = reinterpret_cast<struct delayed_pcb*>(arg);
+  AsyncServer * s = d->server;
+  s->_dropDelayed(d);
+  s->_admit_stats.refused++;
+  if(tcp_close(tpcb) != ERR_OK){
+    tcp_abort(tpcb);
+    return ERR_ABRT;
+  }
+  return ERR_OK;
+}
 
-  struct pending_pcb * p;
+err_t AsyncServer::_s_delayed_poll(void *arg, struct tcp_pcb *tpcb){
+  struct delayed_pcb * d = reinterpret_cast<struct delayed_pcb*>(arg);
+  AsyncServer * s = d->server;
+  if(s->_admissible(tpcb)){
+    s->_dropDelayed(d);
+    return s->_accept(tpcb, ERR_OK);
+  }
+  if((millis() - d->since) >= ASYNC_ADMIT_DELAY_MAX){
+    s->_dropDelayed(d);
+    s->_admit_stats.refused++;
+    tcp_abort(tpcb);
+    return ERR_ABRT;
+  }
+  return ERR_OK;
+}
 
-  if(!pb){
-    //1 ASYNC_TCP_DEBUG("### close from wait: %d\n", _clients_waiting);
-    p = _pending;
-    if(p->pcb == pcb){
-      _pending = _pending->next;
-    } else {
-      while(p->next && p->next->pcb != pcb) p = p->next;
-      if(!p->next) return 0;
-      struct pending_pcb * b = p->next;
-      p->next = b->next;
-      p = b;
-    }
-    if(p->pb){
-      pbuf_free(p->pb);
-    }
-    free(p);
-    size_t err = tcp_close(pcb);
-    if (err != ERR_OK) {
+void AsyncServer::_s_delayed_error(void *arg, err_t err){
+  (void)err;
+  struct delayed_pcb * d = reinterpret_cast<struct delayed_pcb*>(arg);
+  // the pcb is already freed
+  d->pcb = NULL;
+  d->server->_dropDelayed(d);
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+/*
+  Create the client of a secure connection. Its handshake goes on from the
+  data kept while it waited, if any.
+*/
+err_t AsyncServer::_startSecure(tcp_pcb* pcb, struct pbuf *pb){
+  AsyncClient *c = _newClient(pcb);
+  if(!c){
+    ASYNC_TCP_DEBUG("_accept[_ssl_ctx]: new AsyncClient() failed, connection aborted!\n");
+    if(pb)
+      pbuf_free(pb);
+    if(tcp_close(pcb) != ERR_OK){
       tcp_abort(pcb);
       return ERR_ABRT;
     }
-  } else {
-    //1 ASYNC_TCP_DEBUG("### wait _recv: %u %d\n", pb->tot_len, _clients_waiting);
-    p = _pending;
-    while(p && p->pcb != pcb)
-      p = p->next;
-    if(p){
-      if(p->pb){
-        pbuf_chain(p->pb, pb);
-      } else {
-        p->pb = pb;
-      }
+    return ERR_OK;
+  }
+  if(!c->_pcb){
+    // the handshake could not be set up and the connection is closed, the
+    // client (and its pool slot) goes back
+    ASYNC_TCP_DEBUG("_accept[_ssl_ctx]: tcp_ssl_new_server() failed, connection closed!\n");
+    err_t err = c->_errorState.close_error;
+    delete c;
+    if(pb)
+      pbuf_free(pb);
+    return (err == ERR_ABRT) ? ERR_ABRT : ERR_OK;
+  }
+  _setupClient(c);
+  ASYNC_TCP_DEBUG("_accept[%u]: SSL connected\n", c->getConnectionId());
+  c->onConnect([this](void * arg, AsyncClient *c){
+    (void)arg;
+    _connect_cb(_connect_cb_arg, c);
+  }, this);
+  if(!pb)
+    return ERR_OK;
+  ACErrorTracker errorTracker(c);
+  c->_recv(errorTracker, pcb, pb, 0);
+  return errorTracker.getCallbackCloseError();
+}
+
+/*
+  Park a secure connection until a handshake slot frees. The queue is FIFO,
+  the pcb's arg points at its entry, and what it receives meanwhile is kept
+  up to ASYNC_SSL_PENDING_MAX bytes.
+*/
+err_t AsyncServer::_queuePending(tcp_pcb* pcb){
+  struct pending_pcb * p = new (std::nothrow) pending_pcb;
+  if(!p){
+    ASYNC_TCP_DEBUG("### malloc new pending failed!\n");
+    if(tcp_close(pcb) != ERR_OK){
+      tcp_abort(pcb);
+      return ERR_ABRT;
     }
+    return ERR_OK;
   }
+  p->server = this;
+  p->pcb = pcb;
+  p->pb = NULL;
+  p->throttled = false;
+  p->prev = _pending_tail;
+  p->next = NULL;
+  if(_pending_tail)
+    _pending_tail->next = p;
+  else
+    _pending = p;
+  _pending_tail = p;
+  _ssl_stats.queued++;
+  if(++_ssl_stats.depth > _ssl_stats.peak)
+    _ssl_stats.peak = _ssl_stats.depth;
+  tcp_setprio(pcb, _tcpPrio(_prio_class));
+  tcp_arg(pcb, p);
+  tcp_recv(pcb, &_s_pending_recv);
+  tcp_err(pcb, &_s_pending_error);
+  tcp_poll(pcb, &_s_pending_poll, 1);
   return ERR_OK;
 }
 
+// Takes p off the queue, returning the data kept for it.
+struct pbuf * AsyncServer::_dropPending(struct pending_pcb * p){
+  if(p->prev)
+    p->prev->next = p->next;
+  else
+    _pending = p->next;
+  if(p->next)
+    p->next->prev = p->prev;
+  else
+    _pending_tail = p->prev;
+  _ssl_stats.depth--;
+  if(p->pcb){
+    tcp_arg(p->pcb, NULL);
+    tcp_recv(p->pcb, NULL);
+    tcp_err(p->pcb, NULL);
+    tcp_poll(p->pcb, NULL, 0);
+  }
+  struct pbuf * pb = p->pb;
+  delete p;
+  return pb;
+}
+
+/*
+  A handshake slot may have freed. Waiting connections are started from
+  the timer rather than here, so that a client never gets created inside
+  another connection's callbacks.
+*/
+void AsyncServer::_kickPending(){
+  if(_pending && !_ssl_timer.armed())
+    _ssl_timer.arm(0);
+}
+
+void AsyncServer::setMaxHandshakes(uint8_t count){
+  _max_handshakes = count ? count : 1;
+  _kickPending();
+}
+
 int AsyncServer::_cert(const char *filename, uint8_t **buf){
   if(_file_cb){
     return _file_cb(_file_cb_arg, filename, buf);
@@ -1396,11 +3273,65 @@ int AsyncServer::_s_cert(void *arg, const char *filename, uint8_t **buf){
   return reinterpret_cast<AsyncServer*>(arg)->_cert(filename, buf);
 }
 
-err_t AsyncServer::_s_poll(void *arg, struct tcp_pcb *pcb){
-  return reinterpret_cast<AsyncServer*>(arg)->_poll(pcb);
+void AsyncServer::_s_pending_timer(AsyncTimer *timer, void *arg){
+  (void)timer;
+  AsyncServer * s = reinterpret_cast<AsyncServer*>(arg);
+  while(s->_pending && tcp_ssl_server_handshakes() < s->_max_handshakes){
+    struct pending_pcb * p = s->_pending;
+    tcp_pcb * pcb = p->pcb;
+    struct pbuf * pb = s->_dropPending(p);
+    s->_ssl_stats.promoted++;
+    s->_startSecure(pcb, pb);
+  }
+}
+
+err_t AsyncServer::_s_pending_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err){
+  (void)err;
+  struct pending_pcb * p = reinterpret_cast<struct pending_pcb*>(arg);
+  AsyncServer * s = p->server;
+  if(!pb){
+    struct pbuf * kept = s->_dropPending(p);
+    if(kept)
+      pbuf_free(kept);
+    s->_ssl_stats.dropped++;
+    if(tcp_close(tpcb) != ERR_OK){
+      tcp_abort(tpcb);
+      return ERR_ABRT;
+    }
+    return ERR_OK;
+  }
+  if(p->pb){
+    if((size_t)p->pb->tot_len + pb->tot_len > ASYNC_SSL_PENDING_MAX){
+      // lwIP keeps it and hands it to the client once there is one
+      if(!p->throttled){
+        p->throttled = true;
+        s->_ssl_stats.throttled++;
+      }
+      return ERR_MEM;
+    }
+    pbuf_cat(p->pb, pb);
+  } else {
+    p->pb = pb;
+  }
+  return ERR_OK;
+}
+
+err_t AsyncServer::_s_pending_poll(void *arg, struct tcp_pcb *tpcb){
+  (void)tpcb;
+  // also catches slots freed by the connections of other servers
+  reinterpret_cast<struct pending_pcb*>(arg)->server->_kickPending();
+  return ERR_OK;
 }
 
-err_t AsyncServer::_s_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *pb, err_t err){
-  return reinterpret_cast<AsyncServer*>(arg)->_recv(pcb, pb, err);
+void AsyncServer::_s_pending_error(void *arg, err_t err){
+  (void)err;
+  struct pending_pcb * p = reinterpret_cast<struct pending_pcb*>(arg);
+  AsyncServer * s = p->server;
+  // the pcb is already freed
+  p->pcb = NULL;
+  struct pbuf * kept = s->_dropPending(p);
+  if(kept)
+    pbuf_free(kept);
+  s->_ssl_stats.dropped++;
 }
 #endif
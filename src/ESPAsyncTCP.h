@@ -24,8 +24,14 @@
 
 #include <async_config.h>
 #include "IPAddress.h"
+#include "AsyncRingBuffer.h"
+#include "AsyncTCPStats.h"
+#include "AsyncTimerWheel.h"
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 extern "C" {
     #include "lwip/init.h"
@@ -36,8 +42,11 @@ extern "C" {
 class AsyncClient;
 class AsyncServer;
 class ACErrorTracker;
+class AsyncSendScheduler;
+class AsyncClientPool;
 
 #define ASYNC_MAX_ACK_TIME 5000
+#define ASYNC_SSL_HANDSHAKE_TIMEOUT 2000
 #define ASYNC_WRITE_FLAG_COPY 0x01 //will allocate new buffer to hold the data while sending (else will hold reference to the data given)
 #define ASYNC_WRITE_FLAG_MORE 0x02 //will not send PSH flag, meaning that there should be more data to be sent before the application should react.
 
@@ -55,8 +64,101 @@ typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAc
 typedef std::function<void(void*, AsyncClient*, err_t error)> AcErrorHandler;
 typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
 typedef std::function<void(void*, AsyncClient*, struct pbuf *pb)> AcPacketHandler;
+struct AcDataVec;
+typedef std::function<void(void*, AsyncClient*, const AcDataVec *vec, size_t count, size_t total)> AcDataVecHandler;
 typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
 typedef std::function<void(void*, size_t event)> AsNotifyHandler;
+typedef std::function<void(void*, const char *data, size_t len)> AcReleaseHandler;
+
+// One fragment of a scatter/gather send, see AsyncClient::addv().
+// Unless ASYNC_WRITE_FLAG_COPY is given, the data is referenced by the stack
+// and must stay valid until the release handler has been called. On SSL
+// connections the data is encrypted right away and the release handlers
+// run before addv() returns.
+struct AcSendFragment {
+  const char *data;
+  size_t len;
+  uint8_t flags;              // ASYNC_WRITE_FLAG_COPY to have this fragment copied
+  AcReleaseHandler release;   // called once the fragment has been acked (or the connection is gone)
+  void *release_arg;
+};
+struct ac_release_item;
+
+// Payload of one pbuf of a received chain, see AsyncClient::onDataVec().
+struct AcDataVec {
+  char *data;
+  size_t len;
+};
+
+// End of the sequence space buffered by one tcp_output() and when it happened.
+struct ac_send_mark {
+  uint32_t end;
+  uint32_t time;
+};
+
+// Bytes the send scheduler handed to the stack, the last len before end in
+// ac_client_tx::added_total terms.
+struct ac_sched_span {
+  uint32_t end;
+  uint32_t len;
+};
+
+// Byte rate limiter used to pace the send queue, see AsyncClient::setRateLimit().
+// A rate of 0 means unlimited.
+class AsyncTokenBucket {
+  private:
+    uint32_t _rate;     // bytes per second
+    uint32_t _burst;    // bucket depth in bytes
+    uint32_t _tokens;
+    uint32_t _stamp;    // millis() the tokens were last brought up to date
+
+  public:
+    AsyncTokenBucket(): _rate(0), _burst(0), _tokens(0), _stamp(0) {}
+    void configure(uint32_t rate, uint32_t burst);
+    uint32_t rate() const { return _rate; }
+    uint32_t burst() const { return _burst; }
+    size_t available(uint32_t now);
+    void take(size_t len);
+};
+
+// Priority classes for AsyncClient::setPriority(). The send scheduler serves
+// higher classes first, and the class picks the lwIP pcb priority used when
+// lwIP has to kill connections to free memory. Normal keeps the historical
+// TCP_PRIO_MIN; nothing is below it, so bulk shares it.
+typedef enum {
+  AC_PRIO_BULK,
+  AC_PRIO_NORMAL,
+  AC_PRIO_CONTROL,
+  AC_PRIO_CLASSES
+} acPriority_t;
+
+/*
+  Hands out send space to the queued data of all connections. Disabled by
+  default; with a budget set, the bytes in flight from all send queues
+  together stay within it. Classes are served strictly in priority order,
+  connections of the same class deficit-round-robin by weight.
+*/
+class AsyncSendScheduler {
+  private:
+    static size_t _budget;
+    static size_t _inflight;
+    static bool _running;
+    static AsyncClient *_head[AC_PRIO_CLASSES];
+    static AsyncClient *_tail[AC_PRIO_CLASSES];
+
+  protected:
+    friend class AsyncClient;
+    static bool enabled(){ return _budget != 0; }
+    static void activate(AsyncClient *c);
+    static void detach(AsyncClient *c);
+    static void release(size_t len);
+    static void run();
+
+  public:
+    static void setBudget(size_t bytes);//bytes in flight over all send queues, 0 disables the scheduler
+    static size_t getBudget(){ return _budget; }
+    static size_t inFlight(){ return _inflight; }
+};
 
 enum error_events {
   EE_OK = 0,
@@ -70,19 +172,41 @@ enum error_events {
 // DEBUG_MORE is for gathering more information on which CBs close events are
 // occuring and count.
 // #define DEBUG_MORE 1
-class ACErrorTracker {
-  private:
-    AsyncClient *_client;
-    err_t _close_error;
-    int _errored;
+// Close/abort state of a connection, kept inside its AsyncClient.
+struct ACErrorState {
+  err_t close_error;
+  uint8_t errored;
 #if DEBUG_ESP_ASYNC_TCP
-    size_t _connectionId;
+  size_t connectionId;
 #endif
 #ifdef DEBUG_MORE
-    AsNotifyHandler _error_event_cb;
-    void* _error_event_cb_arg;
+  AsNotifyHandler error_event_cb;
+  void* error_event_cb_arg;
 #endif
 
+  void setCloseError(err_t e);
+  void setErrored(size_t errorEvent);
+  err_t getCallbackCloseError(void);
+};
+
+/*
+  Guards one entry from lwIP into an AsyncClient. It lives on the stack of
+  the callback and is linked into the client, so it costs no allocation.
+  When the client is deleted while guards are live, ~AsyncClient() unlinks
+  them and leaves each a copy of the close state, so hasClient() turns false
+  and getCallbackCloseError() still reports ERR_ABRT exactly once.
+*/
+class ACErrorTracker {
+  private:
+    AsyncClient *_client;
+    ACErrorState *_state;
+    ACErrorTracker *_outer;   // enclosing guard on the same client
+    ACErrorState _saved;
+
+    ACErrorTracker(const ACErrorTracker &);
+    ACErrorTracker &operator=(const ACErrorTracker &);
+    void _detach();
+
   protected:
     friend class AsyncClient;
     friend class AsyncServer;
@@ -90,25 +214,111 @@ class ACErrorTracker {
     void onErrorEvent(AsNotifyHandler cb, void *arg);
 #endif
 #if DEBUG_ESP_ASYNC_TCP
-    void setConnectionId(size_t id) { _connectionId=id;}
-    size_t getConnectionId(void) { return _connectionId;}
+    size_t getConnectionId(void) { return _state->connectionId;}
 #endif
-    void setCloseError(err_t e);
-    void setErrored(size_t errorEvent);
-    err_t getCallbackCloseError(void);
-    void clearClient(void){ if (_client) _client = NULL;}
+    void setCloseError(err_t e){ _state->setCloseError(e);}
+    void setErrored(size_t errorEvent){ _state->setErrored(errorEvent);}
+    err_t getCallbackCloseError(void){ return _state->getCallbackCloseError();}
 
   public:
-    err_t getCloseError(void) const { return _close_error;}
+    err_t getCloseError(void) const { return _state->close_error;}
     bool hasClient(void) const { return (_client != NULL);}
     ACErrorTracker(AsyncClient *c);
-    ~ACErrorTracker() {}
+    ~ACErrorTracker();
+};
+
+/*
+  Callbacks and receive options few applications use. AsyncClient allocates
+  this on the first onPacket(), onPoll(), setRecvCoalesce()... so
+  connections that only use the common callbacks do not carry seven more
+  std::function objects.
+*/
+struct ac_client_ext {
+  AcPacketHandler pb_cb;
+  void* pb_cb_arg;
+  AcPacketHandler chain_cb;
+  void* chain_cb_arg;
+  AcDataVecHandler vec_cb;
+  void* vec_cb_arg;
+  AcTimeoutHandler timeout_cb;
+  void* timeout_cb_arg;
+  AcConnectHandler poll_cb;
+  void* poll_cb_arg;
+  AcConnectHandler writable_cb;
+  void* writable_cb_arg;
+  AcAckHandler progress_cb;
+  void* progress_cb_arg;
+  uint32_t writable_low;
+  uint32_t writable_high;
+  pbuf *rx_hold;            // segments held back by setRecvCoalesce()
+  uint32_t rx_hold_since;
+  uint32_t rx_coalesce_bytes;
+  uint32_t rx_coalesce_ms;
+  uint32_t rx_limit;        // see setRxBufferLimit()
+  uint32_t rx_held;         // delivered, not yet consume()d
+  uint32_t rx_withheld;     // delivered, tcp_recved() pending
+};
+
+/*
+  Send side state, allocated on the first enqueue(), addv() with release
+  handlers, setCork(true), setRateLimit() or the first send while earlier
+  data is still unacked. A connection with one request in flight at a time
+  never needs it.
+*/
+struct ac_client_tx {
+  AsyncRingBuffer txq;
+  uint32_t txq_in;          // bytes ever written to / drained from txq
+  uint32_t txq_out;
+  ac_release_item *ref_head;  // queued by reference, behind txq up to their txq_in mark
+  ac_release_item *ref_tail;
+  uint32_t ref_off;         // bytes of ref_head already handed to the stack
+  uint32_t ref_bytes;       // bytes of the queued references still to send
+  ac_release_item *release_head;
+  ac_release_item *release_tail;
+  AsyncTokenBucket *bucket;
+  AsyncClient *sched_prev;
+  AsyncClient *sched_next;
+  uint32_t deficit;
+  uint32_t sched_inflight;
+  ac_sched_span sched_spans[ASYNC_SCHED_SPANS];  // where sched_inflight is, see _schedAcked()
+  uint8_t sched_span_head;
+  uint8_t sched_span_count;
+  uint32_t added_total;     // byte counters the release records are kept against
+  uint32_t acked_total;
+  uint32_t cork_pending;
+  uint32_t cork_saved;
+  ac_send_mark marks[ASYNC_SEND_MARKS];
+  uint8_t mark_head;
+  uint8_t mark_count;
+};
+
+/*
+  Plain function pointer hooks, one per std::function callback of
+  AsyncClient. Filled in at compile time by AsyncClientT; a NULL entry
+  means the handler does not take that event.
+*/
+struct AcHandlerTable {
+  void (*connect)(AsyncClient *c);
+  void (*disconnect)(AsyncClient *c);
+  void (*ack)(AsyncClient *c, size_t len, uint32_t time);
+  void (*error)(AsyncClient *c, err_t error);
+  void (*data)(AsyncClient *c, void *data, size_t len);
+  void (*packet)(AsyncClient *c, struct pbuf *pb);
+  void (*timeout)(AsyncClient *c, uint32_t time);
+  void (*poll)(AsyncClient *c);
+  void (*chain)(AsyncClient *c, struct pbuf *pb);
+  void (*vec)(AsyncClient *c, const AcDataVec *vec, size_t count, size_t total);
+  void (*writable)(AsyncClient *c);
+  void (*progress)(AsyncClient *c, size_t len, uint32_t time);
 };
 
 class AsyncClient {
   protected:
+    friend class ACErrorTracker;
     friend class AsyncTCPbuffer;
+    friend class SyncClient;
     friend class AsyncServer;
+    friend class AsyncSendScheduler;
     tcp_pcb* _pcb;
     AcConnectHandler _connect_cb;
     void* _connect_cb_arg;
@@ -120,38 +330,102 @@ class AsyncClient {
     void* _error_cb_arg;
     AcDataHandler _recv_cb;
     void* _recv_cb_arg;
-    AcPacketHandler _pb_cb;
-    void* _pb_cb_arg;
-    AcTimeoutHandler _timeout_cb;
-    void* _timeout_cb_arg;
-    AcConnectHandler _poll_cb;
-    void* _poll_cb_arg;
-    bool _pcb_busy;
-#if ASYNC_TCP_SSL_ENABLED
-    bool _pcb_secure;
-    bool _handshake_done;
-#endif
-    uint32_t _pcb_sent_at;
-    bool _close_pcb;
-    bool _ack_pcb;
+    ac_client_ext *_ext;              // rarely used callbacks, see _extend()
+    ac_client_tx *_tx;                // send queue and friends, see _txState()
+    const AcHandlerTable *_handlers;  // AsyncClientT hooks, used before the std::function callbacks
+    void *_handlers_arg;              // owner for the hooks of SyncClient and AsyncTCPbuffer
+    uint32_t _pcb_sent_at;  // send time of the oldest unacked data
+    uint32_t _pcb_sent_end; // end of the data sent last, see _markSent()
     uint32_t _tx_unacked_len;
     uint32_t _tx_acked_len;
     uint32_t _rx_ack_len;
     uint32_t _rx_last_packet;
-    uint32_t _rx_since_timeout;
+    uint32_t _rx_since_timeout;  // ms
     uint32_t _ack_timeout;
+    AsyncTCPStats *_stats;
+    AsyncServer *_server;       // admission accounting, pacing and stats, see AsyncServer::setMaxClients()
+    AsyncClient *_srv_prev;
+    AsyncClient *_srv_next;
+    ACErrorTracker *_trackers;  // live guards, innermost first
+    AsyncTimer _timer;          // earliest ack, RX idle, handshake or coalescing deadline
+    ACErrorState _errorState;
     uint16_t _connect_port;
     u8_t _recv_pbuf_flags;
-    std::shared_ptr<ACErrorTracker> _errorTracker;
+    uint8_t _prio_class;
+    uint8_t _weight;
+    bool _writable_armed : 1;
+    bool _pcb_busy : 1;
+#if ASYNC_TCP_SSL_ENABLED
+    bool _pcb_secure : 1;
+    bool _handshake_done : 1;
+#endif
+    bool _close_pcb : 1;
+    bool _ack_pcb : 1;
+    bool _cork : 1;
+    bool _sched_active : 1;
 
     void _close();
-    void _connected(std::shared_ptr<ACErrorTracker>& closeAbort, void* pcb, err_t err);
-    void _error(err_t err);
+    void _releaseFragments(bool all);
+    size_t _drainQueue(size_t limit = SIZE_MAX);
+    size_t _drainRing(size_t limit);
+    size_t _drainRef(size_t limit);
+    bool _reserveQueue(size_t len);
+    bool _enqueueRef(const char* data, size_t len, AcReleaseHandler release, void* arg);
+    void _kickQueue();
+    void _schedDetach();
+    void _schedSent(size_t len);
+    size_t _schedAcked();
+    void _clearQueue();
+    bool _output();
+    void _flushCork(){ if(_tx && _tx->cork_pending && _pcb) _output(); }
+    bool _queueEmpty() const { return !_tx || (_tx->txq.empty() && !_tx->ref_head); }
+    size_t _txAllowance(size_t room);
+    void _txTake(size_t len);
+    void _recordStats(uint32_t ackTime);
+    bool _hasConnectCb() const { return (_handlers && _handlers->connect) || _connect_cb; }
+    bool _hasDataCb() const { return (_handlers && _handlers->data) || _recv_cb; }
+    bool _hasPacketCb() const { return (_handlers && _handlers->packet) || (_ext && _ext->pb_cb); }
+    bool _hasChainCb() const { return (_handlers && _handlers->chain) || (_ext && _ext->chain_cb); }
+    bool _hasVecCb() const { return (_handlers && _handlers->vec) || (_ext && _ext->vec_cb); }
+    bool _hasWritableCb() const { return (_handlers && _handlers->writable) || (_ext && _ext->writable_cb); }
+    bool _hasProgressCb() const { return (_handlers && _handlers->progress) || (_ext && _ext->progress_cb); }
+    void _connectCb(){ if(_handlers && _handlers->connect) _handlers->connect(this); else if(_connect_cb) _connect_cb(_connect_cb_arg, this); }
+    void _discardCb(){ if(_handlers && _handlers->disconnect) _handlers->disconnect(this); else if(_discard_cb) _discard_cb(_discard_cb_arg, this); }
+    void _ackCb(size_t len, uint32_t time){ if(_handlers && _handlers->ack) _handlers->ack(this, len, time); else if(_sent_cb) _sent_cb(_sent_cb_arg, this, len, time); }
+    void _errorCb(err_t err){ if(_handlers && _handlers->error) _handlers->error(this, err); else if(_error_cb) _error_cb(_error_cb_arg, this, err); }
+    void _dataCb(void *data, size_t len){ if(_handlers && _handlers->data) _handlers->data(this, data, len); else if(_recv_cb) _recv_cb(_recv_cb_arg, this, data, len); }
+    void _packetCb(pbuf *pb){ if(_handlers && _handlers->packet) _handlers->packet(this, pb); else if(_ext && _ext->pb_cb) _ext->pb_cb(_ext->pb_cb_arg, this, pb); }
+    void _timeoutCb(uint32_t time){ if(_handlers && _handlers->timeout) _handlers->timeout(this, time); else if(_ext && _ext->timeout_cb) _ext->timeout_cb(_ext->timeout_cb_arg, this, time); }
+    void _pollCb(){ if(_handlers && _handlers->poll) _handlers->poll(this); else if(_ext && _ext->poll_cb) _ext->poll_cb(_ext->poll_cb_arg, this); }
+    void _chainCb(pbuf *pb){ if(_handlers && _handlers->chain) _handlers->chain(this, pb); else _ext->chain_cb(_ext->chain_cb_arg, this, pb); }
+    void _vecCb(const AcDataVec *vec, size_t count, size_t total){ if(_handlers && _handlers->vec) _handlers->vec(this, vec, count, total); else _ext->vec_cb(_ext->vec_cb_arg, this, vec, count, total); }
+    void _writableCb(){ if(_handlers && _handlers->writable) _handlers->writable(this); else _ext->writable_cb(_ext->writable_cb_arg, this); }
+    void _progressCb(size_t len, uint32_t time){ if(_handlers && _handlers->progress) _handlers->progress(this, len, time); else _ext->progress_cb(_ext->progress_cb_arg, this, len, time); }
+    size_t _writableLow() const { return _ext ? _ext->writable_low : ASYNC_WRITABLE_LOW; }
+    size_t _writableHigh() const { return _ext ? _ext->writable_high : ASYNC_WRITABLE_HIGH; }
+    void _armWritable(){ if(_hasWritableCb() && outstanding() >= _writableHigh()) _writable_armed = true; }
+    ac_client_ext *_extend(bool create);
+    ac_client_tx *_txState(bool create);
+    bool _bindHandlers(const AcHandlerTable *table, void *owner);
+    void _unbindHandlers(const AcHandlerTable *table);
+    void _markSent(uint32_t now);
+    void _armTimeouts();
+    void _timeouts(ACErrorTracker& closeAbort);
+    uint32_t _ackMarks();
+    void _connected(ACErrorTracker& closeAbort, void* pcb, err_t err);
+    void _error(ACErrorTracker& errorTracker, err_t err);
 #if ASYNC_TCP_SSL_ENABLED
     void _ssl_error(int8_t err);
 #endif
-    void _poll(std::shared_ptr<ACErrorTracker>& closeAbort, tcp_pcb* pcb);
-    void _sent(std::shared_ptr<ACErrorTracker>& closeAbort, tcp_pcb* pcb, uint16_t len);
+    void _poll(ACErrorTracker& closeAbort, tcp_pcb* pcb);
+    void _recved(tcp_pcb* pcb, size_t len);
+    void _deliverRecv(ACErrorTracker& closeAbort, tcp_pcb* pcb, pbuf* pb);
+    pbuf* _holdRecv(pbuf* pb, bool flush);
+    bool _holdExpired(uint32_t now);
+    void _freeHold();
+    void _serverDetach();
+    void _recvVec(ACErrorTracker& closeAbort, tcp_pcb* pcb, pbuf* pb);
+    void _sent(ACErrorTracker& closeAbort, tcp_pcb* pcb, uint16_t len);
 #if LWIP_VERSION_MAJOR == 1
     void _dns_found(struct ip_addr *ipaddr);
 #else
@@ -162,6 +436,7 @@ class AsyncClient {
     static void _s_error(void *arg, err_t err);
     static err_t _s_sent(void *arg, struct tcp_pcb *tpcb, uint16_t len);
     static err_t _s_connected(void* arg, void* tpcb, err_t err);
+    static void _s_timer(AsyncTimer *timer, void *arg);
 #if LWIP_VERSION_MAJOR == 1
     static void _s_dns_found(const char *name, struct ip_addr *ipaddr, void *arg);
 #else
@@ -172,19 +447,25 @@ class AsyncClient {
     static void _s_handshake(void *arg, struct tcp_pcb *tcp, SSL *ssl);
     static void _s_ssl_error(void *arg, struct tcp_pcb *tcp, int8_t err);
 #endif
-    std::shared_ptr<ACErrorTracker> getACErrorTracker(void) const { return _errorTracker; };
-    void setCloseError(err_t e) const { _errorTracker->setCloseError(e);}
+    void setCloseError(err_t e){ _errorState.setCloseError(e);}
 
   public:
     AsyncClient* prev;
     AsyncClient* next;
 
+    // pooled clients go back to their AsyncClientPool; new is declared
+    // alongside so the two always pair up
+    static void *operator new(size_t size);
+    static void *operator new(size_t size, const std::nothrow_t &tag) noexcept;
+    static void *operator new(size_t size, void *where) noexcept { (void)size; return where; }
+    static void operator delete(void *p);
+
 #if ASYNC_TCP_SSL_ENABLED
     AsyncClient(tcp_pcb* pcb = 0, SSL_CTX * ssl_ctx = NULL);
 #else
     AsyncClient(tcp_pcb* pcb = 0);
 #endif
-    ~AsyncClient();
+    virtual ~AsyncClient();
 
     AsyncClient & operator=(const AsyncClient &other);
     AsyncClient & operator+=(const AsyncClient &other);
@@ -209,12 +490,31 @@ class AsyncClient {
     bool canSend();//ack is not pending
     size_t space();
     size_t add(const char* data, size_t size, uint8_t apiflags=0);//add for sending
+    size_t addv(const AcSendFragment *frags, size_t count, uint8_t apiflags=0);//add several fragments at once, all or nothing
     bool send();//send all data added with the method above
+    size_t enqueue(const char* data, size_t size);//copy into the send queue, sent as space becomes available
+    size_t queued(){ return _tx ? _tx->txq.available() + _tx->ref_bytes : 0; } //bytes still waiting in the send queue
+    size_t outstanding(){ return _tx_unacked_len + queued(); } //bytes not yet acked by the peer, queued or in flight
+    void setCork(bool cork);//coalesce add()/send() until a full MSS, the end of the callback (next timer tick from loop()) or flush()
+    bool getCork(){ return _cork; }
+    bool flush();//push out corked data now
+    uint32_t getCorkSaved(){ return _tx ? _tx->cork_saved : 0; } //tcp_output() calls avoided by cork mode
+    void setRateLimit(uint32_t bytesPerSec, uint32_t burst = 0);//pace the send queue, 0 disables
+    uint32_t getRateLimit(){ return (_tx && _tx->bucket) ? _tx->bucket->rate() : 0; }
+    void setPriority(acPriority_t cls, uint8_t weight = 1);//send scheduler class and weight
+    acPriority_t getPriority(){ return (acPriority_t)_prio_class; }
+    bool setStats(bool enable);//collect ack latency and RTT histograms
+    bool getStats(AsyncTCPStats &out, bool reset = false);//false if collection is off
     size_t ack(size_t len); //ack data that you have not acked using the method below
     void ackLater(){ _ack_pcb = false; } //will not ack the current packet. Call from onData
+    void setRxBufferLimit(size_t bytes);//close the window while the application holds this much, 0 disables
+    size_t getRxBufferLimit(){ return _ext ? _ext->rx_limit : 0; }
+    size_t consume(size_t len);//the application is done with len bytes from onData/onDataVec
+    size_t rxHeld(){ return _ext ? _ext->rx_held : 0; }
     bool isRecvPush(){ return !!(_recv_pbuf_flags & PBUF_FLAG_PUSH); }
+    void setRecvCoalesce(size_t bytes, uint32_t ms = 0);//hold onData/onDataVec data until PSH, bytes or ms; bytes 0 disables, ms 0 is no time limit, bytes is capped below TCP_WND
 #if DEBUG_ESP_ASYNC_TCP
-    size_t getConnectionId(void) const { return _errorTracker->getConnectionId();}
+    size_t getConnectionId(void) const { return _errorState.connectionId;}
 #endif
 #if ASYNC_TCP_SSL_ENABLED
     SSL *getSSL();
@@ -222,6 +522,7 @@ class AsyncClient {
 
     size_t write(const char* data);
     size_t write(const char* data, size_t size, uint8_t apiflags=0); //only when canSend() == true
+    size_t writev(const AcSendFragment *frags, size_t count, uint8_t apiflags=0); //addv() + send()
 
     uint8_t state();
     bool connecting();
@@ -233,6 +534,8 @@ class AsyncClient {
     uint16_t getMss();
     uint32_t getRxTimeout();
     void setRxTimeout(uint32_t timeout);//no RX data timeout for the connection in seconds
+    uint32_t getRxTimeoutMs(){ return _rx_since_timeout; }
+    void setRxTimeoutMs(uint32_t timeout);//same, in milliseconds
     uint32_t getAckTimeout();
     void setAckTimeout(uint32_t timeout);//no ACK timeout for the last sent packet in milliseconds
     void setNoDelay(bool nodelay);
@@ -251,21 +554,198 @@ class AsyncClient {
     void onError(AcErrorHandler cb, void* arg = 0);         //unsuccessful connect or error
     void onData(AcDataHandler cb, void* arg = 0);           //data received (called if onPacket is not used)
     void onPacket(AcPacketHandler cb, void* arg = 0);       //data received
+    void onPacketChain(AcPacketHandler cb, void* arg = 0);  //whole pbuf chain received, release with ackPackets()
+    void onDataVec(AcDataVecHandler cb, void* arg = 0);     //whole pbuf chain received as views, acked once after the call
     void onTimeout(AcTimeoutHandler cb, void* arg = 0);     //ack timeout
     void onPoll(AcConnectHandler cb, void* arg = 0);        //every 125ms when connected
+    void onWritable(AcConnectHandler cb, void* arg = 0, size_t low = ASYNC_WRITABLE_LOW, size_t high = ASYNC_WRITABLE_HIGH); //outstanding() fell to low after reaching high
+    void onProgress(AcAckHandler cb, void* arg = 0);        //every ack, also partial ones
     void ackPacket(struct pbuf * pb);
+    void ackPackets(struct pbuf * pb); //free a chain from onPacketChain() with a single window update
 
-    const char * errorToString(err_t error);
+    static const char * errorToString(err_t error);
     const char * stateToString();
 
-    void _recv(std::shared_ptr<ACErrorTracker>& closeAbort, tcp_pcb* pcb, pbuf* pb, err_t err);
-    err_t getCloseError(void) const { return _errorTracker->getCloseError();}
+    void _recv(ACErrorTracker& closeAbort, tcp_pcb* pcb, pbuf* pb, err_t err);
+    err_t getCloseError(void) const { return _errorState.close_error;}
+};
+
+/*
+  Base for AsyncClientT handlers. Declare only the events you want; the ones
+  left to these no-op defaults get a NULL hook and cost nothing.
+*/
+struct AsyncClientHandler {
+  void onConnect(AsyncClient *c){ (void)c; }
+  void onDisconnect(AsyncClient *c){ (void)c; }
+  void onAck(AsyncClient *c, size_t len, uint32_t time){ (void)c; (void)len; (void)time; }
+  void onError(AsyncClient *c, err_t error){ (void)c; (void)error; }
+  void onData(AsyncClient *c, void *data, size_t len){ (void)c; (void)data; (void)len; }
+  void onPacket(AsyncClient *c, struct pbuf *pb){ (void)c; (void)pb; }
+  void onTimeout(AsyncClient *c, uint32_t time){ (void)c; (void)time; }
+  void onPoll(AsyncClient *c){ (void)c; }
+  void onPacketChain(AsyncClient *c, struct pbuf *pb){ (void)c; (void)pb; }
+  void onDataVec(AsyncClient *c, const AcDataVec *vec, size_t count, size_t total){ (void)c; (void)vec; (void)count; (void)total; }
+  void onWritable(AsyncClient *c){ (void)c; }
+  void onProgress(AsyncClient *c, size_t len, uint32_t time){ (void)c; (void)len; (void)time; }
+};
+
+// True when H declares its own f rather than inheriting AsyncClientHandler's.
+#define AC_HANDLES(H, f) (!std::is_same<decltype(&H::f), decltype(&AsyncClientHandler::f)>::value)
+
+/*
+  AsyncClient with its callbacks in a function pointer table instead of
+  std::function members. The library code is not a template: every
+  AsyncClient carries a pointer to an AcHandlerTable, and an event checks
+  it and makes one indirect call into a thunk made for Handler, with
+  Handler's member inlined there. Handler lives inside the client, so its
+  state takes no heap of its own the way a std::function capture can; the
+  std::function members stay in AsyncClient, so the object itself is not
+  smaller. Callbacks set with onData() and friends still work for the
+  events Handler does not declare. tests/host/bench_dispatch compares the
+  two ways.
+
+    struct Echo : AsyncClientHandler {
+      void onData(AsyncClient *c, void *data, size_t len){ c->write((const char*)data, len); }
+    };
+    AsyncClientT<Echo> *client = new AsyncClientT<Echo>();
+
+  ~AsyncClient() is virtual, so the client may be deleted through an
+  AsyncClient pointer, from onDisconnect() too. ~AsyncClientT() closes the
+  connection while Handler is still alive, so Handler sees onDisconnect(),
+  then destroys it.
+*/
+template<class Handler>
+class AsyncClientT : public AsyncClient {
+  private:
+    typename std::aligned_storage<sizeof(Handler), alignof(Handler)>::type _storage;
+    static const AcHandlerTable _table;
+
+    static Handler &_h(AsyncClient *c){ return static_cast<AsyncClientT*>(c)->handler(); }
+    static void _connect(AsyncClient *c){ _h(c).onConnect(c); }
+    static void _disconnect(AsyncClient *c){ _h(c).onDisconnect(c); }
+    static void _ack(AsyncClient *c, size_t len, uint32_t time){ _h(c).onAck(c, len, time); }
+    static void _error(AsyncClient *c, err_t error){ _h(c).onError(c, error); }
+    static void _data(AsyncClient *c, void *data, size_t len){ _h(c).onData(c, data, len); }
+    static void _packet(AsyncClient *c, struct pbuf *pb){ _h(c).onPacket(c, pb); }
+    static void _timeout(AsyncClient *c, uint32_t time){ _h(c).onTimeout(c, time); }
+    static void _poll(AsyncClient *c){ _h(c).onPoll(c); }
+    static void _chain(AsyncClient *c, struct pbuf *pb){ _h(c).onPacketChain(c, pb); }
+    static void _vec(AsyncClient *c, const AcDataVec *vec, size_t count, size_t total){ _h(c).onDataVec(c, vec, count, total); }
+    static void _writable(AsyncClient *c){ _h(c).onWritable(c); }
+    static void _progress(AsyncClient *c, size_t len, uint32_t time){ _h(c).onProgress(c, len, time); }
+
+  public:
+    AsyncClientT(){ new (&_storage) Handler(); _handlers = &_table; }
+    explicit AsyncClientT(const Handler &handler){ new (&_storage) Handler(handler); _handlers = &_table; }
+    ~AsyncClientT(){
+      if(_pcb)
+        _close();
+      _handlers = NULL;
+      handler().~Handler();
+    }
+    Handler &handler(){ return *reinterpret_cast<Handler*>(&_storage); }
+};
+
+template<class Handler>
+const AcHandlerTable AsyncClientT<Handler>::_table = {
+  AC_HANDLES(Handler, onConnect) ? &AsyncClientT::_connect : NULL,
+  AC_HANDLES(Handler, onDisconnect) ? &AsyncClientT::_disconnect : NULL,
+  AC_HANDLES(Handler, onAck) ? &AsyncClientT::_ack : NULL,
+  AC_HANDLES(Handler, onError) ? &AsyncClientT::_error : NULL,
+  AC_HANDLES(Handler, onData) ? &AsyncClientT::_data : NULL,
+  AC_HANDLES(Handler, onPacket) ? &AsyncClientT::_packet : NULL,
+  AC_HANDLES(Handler, onTimeout) ? &AsyncClientT::_timeout : NULL,
+  AC_HANDLES(Handler, onPoll) ? &AsyncClientT::_poll : NULL,
+  AC_HANDLES(Handler, onPacketChain) ? &AsyncClientT::_chain : NULL,
+  AC_HANDLES(Handler, onDataVec) ? &AsyncClientT::_vec : NULL,
+  AC_HANDLES(Handler, onWritable) ? &AsyncClientT::_writable : NULL,
+  AC_HANDLES(Handler, onProgress) ? &AsyncClientT::_progress : NULL
+};
+
+/*
+  Fixed set of AsyncClient slots made in one allocation. create()
+  constructs a client in a free slot and delete on the client returns it,
+  so once the pool exists accepting a connection does not touch the heap.
+  Free slots are linked through their own storage, so both are O(1), and
+  deleting a client from the heap costs one range check.
+*/
+class AsyncClientPool {
+  private:
+    char *_mem;
+    uint8_t *_state;
+    void *_free;            // first free slot, each holds the next one
+    size_t _capacity;
+    size_t _slot_size;
+    size_t _used;
+    size_t _high_water;
+    uint32_t _misses;
+    bool _orphan;
+    AsyncClientPool *_next;
+    static AsyncClientPool *_pools;
+    static const char *_lo;  // lowest and highest slot address of all pools
+    static const char *_hi;
+
+    AsyncClientPool(size_t capacity);
+    ~AsyncClientPool();
+    static void _span();
+    static AsyncClientPool *_find(const void *p, size_t *index);
+    void _clear(size_t index);
+    void *_slot(size_t index) const { return _mem + index * _slot_size; }
+
+  protected:
+    friend class AsyncClient;
+    friend class AsyncServer;
+    static bool release(void *p);
+
+  public:
+    static AsyncClientPool *make(size_t capacity);
+    void destroy(); //freed once the last slot is returned
+#if ASYNC_TCP_SSL_ENABLED
+    AsyncClient *create(tcp_pcb *pcb, SSL_CTX *ssl_ctx);
+#else
+    AsyncClient *create(tcp_pcb *pcb);
+#endif
+    size_t capacity() const { return _capacity; }
+    size_t used() const { return _used; }
+    size_t highWater() const { return _high_water; }
+    uint32_t misses() const { return _misses; } //create() found no free slot
 };
 
 #if ASYNC_TCP_SSL_ENABLED
 typedef std::function<int(void* arg, const char *filename, uint8_t **buf)> AcSSlFileHandler;
 struct pending_pcb;
+
+// Queue of secure connections waiting for a handshake slot.
+struct AsSslStats {
+  uint32_t queued;      // had to wait
+  uint32_t promoted;    // got their handshake after waiting
+  uint32_t dropped;     // closed or failed while waiting
+  uint32_t throttled;   // had data refused at ASYNC_SSL_PENDING_MAX
+  uint16_t depth;       // waiting now
+  uint16_t peak;        // most waiting at once
+};
 #endif
+struct delayed_pcb;
+
+// What AsyncServer does with a connection that is over one of its limits.
+typedef enum {
+  AS_ADMIT_REFUSE,      // reset it
+  AS_ADMIT_DELAY,       // hold it unaccepted until a slot frees, up to ASYNC_ADMIT_DELAY_MAX
+  AS_ADMIT_EVICT_IDLE   // close the longest idle client to make room, else refuse
+} asAdmitPolicy_t;
+
+struct AsAdmitStats {
+  uint32_t accepted;
+  uint32_t refused;
+  uint32_t delayed;
+  uint32_t evicted;
+};
+
+// Position of a forEachClient() walk, moved on when its next client leaves.
+struct as_client_walk {
+  AsyncClient *next;
+  struct as_client_walk *outer;
+};
 
 
 class AsyncServer {
@@ -274,10 +754,29 @@ class AsyncServer {
     IPAddress _addr;
     bool _noDelay;
     tcp_pcb* _pcb;
+    AsyncTokenBucket *_rate_bucket;  // shared by the clients, looked up through AsyncClient::_server
+    uint8_t _prio_class;
+    uint8_t _weight;
+    AsyncTCPStats *_stats;
+    AsyncClient *_clients;      // connected clients, newest first
+    size_t _client_count;
+    struct as_client_walk * _walks;
+    size_t _max_clients;
+    size_t _max_per_ip;
+    size_t _min_heap;
+    asAdmitPolicy_t _admit_policy;
+    AsAdmitStats _admit_stats;
+    struct delayed_pcb * _delayed;
+    size_t _pool_size;
+    AsyncClientPool *_pool;
     AcConnectHandler _connect_cb;
     void* _connect_cb_arg;
 #if ASYNC_TCP_SSL_ENABLED
-    struct pending_pcb * _pending;
+    struct pending_pcb * _pending;      // oldest first
+    struct pending_pcb * _pending_tail;
+    uint8_t _max_handshakes;
+    AsSslStats _ssl_stats;
+    AsyncTimer _ssl_timer;
     SSL_CTX * _ssl_ctx;
     AcSSlFileHandler _file_cb;
     void* _file_cb_arg;
@@ -295,28 +794,61 @@ class AsyncServer {
 #if ASYNC_TCP_SSL_ENABLED
     void onSslFileRequest(AcSSlFileHandler cb, void* arg);
     void beginSecure(const char *cert, const char *private_key_file, const char *password);
+    void setMaxHandshakes(uint8_t count); //at once for all servers, the rest wait in order
+    const AsSslStats & getSslStats(){ return _ssl_stats; }
 #endif
     void begin();
-    void end();
+    void end(); //stop listening, accepted clients stay connected
     void setNoDelay(bool nodelay);
     bool getNoDelay();
+    void setRateLimit(uint32_t bytesPerSec, uint32_t burst = 0);//aggregate pacing of all accepted clients
+    uint32_t getRateLimit(){ return _rate_bucket ? _rate_bucket->rate() : 0; }
+    void setPriority(acPriority_t cls, uint8_t weight = 1);//applied to accepted clients
+    bool setStats(bool enable);//aggregate histograms of clients accepted from now on
+    bool getStats(AsyncTCPStats &out, bool reset = false);
+    void setMaxClients(size_t count){ _max_clients = count; } //0 is unlimited
+    void setMaxClientsPerIP(size_t count){ _max_per_ip = count; } //0 is unlimited
+    void setMinFreeHeap(size_t bytes){ _min_heap = bytes; } //admit only while more heap is free
+    void setAdmitPolicy(asAdmitPolicy_t policy){ _admit_policy = policy; }
+    size_t clientCount(){ return _client_count; }
+    size_t forEachClient(AcConnectHandler cb, void* arg = 0); //cb may close or delete any client
+    size_t closeAll(bool now = false); //e.g. before end() to drop the accepted clients too
+    size_t abortIdle(uint32_t olderThan); //ms without data in either direction
+    size_t broadcast(const char* data, size_t size, size_t maxOutstanding = ASYNC_BROADCAST_MAX_OUTSTANDING, bool dropLagging = false); //one shared copy for all clients, 0 is no lag limit
+    const AsAdmitStats & getAdmitStats(){ return _admit_stats; }
+    void setClientPool(size_t capacity){ _pool_size = capacity; } //preallocate client slots at begin()
+    const AsyncClientPool *getClientPool(){ return _pool; }
     uint8_t status();
 #ifdef DEBUG_MORE
     int getEventCount(size_t ee) const { return _event_count[ee];}
 #endif
   protected:
+    friend class AsyncClient;
     err_t _accept(tcp_pcb* newpcb, err_t err);
+    void _setupClient(AsyncClient *c);
+    AsyncClient *_newClient(tcp_pcb* pcb);
+    bool _admissible(tcp_pcb* pcb);
+    bool _evictIdle();
+    err_t _delay(tcp_pcb* pcb);
+    void _dropDelayed(struct delayed_pcb * d);
+    static err_t _s_delayed_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err);
+    static err_t _s_delayed_poll(void *arg, struct tcp_pcb *tpcb);
+    static void _s_delayed_error(void *arg, err_t err);
     static err_t _s_accept(void *arg, tcp_pcb* newpcb, err_t err);
 #ifdef DEBUG_MORE
     int incEventCount(size_t ee) { return ++_event_count[ee];}
 #endif
 #if ASYNC_TCP_SSL_ENABLED
     int _cert(const char *filename, uint8_t **buf);
-    err_t _poll(tcp_pcb* pcb);
-    err_t _recv(tcp_pcb *pcb, struct pbuf *pb, err_t err);
     static int _s_cert(void *arg, const char *filename, uint8_t **buf);
-    static err_t _s_poll(void *arg, struct tcp_pcb *tpcb);
-    static err_t _s_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err);
+    err_t _startSecure(tcp_pcb* pcb, struct pbuf *pb);
+    err_t _queuePending(tcp_pcb* pcb);
+    struct pbuf * _dropPending(struct pending_pcb * p);
+    void _kickPending();
+    static void _s_pending_timer(AsyncTimer *timer, void *arg);
+    static err_t _s_pending_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, err_t err);
+    static err_t _s_pending_poll(void *arg, struct tcp_pcb *tpcb);
+    static void _s_pending_error(void *arg, err_t err);
 #endif
 };
 
@@ -36,15 +36,23 @@ AsyncTCPbuffer::AsyncTCPbuffer(AsyncClient* client) {
     }
 
     _client = client;
-    _TXbufferWrite = new (std::nothrow) cbuf(TCP_MSS);
-    _TXbufferRead = _TXbufferWrite;
-    _RXbuffer = new (std::nothrow) cbuf(100);
+    _RXbuffer = new (std::nothrow) AsyncRingBuffer(ATB_RX_BUFFER_SIZE);
     _RXmode = ATB_RX_MODE_FREE;
     _rxSize = 0;
     _rxTerminator = 0x00;
     _rxReadBytesPtr = NULL;
+    _rxReadCount = 0;
     _rxReadStringPtr = NULL;
+    _rxFrameHeader = 2;
+    _rxFrameBigEndian = true;
+    _rxFrameMax = TCP_MSS;
+    _rxShrinkIdle = ATB_RX_SHRINK_IDLE;
+    _rxShrinkHeap = ATB_RX_SHRINK_HEAP;
+    _rxLastData = 0;
+    _rxResizes = 0;
+    _rxPeak = ATB_RX_BUFFER_SIZE;
     _cbDisconnect = NULL;
+    _cbFrame = NULL;
 
     _cbRX = NULL;
     _cbDone = NULL;
@@ -60,22 +68,6 @@ AsyncTCPbuffer::~AsyncTCPbuffer() {
         delete _RXbuffer;
         _RXbuffer = NULL;
     }
-
-    if(_TXbufferWrite) {
-        // will be deleted in _TXbufferRead chain
-        _TXbufferWrite = NULL;
-    }
-
-    if(_TXbufferRead) {
-        cbuf * next = _TXbufferRead->next;
-        delete _TXbufferRead;
-        while(next != NULL) {
-            _TXbufferRead = next;
-            next = _TXbufferRead->next;
-            delete _TXbufferRead;
-        }
-        _TXbufferRead = NULL;
-    }
 }
 
 size_t AsyncTCPbuffer::write(String & data) {
@@ -95,63 +87,35 @@ size_t AsyncTCPbuffer::write(const char *data, size_t len) {
 }
 
 /**
- * write data in to buffer and try to send the data
+ * write data in to the send queue of the client, it is sent out as the peer acks
  * @param data
  * @param len
  * @return
  */
 size_t AsyncTCPbuffer::write(const uint8_t *data, size_t len) {
-    if(_TXbufferWrite == NULL || _client == NULL || !_client->connected() || data == NULL || len == 0) {
+    if(_client == NULL || !_client->connected() || data == NULL || len == 0) {
         return 0;
     }
 
-    size_t bytesLeft = len;
-    while(bytesLeft) {
-        size_t w = _TXbufferWrite->write((const char*) data, bytesLeft);
-        bytesLeft -= w;
-        data += w;
-        _sendBuffer();
-
-        // add new buffer since we have more data
-        if(_TXbufferWrite->full() && bytesLeft > 0) {
-
-            // to less ram!!!
-            if(ESP.getFreeHeap() < 4096) {
-                DEBUG_ASYNC_TCP("[A-TCP] run out of Heap can not send all Data!\n");
-                return (len - bytesLeft);
-            }
-
-            cbuf * next = new (std::nothrow) cbuf(TCP_MSS);
-            if(next == NULL) {
-                DEBUG_ASYNC_TCP("[A-TCP] run out of Heap!\n");
-                panic();
-            } else {
-                DEBUG_ASYNC_TCP("[A-TCP] new cbuf\n");
-            }
-
-            // add new buffer to chain (current cbuf)
-            _TXbufferWrite->next = next;
-
-            // move ptr for next data
-            _TXbufferWrite = next;
-        }
+    // to less ram!!!
+    if(_client->queued() > 0 && ESP.getFreeHeap() < 4096) {
+        DEBUG_ASYNC_TCP("[A-TCP] run out of Heap can not send all Data!\n");
+        return 0;
     }
 
-    return len;
-
+    size_t w = _client->enqueue((const char*) data, len);
+    if(w != len) {
+        DEBUG_ASYNC_TCP("[A-TCP] run out of Heap, queued %d of %d!\n", w, len);
+    }
+    return w;
 }
 
 /**
  * wait until all data has send out
  */
 void AsyncTCPbuffer::flush() {
-    while(!_TXbufferWrite->empty()) {
-        while(connected() && !_client->canSend()) {
-          delay(0);
-        }
-        if(!connected())
-          return;
-        _sendBuffer();
+    while(connected() && _client->queued() > 0) {
+        delay(0);
     }
 }
 
@@ -172,21 +136,23 @@ void AsyncTCPbuffer::readStringUntil(char terminator, String * str, AsyncTCPbuff
     _RXmode = ATB_RX_MODE_TERMINATOR_STRING;
 }
 
-/*
- void AsyncTCPbuffer::readBytesUntil(char terminator, char *buffer, size_t length, AsyncTCPbufferDoneCb done) {
- _RXmode = ATB_RX_MODE_NONE;
- _cbDone = done;
- _rxReadBytesPtr = (uint8_t *) buffer;
- _rxTerminator = terminator;
- _rxSize = length;
- _RXmode = ATB_RX_MODE_TERMINATOR;
- _handleRxBuffer(NULL, 0);
- }
-
- void AsyncTCPbuffer::readBytesUntil(char terminator, uint8_t *buffer, size_t length, AsyncTCPbufferDoneCb done) {
- readBytesUntil(terminator, (char *) buffer, length, done);
- }
- */
+void AsyncTCPbuffer::readBytesUntil(char terminator, char *buffer, size_t length, AsyncTCPbufferDoneCb done) {
+    if(_client == NULL) {
+        return;
+    }
+    DEBUG_ASYNC_TCP("[A-TCP] readBytesUntil terminator: %02X length: %d\n", terminator, length);
+    _RXmode = ATB_RX_MODE_NONE;
+    _cbDone = done;
+    _rxReadBytesPtr = (uint8_t *) buffer;
+    _rxReadCount = 0;
+    _rxTerminator = terminator;
+    _rxSize = length;
+    _RXmode = ATB_RX_MODE_TERMINATOR;
+}
+
+void AsyncTCPbuffer::readBytesUntil(char terminator, uint8_t *buffer, size_t length, AsyncTCPbufferDoneCb done) {
+    readBytesUntil(terminator, (char *) buffer, length, done);
+}
 
 void AsyncTCPbuffer::readBytes(char *buffer, size_t length, AsyncTCPbufferDoneCb done) {
     if(_client == NULL) {
@@ -215,10 +181,32 @@ void AsyncTCPbuffer::onData(AsyncTCPbufferDataCb cb) {
     _RXmode = ATB_RX_MODE_FREE;
 }
 
+void AsyncTCPbuffer::onFrame(AsyncTCPbufferFrameCb cb, uint8_t headerSize, bool bigEndian, size_t maxSize) {
+    if(_client == NULL) {
+        return;
+    }
+    if(headerSize < 1 || headerSize > 4) {
+        headerSize = 2;
+    }
+    DEBUG_ASYNC_TCP("[A-TCP] onFrame header: %d max: %d\n", headerSize, maxSize);
+    _RXmode = ATB_RX_MODE_NONE;
+    _cbDone = NULL;
+    _cbFrame = cb;
+    _rxFrameHeader = headerSize;
+    _rxFrameBigEndian = bigEndian;
+    _rxFrameMax = maxSize;
+    _RXmode = ATB_RX_MODE_FRAME;
+}
+
 void AsyncTCPbuffer::onDisconnect(AsyncTCPbufferDisconnectCb cb) {
     _cbDisconnect = cb;
 }
 
+void AsyncTCPbuffer::setRxShrink(uint32_t idleMs, size_t lowHeap) {
+    _rxShrinkIdle = idleMs;
+    _rxShrinkHeap = lowHeap;
+}
+
 IPAddress AsyncTCPbuffer::remoteIP() {
     if(!_client) {
         return IPAddress(0U);
@@ -279,25 +267,6 @@ void AsyncTCPbuffer::_attachCallbacks() {
     }
     DEBUG_ASYNC_TCP("[A-TCP] attachCallbacks\n");
 
-    _client->onPoll([](void *obj, AsyncClient* c) {
-        (void)c;
-        AsyncTCPbuffer* b = ((AsyncTCPbuffer*)(obj));
-        if((b->_TXbufferRead != NULL) && !b->_TXbufferRead->empty()) {
-            b->_sendBuffer();
-        }
-        //    if(!b->_RXbuffer->empty()) {
-        //       b->_handleRxBuffer(NULL, 0);
-        //   }
-    }, this);
-
-    _client->onAck([](void *obj, AsyncClient* c, size_t len, uint32_t time) {
-        (void)c;
-        (void)len;
-        (void)time;
-        DEBUG_ASYNC_TCP("[A-TCP] onAck\n");
-        ((AsyncTCPbuffer*)(obj))->_sendBuffer();
-    }, this);
-
     _client->onDisconnect([](void *obj, AsyncClient* c) {
         DEBUG_ASYNC_TCP("[A-TCP] onDisconnect\n");
         AsyncTCPbuffer* b = ((AsyncTCPbuffer*)(obj));
@@ -318,66 +287,43 @@ void AsyncTCPbuffer::_attachCallbacks() {
         b->_rxData((uint8_t *)buf, len);
     }, this);
 
-    _client->onTimeout([](void *obj, AsyncClient* c, uint32_t time){
-        (void)obj;
-        (void)time;
-        DEBUG_ASYNC_TCP("[A-TCP] onTimeout\n");
-        c->close();
-    }, this);
+    if(!_client->_bindHandlers(&_handlers, this)) {
+        // an AsyncClientT keeps its own table
+        _client->onPoll([](void *obj, AsyncClient* c) {
+            (void)c;
+            AsyncTCPbuffer* b = ((AsyncTCPbuffer*)(obj));
+            b->_rxShrink(true);
+        }, this);
+
+        _client->onTimeout([](void *obj, AsyncClient* c, uint32_t time){
+            (void)obj;
+            _s_timeout(c, time);
+        }, this);
+    }
 
     DEBUG_ASYNC_TCP("[A-TCP] attachCallbacks Done.\n");
 }
 
 /**
- * send TX buffer if possible
+ * poll and ack timeout come through a handler table rather than
+ * onPoll()/onTimeout(), so the client does not allocate its side table
  */
-void AsyncTCPbuffer::_sendBuffer() {
-    //DEBUG_ASYNC_TCP("[A-TCP] _sendBuffer...\n");
-    size_t available = _TXbufferRead->available();
-    if(available == 0 || _client == NULL || !_client->connected() || !_client->canSend()) {
-        return;
-    }
-
-    while(connected() && (_client->space() > 0) && (_TXbufferRead->available() > 0) && _client->canSend()) {
-
-        available = _TXbufferRead->available();
-
-        if(available > _client->space()) {
-            available = _client->space();
-        }
-
-        char *out = new (std::nothrow) char[available];
-        if(out == NULL) {
-            DEBUG_ASYNC_TCP("[A-TCP] to less heap, try later.\n");
-            return;
-        }
-
-        // read data from buffer
-        _TXbufferRead->peek(out, available);
-
-        // send data
-        size_t send = _client->write((const char*) out, available);
-        if(send != available) {
-            DEBUG_ASYNC_TCP("[A-TCP] write failed send: %d available: %d \n", send, available);
-            if(!connected()) {
-                DEBUG_ASYNC_TCP("[A-TCP] incomplete transfer, connection lost.\n");
-            }
-        }
-
-        // remove really send data from buffer
-        _TXbufferRead->remove(send);
-
-        // if buffer is empty and there is a other buffer in chain delete the empty one
-        if(_TXbufferRead->available() == 0 && _TXbufferRead->next != NULL) {
-            cbuf * old = _TXbufferRead;
-            _TXbufferRead = _TXbufferRead->next;
-            delete old;
-            DEBUG_ASYNC_TCP("[A-TCP] delete cbuf\n");
-        }
-
-        delete out;
-    }
+const AcHandlerTable AsyncTCPbuffer::_handlers = {
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    &AsyncTCPbuffer::_s_timeout,
+    &AsyncTCPbuffer::_s_poll,
+    NULL, NULL, NULL, NULL
+};
+
+void AsyncTCPbuffer::_s_timeout(AsyncClient *c, uint32_t time) {
+    (void)time;
+    DEBUG_ASYNC_TCP("[A-TCP] onTimeout\n");
+    c->close();
+}
 
+void AsyncTCPbuffer::_s_poll(AsyncClient *c) {
+    AsyncTCPbuffer* b = ((AsyncTCPbuffer*)(c->_handlers_arg));
+    b->_rxShrink(true);
 }
 
 /**
@@ -395,6 +341,7 @@ void AsyncTCPbuffer::_rxData(uint8_t *buf, size_t len) {
         return;
     }
     DEBUG_ASYNC_TCP("[A-TCP] _rxData len: %d RXmode: %d\n", len, _RXmode);
+    _rxLastData = millis();
 
     size_t handled = 0;
 
@@ -416,9 +363,16 @@ void AsyncTCPbuffer::_rxData(uint8_t *buf, size_t len) {
     if(len > 0) {
 
         if(_RXbuffer->room() < len) {
-            // to less space
+            // to less space, grow geometrically
             DEBUG_ASYNC_TCP("[A-TCP] _rxData buffer full try resize\n");
-            _RXbuffer->resizeAdd((len + _RXbuffer->room()));
+            size_t capacity = _RXbuffer->capacity();
+            _RXbuffer->reserve(len);
+            if(_RXbuffer->capacity() != capacity) {
+                _rxResizes++;
+                if(_RXbuffer->capacity() > _rxPeak) {
+                    _rxPeak = _RXbuffer->capacity();
+                }
+            }
 
             if(_RXbuffer->room() < len) {
                 DEBUG_ASYNC_TCP("[A-TCP] _rxData buffer to full can only handle %d!!!\n", _RXbuffer->room());
@@ -437,10 +391,26 @@ void AsyncTCPbuffer::_rxData(uint8_t *buf, size_t len) {
     }
 
     // clean up ram
-    if(_RXbuffer->empty() && _RXbuffer->room() != 100) {
-        _RXbuffer->resize(100);
-    }
+    _rxShrink(false);
+}
 
+/**
+ * return an empty grown RX buffer to ATB_RX_BUFFER_SIZE once it has been
+ * idle for _rxShrinkIdle ms (checked from poll), or right away on low heap
+ * @param idle called from poll
+ */
+void AsyncTCPbuffer::_rxShrink(bool idle) {
+    if(!_RXbuffer || !_RXbuffer->empty() || _RXbuffer->capacity() <= ATB_RX_BUFFER_SIZE) {
+        return;
+    }
+    bool lowHeap = ESP.getFreeHeap() < _rxShrinkHeap;
+    if(!lowHeap && !(idle && (millis() - _rxLastData) >= _rxShrinkIdle)) {
+        return;
+    }
+    DEBUG_ASYNC_TCP("[A-TCP] _rxShrink from %d\n", _RXbuffer->capacity());
+    if(_RXbuffer->resize(ATB_RX_BUFFER_SIZE)) {
+        _rxResizes++;
+    }
 }
 
 /**
@@ -464,13 +434,27 @@ size_t AsyncTCPbuffer::_handleRxBuffer(uint8_t *buf, size_t len) {
         }
 
         if(BufferAvailable > 0) {
-            uint8_t * b = new (std::nothrow) uint8_t[BufferAvailable];
-            if(b == NULL){
-              panic(); //TODO: What action should this be ?
+            // hand the buffered data over span by span, no copy needed
+            AsyncRingSpan spans[2];
+            size_t count = _RXbuffer->readSpans(spans);
+            for(size_t i = 0; i < count; i++) {
+                size_t h = _cbRX((uint8_t *) spans[i].data, spans[i].len);
+                r += h;
+                if(h != spans[i].len) {
+                    break;
+                }
+            }
+            _RXbuffer->consume(r);
+
+            if(count == 2 && r < spans[0].len) {
+                // the callback may only take whole records and one straddles
+                // the end of the ring, offer the rest again in one piece
+                _RXbuffer->linearize();
+                _RXbuffer->readSpans(spans);
+                size_t h = _cbRX((uint8_t *) spans[0].data, spans[0].len);
+                _RXbuffer->consume(h);
+                r += h;
             }
-            _RXbuffer->peek((char *) b, BufferAvailable);
-            r = _cbRX(b, BufferAvailable);
-            _RXbuffer->remove(r);
         }
 
         if(r == BufferAvailable && buf && (len > 0)) {
@@ -511,45 +495,171 @@ size_t AsyncTCPbuffer::_handleRxBuffer(uint8_t *buf, size_t len) {
         // add left over bytes to Buffer
         return newReadCount;
 
-    } else if(_RXmode == ATB_RX_MODE_TERMINATOR) {
-        // TODO implement read terminator non string
-
-    } else if(_RXmode == ATB_RX_MODE_TERMINATOR_STRING) {
-        if(_rxReadStringPtr == NULL || _cbDone == NULL) {
+    } else if(_RXmode == ATB_RX_MODE_TERMINATOR || _RXmode == ATB_RX_MODE_TERMINATOR_STRING) {
+        if(_cbDone == NULL) {
+            return 0;
+        }
+        if(_RXmode == ATB_RX_MODE_TERMINATOR ? (_rxReadBytesPtr == NULL) : (_rxReadStringPtr == NULL)) {
             return 0;
         }
 
+        bool done = false;
+        size_t newReadCount = 0;
+
         // handle Buffer
         if(BufferAvailable > 0) {
-            while(!_RXbuffer->empty()) {
-                char c = _RXbuffer->read();
-                if(c == _rxTerminator || c == 0x00) {
-                    _RXmode = ATB_RX_MODE_NONE;
-                    _cbDone(true, _rxReadStringPtr);
-                    return 0;
-                } else {
-                    (*_rxReadStringPtr) += c;
-                }
+            AsyncRingSpan spans[2];
+            size_t count = _RXbuffer->readSpans(spans);
+            for(size_t i = 0; i < count && !done; i++) {
+                r += _scanTerminator((const uint8_t *) spans[i].data, spans[i].len, &done);
             }
+            _RXbuffer->consume(r);
         }
 
-        if(_RXbuffer->empty() && (len > 0) && buf) {
-            size_t newReadCount = 0;
-            while(newReadCount < len) {
-                char c = (char) *buf;
-                buf++;
-                newReadCount++;
-                if(c == _rxTerminator || c == 0x00) {
-                    _RXmode = ATB_RX_MODE_NONE;
-                    _cbDone(true, _rxReadStringPtr);
-                    return newReadCount;
-                } else {
-                    (*_rxReadStringPtr) += c;
-                }
+        if(!done && _RXbuffer->empty() && (len > 0) && buf) {
+            newReadCount = _scanTerminator(buf, len, &done);
+        }
+
+        if(done) {
+            if(_RXmode == ATB_RX_MODE_TERMINATOR) {
+                _RXmode = ATB_RX_MODE_NONE;
+                _cbDone(true, &_rxReadCount);
+            } else {
+                _RXmode = ATB_RX_MODE_NONE;
+                _cbDone(true, _rxReadStringPtr);
+            }
+        }
+        return newReadCount;
+
+    } else if(_RXmode == ATB_RX_MODE_FRAME) {
+        if(_cbFrame == NULL) {
+            return 0;
+        }
+
+        // frames staged in the buffer
+        uint8_t header[4];
+        while(_RXmode == ATB_RX_MODE_FRAME && _RXbuffer->available() >= _rxFrameHeader) {
+            _RXbuffer->peek((char *) header, _rxFrameHeader);
+            size_t size = _frameSize(header);
+            if(size > _rxFrameMax) {
+                _RXbuffer->clear();
+                _frameError(size);
+                return 0;
+            }
+            if(_RXbuffer->available() < _rxFrameHeader + size) {
+                break;
             }
-            return newReadCount;
+            _RXbuffer->consume(_rxFrameHeader);
+
+            AsyncRingSpan spans[2];
+            if(_RXbuffer->readSpans(spans) && spans[0].len < size) {
+                // wrapped around the end of the ring, make it one piece in place
+                _RXbuffer->linearize();
+                _RXbuffer->readSpans(spans);
+            }
+            _cbFrame(size ? (uint8_t *) spans[0].data : NULL, size);
+            _RXbuffer->consume(size);
         }
+
+        // a complete frame in the new data is handed over without staging
+        if(_RXmode == ATB_RX_MODE_FRAME && _RXbuffer->empty() && buf && len >= _rxFrameHeader) {
+            size_t size = _frameSize(buf);
+            if(size > _rxFrameMax) {
+                _frameError(size);
+                return len;
+            }
+            if(len >= _rxFrameHeader + size) {
+                _cbFrame(buf + _rxFrameHeader, size);
+                return _rxFrameHeader + size;
+            }
+        }
+        return 0;
     }
 
     return 0;
 }
+
+/**
+ * decode the length header of a frame
+ * @param header _rxFrameHeader bytes
+ * @return payload length
+ */
+size_t AsyncTCPbuffer::_frameSize(const uint8_t * header) {
+    size_t size = 0;
+    for(uint8_t i = 0; i < _rxFrameHeader; i++) {
+        size = (size << 8) | header[_rxFrameBigEndian ? i : (_rxFrameHeader - 1 - i)];
+    }
+    return size;
+}
+
+/**
+ * the stream can not be framed any more, give up on the connection
+ */
+void AsyncTCPbuffer::_frameError(size_t size) {
+    (void) size;
+    DEBUG_ASYNC_TCP("[A-TCP] frame of %d bytes rejected, max: %d\n", size, _rxFrameMax);
+    _RXmode = ATB_RX_MODE_NONE;
+    if(_client) {
+        _client->close();
+    }
+}
+
+/**
+ * move data up to the terminator into the current read target
+ * the delimiter is found with memchr, the data is copied in bulk
+ * @param data
+ * @param len
+ * @param done set when the terminator was found or the target is full
+ * @return bytes used from data, the terminator included
+ */
+size_t AsyncTCPbuffer::_scanTerminator(const uint8_t *data, size_t len, bool *done) {
+    bool string = (_RXmode == ATB_RX_MODE_TERMINATOR_STRING);
+    size_t n = len;
+
+    if(!string && n > _rxSize) {
+        n = _rxSize;
+    }
+
+    const uint8_t * end = (const uint8_t *) memchr(data, _rxTerminator, n);
+    if(end) {
+        n = end - data;
+    }
+    if(string) {
+        // a string also ends at 0x00
+        const uint8_t * zero = (const uint8_t *) memchr(data, 0x00, n);
+        if(zero) {
+            n = zero - data;
+            end = zero;
+        }
+    }
+
+    if(string) {
+        String * str = _rxReadStringPtr;
+        str->reserve(str->length() + n);
+        char tmp[65];
+        for(size_t i = 0; i < n;) {
+            size_t chunk = n - i;
+            if(chunk > sizeof(tmp) - 1) {
+                chunk = sizeof(tmp) - 1;
+            }
+            memcpy(tmp, data + i, chunk);
+            tmp[chunk] = 0x00;
+            str->concat(tmp);
+            i += chunk;
+        }
+    } else {
+        memcpy(_rxReadBytesPtr, data, n);
+        _rxReadBytesPtr += n;
+        _rxReadCount += n;
+        _rxSize -= n;
+    }
+
+    if(end) {
+        *done = true;
+        return n + 1;
+    }
+    if(!string && _rxSize == 0) {
+        *done = true;
+    }
+    return n;
+}
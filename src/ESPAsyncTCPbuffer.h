@@ -32,10 +32,24 @@
 #endif
 
 #include <Arduino.h>
-#include <cbuf.h>
 
 #include "ESPAsyncTCP.h"
+#include "AsyncRingBuffer.h"
 
+// size the RX buffer returns to once it has been idle
+#ifndef ATB_RX_BUFFER_SIZE
+#define ATB_RX_BUFFER_SIZE 100
+#endif
+
+// ms an empty grown RX buffer is kept before it is shrunk
+#ifndef ATB_RX_SHRINK_IDLE
+#define ATB_RX_SHRINK_IDLE 2000
+#endif
+
+// free heap below which an empty RX buffer is shrunk right away
+#ifndef ATB_RX_SHRINK_HEAP
+#define ATB_RX_SHRINK_HEAP 4096
+#endif
 
 
 typedef enum {
@@ -43,7 +57,8 @@ typedef enum {
     ATB_RX_MODE_FREE,
     ATB_RX_MODE_READ_BYTES,
     ATB_RX_MODE_TERMINATOR,
-    ATB_RX_MODE_TERMINATOR_STRING
+    ATB_RX_MODE_TERMINATOR_STRING,
+    ATB_RX_MODE_FRAME
 } atbRxMode_t;
 
 class AsyncTCPbuffer: public Print {
@@ -53,6 +68,7 @@ class AsyncTCPbuffer: public Print {
         typedef std::function<size_t(uint8_t * payload, size_t length)> AsyncTCPbufferDataCb;
         typedef std::function<void(bool ok, void * ret)> AsyncTCPbufferDoneCb;
         typedef std::function<bool(AsyncTCPbuffer * obj)> AsyncTCPbufferDisconnectCb;
+        typedef std::function<void(uint8_t * payload, size_t length)> AsyncTCPbufferFrameCb;
 
         AsyncTCPbuffer(AsyncClient* c);
         virtual ~AsyncTCPbuffer();
@@ -69,9 +85,9 @@ class AsyncTCPbuffer: public Print {
 
         void readStringUntil(char terminator, String * str, AsyncTCPbufferDoneCb done);
 
-        // TODO implement read terminator non string
-        //void readBytesUntil(char terminator, char *buffer, size_t length, AsyncTCPbufferDoneCb done);
-        //void readBytesUntil(char terminator, uint8_t *buffer, size_t length, AsyncTCPbufferDoneCb done);
+        // done gets a size_t * with the number of bytes stored, the terminator is not stored
+        void readBytesUntil(char terminator, char *buffer, size_t length, AsyncTCPbufferDoneCb done);
+        void readBytesUntil(char terminator, uint8_t *buffer, size_t length, AsyncTCPbufferDoneCb done);
 
         void readBytes(char *buffer, size_t length, AsyncTCPbufferDoneCb done);
         void readBytes(uint8_t *buffer, size_t length, AsyncTCPbufferDoneCb done);
@@ -80,8 +96,16 @@ class AsyncTCPbuffer: public Print {
         // void setTimeout(size_t timeout);
 
         void onData(AsyncTCPbufferDataCb cb);
+        // length prefixed frames, one callback per complete frame (payload only)
+        // larger frames than maxSize close the connection
+        void onFrame(AsyncTCPbufferFrameCb cb, uint8_t headerSize = 2, bool bigEndian = true, size_t maxSize = TCP_MSS);
         void onDisconnect(AsyncTCPbufferDisconnectCb cb);
 
+        // RX buffer policy, grows by doubling, shrinks when idle or heap is low
+        void setRxShrink(uint32_t idleMs, size_t lowHeap = ATB_RX_SHRINK_HEAP);
+        uint32_t getRxResizes() { return _rxResizes; }
+        size_t getRxPeak() { return _rxPeak; }
+
         IPAddress remoteIP();
         uint16_t  remotePort();
         IPAddress localIP();
@@ -94,24 +118,39 @@ class AsyncTCPbuffer: public Print {
 
     protected:
         AsyncClient* _client;
-        cbuf * _TXbufferRead;
-        cbuf * _TXbufferWrite;
-        cbuf * _RXbuffer;
+        AsyncRingBuffer * _RXbuffer;
         atbRxMode_t _RXmode;
         size_t _rxSize;
         char _rxTerminator;
         uint8_t * _rxReadBytesPtr;
+        size_t _rxReadCount;
         String * _rxReadStringPtr;
+        uint8_t _rxFrameHeader;
+        bool _rxFrameBigEndian;
+        size_t _rxFrameMax;
+        uint32_t _rxShrinkIdle;
+        size_t _rxShrinkHeap;
+        uint32_t _rxLastData;
+        uint32_t _rxResizes;
+        size_t _rxPeak;
 
         AsyncTCPbufferDataCb _cbRX;
         AsyncTCPbufferDoneCb _cbDone;
         AsyncTCPbufferDisconnectCb _cbDisconnect;
+        AsyncTCPbufferFrameCb _cbFrame;
+
+        static const AcHandlerTable _handlers;
+        static void _s_timeout(AsyncClient *c, uint32_t time);
+        static void _s_poll(AsyncClient *c);
 
         void _attachCallbacks();
-        void _sendBuffer();
         void _on_close();
         void _rxData(uint8_t *buf, size_t len);
         size_t _handleRxBuffer(uint8_t *buf, size_t len);
+        size_t _scanTerminator(const uint8_t *data, size_t len, bool *done);
+        size_t _frameSize(const uint8_t * header);
+        void _frameError(size_t size);
+        void _rxShrink(bool idle);
 
 };
 
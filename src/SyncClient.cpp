@@ -21,7 +21,6 @@
 #include "Arduino.h"
 #include "SyncClient.h"
 #include "ESPAsyncTCP.h"
-#include "cbuf.h"
 #include <interrupts.h>
 
 #define DEBUG_ESP_SYNC_CLIENT
@@ -40,9 +39,43 @@
 */
 static_assert(LWIP_NETIF_TX_SINGLE_PBUF, "Required, tcp_write() must always copy.");
 
+/*
+  Received pbufs are kept as lwIP handed them over and read() copies straight
+  out of them. A pbuf is freed, and its window returned with ackPacket(), once
+  it has been read completely. SSL data arrives decrypted through onData() and
+  is copied into a pbuf of its own; tcp_axtls acks those records itself.
+*/
+struct sync_rx_queue {
+  struct pbuf *head;
+  struct pbuf *tail;
+  size_t offset;    // read position in head
+  size_t len;       // unread bytes
+  bool copied;      // pbufs are our own copies, do not ack them
+};
+
+/*
+  Packets and ack timeouts come through a handler table rather than
+  onPacket()/onTimeout(), so wrapping a client does not allocate its side
+  table for those two callbacks.
+*/
+const AcHandlerTable SyncClient::_handlers = {
+  NULL, NULL, NULL, NULL, NULL,
+  &SyncClient::_s_packet,
+  &SyncClient::_s_timeout,
+  NULL, NULL, NULL, NULL, NULL
+};
+
+void SyncClient::_s_packet(AsyncClient *c, struct pbuf *pb){
+  ((SyncClient*)(c->_handlers_arg))->_onPacket(pb);
+}
+
+void SyncClient::_s_timeout(AsyncClient *c, uint32_t time){
+  (void)time;
+  c->close();
+}
+
 SyncClient::SyncClient(size_t txBufLen)
   : _client(NULL)
-  , _tx_buffer(NULL)
   , _tx_buffer_size(txBufLen)
   , _rx_buffer(NULL)
   , _ref(NULL)
@@ -52,7 +85,6 @@ SyncClient::SyncClient(size_t txBufLen)
 
 SyncClient::SyncClient(AsyncClient *client, size_t txBufLen)
   : _client(client)
-  , _tx_buffer(new (std::nothrow) cbuf(txBufLen))
   , _tx_buffer_size(txBufLen)
   , _rx_buffer(NULL)
   , _ref(NULL)
@@ -68,21 +100,28 @@ SyncClient::~SyncClient(){
 
 void SyncClient::_release(){
   if(_client != NULL){
+    _client->_unbindHandlers(&_handlers);
+    _client->onPacket(NULL, NULL);
     _client->onData(NULL, NULL);
     _client->onAck(NULL, NULL);
     _client->onPoll(NULL, NULL);
     _client->abort();
     _client = NULL;
   }
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
-  while(_rx_buffer != NULL){
-    cbuf *b = _rx_buffer;
-    _rx_buffer = _rx_buffer->next;
-    delete b;
+  _freeRx();
+}
+
+void SyncClient::_freeRx(){
+  if(_rx_buffer != NULL){
+    sync_rx_queue *q = _rx_buffer;
+    _rx_buffer = NULL;
+    while(q->head != NULL){
+      struct pbuf *b = q->head;
+      q->head = b->next;
+      b->next = NULL;
+      pbuf_free(b);
+    }
+    delete q;
   }
 }
 
@@ -184,15 +223,12 @@ SyncClient & SyncClient::operator=(const SyncClient &other){
   _ref = other._ref;
   ref();
   --*rhsref;
-  // Why do I not test _tx_buffer for != NULL and free?
   // I allow for the lh target container, to be a copy of an active
   // connection. Thus we are just reusing the container.
   // The above unref() handles releaseing the previous client of the container.
+  // Pending tx data lives in the send queue of the AsyncClient.
   _tx_buffer_size = other._tx_buffer_size;
-  _tx_buffer = other._tx_buffer;
   _client = other._client;
-  if (_client != NULL && _tx_buffer == NULL)
-    _tx_buffer = new (std::nothrow) cbuf(_tx_buffer_size);
 
   _rx_buffer = other._rx_buffer;
   if(_client)
@@ -208,18 +244,7 @@ SyncClient & SyncClient::operator=(const SyncClient &other){
     _client = NULL;
   }
   _tx_buffer_size = other._tx_buffer_size;
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
-  while(_rx_buffer != NULL){
-    cbuf *b = _rx_buffer;
-    _rx_buffer = b->next;
-    delete b;
-  }
-  if(other._client != NULL)
-    _tx_buffer = new (std::nothrow) cbuf(other._tx_buffer_size);
+  _freeRx();
 
   _client = other._client;
   if(_client)
@@ -251,45 +276,48 @@ bool SyncClient::stop(unsigned int maxWaitMs){
   return true;
 }
 
-size_t SyncClient::_sendBuffer(){
-  if(_client == NULL || _tx_buffer == NULL)
-    return 0;
-  size_t available = _tx_buffer->available();
-  if(!connected() || !_client->canSend() || available == 0)
-    return 0;
-  size_t sendable = _client->space();
-  if(sendable < available)
-    available= sendable;
-  char *out = new (std::nothrow) char[available];
-  if(out == NULL)
-    return 0;
-
-  _tx_buffer->read(out, available);
-  size_t sent = _client->write(out, available);
-  delete[] out;
-  return sent;
+void SyncClient::_onPacket(struct pbuf *pb){
+  if(pb->len == 0){
+    _client->ackPacket(pb);
+    return;
+  }
+  if(_rx_buffer == NULL){
+    _rx_buffer = new (std::nothrow) sync_rx_queue{NULL, NULL, 0, 0, false};
+    if(_rx_buffer == NULL){
+      // We ran out of memory. This fail causes lost receive data.
+      // The connection should be closed in a manner that conveys something
+      // bad/abnormal has happened to the connection. Hence, we abort the
+      // connection to avoid possible data corruption.
+      // Note, callbacks maybe called.
+      pbuf_free(pb);
+      _client->abort();
+      return;
+    }
+  }
+  pb->next = NULL;
+  if(_rx_buffer->tail != NULL)
+    _rx_buffer->tail->next = pb;
+  else
+    _rx_buffer->head = pb;
+  _rx_buffer->tail = pb;
+  _rx_buffer->len += pb->len;
 }
 
 void SyncClient::_onData(void *data, size_t len){
-  _client->ackLater();
-  cbuf *b = new (std::nothrow) cbuf(len+1);
-  if(b != NULL){
-    b->write((const char *)data, len);
-    if(_rx_buffer == NULL)
-      _rx_buffer = b;
-    else {
-      cbuf *p = _rx_buffer;
-      while(p->next != NULL)
-        p = p->next;
-      p->next = b;
+  while(len){
+    u16_t chunk = (len > 0xFFFF) ? 0xFFFF : len;
+    struct pbuf *pb = pbuf_alloc(PBUF_RAW, chunk, PBUF_RAM);
+    if(pb == NULL){
+      _client->abort();
+      return;
     }
-  } else {
-    // We ran out of memory. This fail causes lost receive data.
-    // The connection should be closed in a manner that conveys something
-    // bad/abnormal has happened to the connection. Hence, we abort the
-    // connection to avoid possible data corruption.
-    // Note, callbacks maybe called.
-    _client->abort();
+    memcpy(pb->payload, data, chunk);
+    _onPacket(pb);
+    if(_rx_buffer == NULL)
+      return;
+    _rx_buffer->copied = true;
+    data = (uint8_t*)data + chunk;
+    len -= chunk;
   }
 }
 
@@ -297,21 +325,10 @@ void SyncClient::_onDisconnect(){
   if(_client != NULL){
     _client = NULL;
   }
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
 }
 
 void SyncClient::_onConnect(AsyncClient *c){
   _client = c;
-  if(_tx_buffer != NULL){
-    cbuf *b = _tx_buffer;
-    _tx_buffer = NULL;
-    delete b;
-  }
-  _tx_buffer = new (std::nothrow) cbuf(_tx_buffer_size);
   _attachCallbacks_AfterConnected();
 }
 
@@ -321,8 +338,11 @@ void SyncClient::_attachCallbacks(){
 }
 
 void SyncClient::_attachCallbacks_AfterConnected(){
-  _client->onAck([](void *obj, AsyncClient* c, size_t len, uint32_t time){ (void)c; (void)len; (void)time; ((SyncClient*)(obj))->_sendBuffer(); }, this);
   _client->onData([](void *obj, AsyncClient* c, void *data, size_t len){ (void)c; ((SyncClient*)(obj))->_onData(data, len); }, this);
+  if(_client->_bindHandlers(&_handlers, this))
+    return;
+  // an AsyncClientT keeps its own table
+  _client->onPacket([](void *obj, AsyncClient* c, struct pbuf *pb){ (void)c; ((SyncClient*)(obj))->_onPacket(pb); }, this);
   _client->onTimeout([](void *obj, AsyncClient* c, uint32_t time){ (void)obj; (void)time; c->close(); }, this);
 }
 
@@ -334,60 +354,69 @@ size_t SyncClient::write(uint8_t data){
   return write(&data, 1);
 }
 
+/*
+  The AsyncClient send queue holds the tx data. We only block while more than
+  _tx_buffer_size bytes are waiting in it.
+*/
 size_t SyncClient::write(const uint8_t *data, size_t len){
-  if(_tx_buffer == NULL || !connected()){
+  if(!connected()){
     return 0;
   }
-  size_t toWrite = 0;
-  size_t toSend = len;
-  while(_tx_buffer->room() < toSend){
-    toWrite = _tx_buffer->room();
-    _tx_buffer->write((const char*)data, toWrite);
-    while(connected() && !_client->canSend())
+  size_t written = 0;
+  while(written < len){
+    size_t queued = _client->queued();
+    if(queued >= _tx_buffer_size){
       delay(0);
-    if(!connected())
-      return 0;
-    _sendBuffer();
-    toSend -= toWrite;
+      if(!connected())
+        return 0;
+      continue;
+    }
+    size_t toWrite = _tx_buffer_size - queued;
+    if(toWrite > len - written)
+      toWrite = len - written;
+    size_t w = _client->enqueue((const char*)(data + written), toWrite);
+    if(w == 0)
+      return written;
+    written += w;
   }
-  _tx_buffer->write((const char*)(data+(len - toSend)), toSend);
-  if(connected() && _client->canSend())
-    _sendBuffer();
   return len;
 }
 
 int SyncClient::available(){
   if(_rx_buffer == NULL) return 0;
-  size_t a = 0;
-  cbuf *b = _rx_buffer;
-  while(b != NULL){
-    a += b->available();
-    b = b->next;
-  }
-  return a;
+  return _rx_buffer->len;
 }
 
 int SyncClient::peek(){
-  if(_rx_buffer == NULL) return -1;
-  return _rx_buffer->peek();
+  if(_rx_buffer == NULL || _rx_buffer->head == NULL) return -1;
+  return ((uint8_t*)_rx_buffer->head->payload)[_rx_buffer->offset];
 }
 
 int SyncClient::read(uint8_t *data, size_t len){
-  if(_rx_buffer == NULL) return -1;
+  if(_rx_buffer == NULL || _rx_buffer->head == NULL) return -1;
 
+  sync_rx_queue *q = _rx_buffer;
   size_t readSoFar = 0;
-  while(_rx_buffer != NULL && (len - readSoFar) >= _rx_buffer->available()){
-    cbuf *b = _rx_buffer;
-    _rx_buffer = _rx_buffer->next;
-    size_t toRead = b->available();
-    readSoFar += b->read((char*)(data+readSoFar), toRead);
-    if(connected()){
-        _client->ack(b->size() - 1);
+  while(readSoFar < len && q->head != NULL){
+    struct pbuf *b = q->head;
+    size_t toRead = b->len - q->offset;
+    if(toRead > len - readSoFar)
+      toRead = len - readSoFar;
+    memcpy(data + readSoFar, (uint8_t*)b->payload + q->offset, toRead);
+    readSoFar += toRead;
+    q->offset += toRead;
+    q->len -= toRead;
+    if(q->offset == b->len){
+      q->head = b->next;
+      if(q->head == NULL)
+        q->tail = NULL;
+      b->next = NULL;
+      q->offset = 0;
+      if(!q->copied && connected())
+        _client->ackPacket(b);
+      else
+        pbuf_free(b);
     }
-    delete b;
-  }
-  if(_rx_buffer != NULL && readSoFar < len){
-    readSoFar += _rx_buffer->read((char*)(data+readSoFar), (len - readSoFar));
   }
   return readSoFar;
 }
@@ -401,14 +430,9 @@ int SyncClient::read(){
 
 bool SyncClient::flush(unsigned int maxWaitMs){
   (void)maxWaitMs;
-  if(_tx_buffer == NULL || !connected())
+  if(!connected())
     return false;
-  if(_tx_buffer->available()){
-    while(connected() && !_client->canSend())
-      delay(0);
-    if(_client == NULL || _tx_buffer == NULL)
-      return false;
-    _sendBuffer();
-  }
-  return true;
+  while(connected() && _client->queued())
+    delay(0);
+  return connected();
 }
@@ -30,19 +30,25 @@
 #define CONST
 #endif
 #include <async_config.h>
-class cbuf;
 class AsyncClient;
+struct AcHandlerTable;
+struct pbuf;
+struct sync_rx_queue;
 
 class SyncClient: public Client {
   private:
     AsyncClient *_client;
-    cbuf *_tx_buffer;
     size_t _tx_buffer_size;
-    cbuf *_rx_buffer;
+    sync_rx_queue *_rx_buffer;
     int *_ref;
 
-    size_t _sendBuffer();
+    static const AcHandlerTable _handlers;
+    static void _s_packet(AsyncClient *c, struct pbuf *pb);
+    static void _s_timeout(AsyncClient *c, uint32_t time);
+
+    void _onPacket(struct pbuf *pb);
     void _onData(void *data, size_t len);
+    void _freeRx();
     void _onConnect(AsyncClient *c);
     void _onDisconnect();
     void _attachCallbacks();
@@ -13,6 +13,77 @@
 #define TCP_MSS (1460)
 #endif
 
+#ifndef ASYNC_TX_QUEUE_SIZE
+// Initial size of the AsyncClient send queue ring, see AsyncClient::enqueue().
+// The ring doubles whenever a write does not fit.
+#define ASYNC_TX_QUEUE_SIZE (TCP_MSS)
+#endif
+
+#ifndef ASYNC_RX_VEC_MAX
+// Views handed to one AsyncClient::onDataVec() call; longer pbuf chains are
+// delivered in several calls but still acked once.
+#define ASYNC_RX_VEC_MAX 8
+#endif
+
+#ifndef ASYNC_WRITABLE_LOW
+// Default watermarks of AsyncClient::onWritable(), in outstanding bytes
+// (unacked by the peer plus waiting in the send queue).
+#define ASYNC_WRITABLE_LOW (TCP_MSS)
+#endif
+#ifndef ASYNC_WRITABLE_HIGH
+#define ASYNC_WRITABLE_HIGH (2 * TCP_MSS)
+#endif
+
+#ifndef ASYNC_BROADCAST_MAX_OUTSTANDING
+// Default lag limit of AsyncServer::broadcast(): a client that still has
+// more than this outstanding with the payload added is skipped.
+#define ASYNC_BROADCAST_MAX_OUTSTANDING (4 * ASYNC_TX_QUEUE_SIZE)
+#endif
+
+#ifndef ASYNC_SEND_MARKS
+// Send timestamps kept per AsyncClient to time acks from the oldest unacked
+// byte. When they run out the newest one is stretched over the extra data.
+#define ASYNC_SEND_MARKS 8
+#endif
+
+#ifndef ASYNC_ADMIT_DELAY_MAX
+// How long AsyncServer keeps a connection waiting for a free slot under
+// AS_ADMIT_DELAY before it is refused, in ms.
+#define ASYNC_ADMIT_DELAY_MAX 5000
+#endif
+
+#ifndef ASYNC_SSL_MAX_HANDSHAKES
+// Server side TLS handshakes run at once, see AsyncServer::setMaxHandshakes().
+// Each one holds the axTLS handshake buffers, later connections wait in a queue.
+#define ASYNC_SSL_MAX_HANDSHAKES 2
+#endif
+
+#ifndef ASYNC_SSL_PENDING_MAX
+// Bytes kept for a connection waiting for its handshake; beyond that its data
+// is refused and left to lwIP, which stops opening the receive window.
+#define ASYNC_SSL_PENDING_MAX (2 * TCP_MSS)
+#endif
+
+#ifndef ASYNC_CLIENT_FOOTPRINT_MAX
+// Upper bound on sizeof(AsyncClient), checked when ESPAsyncTCP.cpp is built:
+// the size of the 1.2.2 client, eight callbacks with their args, five
+// pointers and ten words. That is 400 bytes on a 64-bit host build, of which
+// 384 are used (400 with DEBUG_ESP_ASYNC_TCP). State for the optional
+// features lives in ac_client_ext and ac_client_tx, allocated on first use.
+#define ASYNC_CLIENT_FOOTPRINT_MAX (8 * (sizeof(AcConnectHandler) + sizeof(void*)) + 5 * sizeof(void*) + 10 * sizeof(uint32_t))
+#endif
+
+#ifndef ASYNC_SCHED_SPANS
+// Runs of send scheduler bytes tracked per AsyncClient between direct writes.
+// When they run out the newest one is stretched over the extra data.
+#define ASYNC_SCHED_SPANS 4
+#endif
+
+#ifndef ASYNC_SCHED_QUANTUM
+// Bytes a weight of 1 earns per round of the send scheduler, see AsyncSendScheduler.
+#define ASYNC_SCHED_QUANTUM (TCP_MSS)
+#endif
+
 // #define ASYNC_TCP_DEBUG(...) ets_printf(__VA_ARGS__)
 // #define TCP_SSL_DEBUG(...) ets_printf(__VA_ARGS__)
 // #define ASYNC_TCP_ASSERT( a ) do{ if(!(a)){ets_printf("ASSERT: %s %u \n", __FILE__, __LINE__);}}while(0)
@@ -53,7 +53,8 @@ uint16_t default_private_key_len = 0;
 uint8_t * default_certificate = NULL;
 uint16_t default_certificate_len = 0;
 
-static uint8_t _tcp_ssl_has_client = 0;
+// Server side connections that have not finished their handshake yet.
+static uint8_t _tcp_ssl_server_handshakes = 0;
 
 SSL_CTX * tcp_ssl_new_server_ctx(const char *cert, const char *private_key_file, const char *password){
   uint32_t options = SSL_CONNECT_IN_PARTS;
@@ -113,7 +114,16 @@ static tcp_ssl_t * tcp_ssl_array = NULL;
 static int tcp_ssl_next_fd = 0;
 
 uint8_t tcp_ssl_has_client(){
-  return _tcp_ssl_has_client;
+  return _tcp_ssl_server_handshakes != 0;
+}
+
+uint8_t tcp_ssl_server_handshakes(){
+  return _tcp_ssl_server_handshakes;
+}
+
+static void tcp_ssl_handshake_end(tcp_ssl_t * item){
+  if(item->type == TCP_SSL_TYPE_SERVER && item->handshake != SSL_OK && _tcp_ssl_server_handshakes)
+    _tcp_ssl_server_handshakes--;
 }
 
 tcp_ssl_t * tcp_ssl_new(struct tcp_pcb *tcp) {
@@ -227,7 +237,7 @@ int tcp_ssl_new_server(struct tcp_pcb *tcp, SSL_CTX* ssl_ctx){
   tcp_ssl->type = TCP_SSL_TYPE_SERVER;
   tcp_ssl->ssl_ctx = ssl_ctx;
 
-  _tcp_ssl_has_client = 1;
+  _tcp_ssl_server_handshakes++;
   tcp_ssl->ssl = ssl_server_new(ssl_ctx, tcp_ssl->fd);
   if(tcp_ssl->ssl == NULL){
     TCP_SSL_DEBUG("tcp_ssl_new_server: failed to allocate ssl\n");
@@ -256,8 +266,7 @@ int tcp_ssl_free(struct tcp_pcb *tcp) {
       ssl_free(item->ssl);
     if(item->type == TCP_SSL_TYPE_CLIENT && item->ssl_ctx)
       ssl_ctx_free(item->ssl_ctx);
-    if(item->type == TCP_SSL_TYPE_SERVER)
-      _tcp_ssl_has_client = 0;
+    tcp_ssl_handshake_end(item);
     free(item);
     return 0;
   }
@@ -279,8 +288,7 @@ int tcp_ssl_free(struct tcp_pcb *tcp) {
     ssl_free(i->ssl);
   if(i->type == TCP_SSL_TYPE_CLIENT && i->ssl_ctx)
     ssl_ctx_free(i->ssl_ctx);
-  if(i->type == TCP_SSL_TYPE_SERVER)
-    _tcp_ssl_has_client = 0;
+  tcp_ssl_handshake_end(i);
   free(i);
   return 0;
 }
@@ -410,7 +418,10 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p) {
     } else {
       if(fd_data->handshake != SSL_OK) {
         // fd_data may be freed in callbacks.
-        int handshake = fd_data->handshake = ssl_handshake_status(fd_data->ssl);
+        int handshake = ssl_handshake_status(fd_data->ssl);
+        if(handshake == SSL_OK)
+          tcp_ssl_handshake_end(fd_data);
+        fd_data->handshake = handshake;
         if(handshake == SSL_OK){
           TCP_SSL_DEBUG("tcp_ssl_read: handshake OK\n");
           if(fd_data->on_handshake)
@@ -61,6 +61,7 @@ typedef void (* tcp_ssl_error_cb_t)(void *arg, struct tcp_pcb *tcp, int8_t error
 typedef int (* tcp_ssl_file_cb_t)(void *arg, const char *filename, uint8_t **buf);
 
 uint8_t tcp_ssl_has_client();
+uint8_t tcp_ssl_server_handshakes();
 
 int tcp_ssl_new_client(struct tcp_pcb *tcp);
 
@@ -0,0 +1,122 @@
+/*
+  The RX side of AsyncTCPbuffer as of 1.2.2, for the benchmarks to compare
+  against: a cbuf that grows with resizeAdd() and goes back to 100 bytes
+  whenever it empties, the ATB_RX_MODE_FREE hand-over (buffered data is
+  copied into a temporary array, which 1.2.2 also leaked; freed here) and
+  the ATB_RX_MODE_TERMINATOR_STRING parser.
+*/
+#ifndef ATB_122_H_
+#define ATB_122_H_
+
+#include "ESPAsyncTCP.h"
+#include "cbuf.h"
+
+struct AtbRx122 {
+  AsyncClient *client;
+  cbuf *rx;
+  bool armed;
+  char terminator;
+  String *str;
+  void (*done)(AtbRx122 *b);
+  size_t (*data)(uint8_t *buf, size_t len);
+  size_t resizes;
+  size_t peak;
+
+  AtbRx122(AsyncClient *c): client(c), rx(new cbuf(100)), armed(false), terminator(0), str(NULL), done(NULL), data(NULL), resizes(0), peak(100) {
+    c->onData([](void *arg, AsyncClient *, void *buf, size_t len){ ((AtbRx122*)arg)->rxData((uint8_t*)buf, len); }, this);
+  }
+  ~AtbRx122(){ delete rx; }
+
+  void readStringUntil(char t, String *s, void (*cb)(AtbRx122 *b)){
+    terminator = t;
+    str = s;
+    done = cb;
+    armed = true;
+  }
+
+  void onData(size_t (*cb)(uint8_t *buf, size_t len)){
+    data = cb;
+    armed = true;
+  }
+
+  size_t handle(uint8_t *buf, size_t len){
+    if(data){
+      size_t available = rx->available();
+      size_t r = 0;
+      if(available > 0){
+        uint8_t *b = new uint8_t[available];
+        rx->peek((char*)b, available);
+        r = data(b, available);
+        rx->remove(r);
+        delete[] b;
+      }
+      if(r == available && buf && len > 0)
+        return data(buf, len);
+      return 0;
+    }
+    if(!rx->empty()){
+      while(!rx->empty()){
+        char c = rx->read();
+        if(c == terminator || c == 0x00){
+          armed = false;
+          done(this);
+          return 0;
+        }
+        (*str) += c;
+      }
+    }
+    if(rx->empty() && len > 0 && buf){
+      size_t n = 0;
+      while(n < len){
+        char c = (char)*buf;
+        buf++;
+        n++;
+        if(c == terminator || c == 0x00){
+          armed = false;
+          done(this);
+          return n;
+        }
+        (*str) += c;
+      }
+      return n;
+    }
+    return 0;
+  }
+
+  void rxData(uint8_t *buf, size_t len){
+    size_t handled = 0;
+    if(armed){
+      handled = handle(buf, len);
+      buf += handled;
+      len -= handled;
+      if(rx->empty()){
+        while(armed && handled != 0 && len > 0){
+          handled = handle(buf, len);
+          buf += handled;
+          len -= handled;
+        }
+      }
+    }
+    if(len > 0){
+      if(rx->room() < len){
+        rx->resizeAdd(len + rx->room());
+        resizes++;
+        if(rx->size() > peak)
+          peak = rx->size();
+      }
+      rx->write((const char*)buf, len);
+    }
+    if(!rx->empty() && armed){
+      handled = handle(NULL, 0);
+      while(armed && handled != 0)
+        handled = handle(NULL, 0);
+    }
+    if(rx->empty() && rx->room() != 100){
+      if(rx->size() != 100)
+        resizes++;
+      rx->resize(100);
+    }
+  }
+};
+
+#endif
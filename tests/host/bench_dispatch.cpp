@@ -0,0 +1,81 @@
+/*
+  Event dispatch through std::function callbacks against AsyncClientT's
+  handler table, on poll events of one connection. Also reports what each
+  costs per client: the object size and the heap it takes with its
+  callbacks set (before connecting).
+*/
+#include "ESPAsyncTCP.h"
+#include "host_test.h"
+
+#define POLLS 20000000u
+
+static size_t events;
+
+// as big as a typical capture: an owner pointer and a bit of state
+struct Owner {
+  void *self;
+  uint32_t state[4];
+};
+
+struct Counter : AsyncClientHandler {
+  Owner owner;
+  void onPoll(AsyncClient *c){ (void)c; events += owner.state[0]; }
+  void onAck(AsyncClient *c, size_t len, uint32_t time){ (void)c; (void)time; events += len; }
+  void onData(AsyncClient *c, void *data, size_t len){ (void)c; (void)data; events += len; }
+  void onDisconnect(AsyncClient *c){ (void)c; events++; }
+};
+
+static struct tcp_pcb *connect(AsyncClient *c){
+  c->connect(IPAddress(0x0100007f), 80);
+  struct tcp_pcb *pcb = host_last_pcb;
+  host_connected(pcb);
+  return pcb;
+}
+
+static double run(struct tcp_pcb *pcb){
+  events = 0;
+  double start = host_seconds();
+  for(uint32_t i = 0; i < POLLS; i++)
+    host_poll(pcb);
+  double ns = (host_seconds() - start) * 1e9 / POLLS;
+  host_sink = events;
+  return ns;
+}
+
+int main(){
+  Owner owner = { NULL, { 1, 0, 0, 0 } };
+
+  size_t before = host_heap.bytes;
+  AsyncClient *none = new AsyncClient();
+  size_t noneHeap = host_heap.bytes - before;
+  double noneNs = run(connect(none));
+
+  before = host_heap.bytes;
+  AsyncClient *fn = new AsyncClient();
+  fn->onPoll([owner](void *, AsyncClient *){ events += owner.state[0]; }, NULL);
+  fn->onAck([owner](void *, AsyncClient *, size_t len, uint32_t){ events += len; }, NULL);
+  fn->onData([owner](void *, AsyncClient *, void *, size_t len){ events += len; }, NULL);
+  fn->onDisconnect([owner](void *, AsyncClient *){ events++; }, NULL);
+  size_t fnHeap = host_heap.bytes - before;
+  double fnNs = run(connect(fn));
+
+  before = host_heap.bytes;
+  AsyncClientT<Counter> *t = new AsyncClientT<Counter>();
+  t->handler().owner = owner;
+  size_t tHeap = host_heap.bytes - before;
+  double tNs = run(connect(t));
+
+  printf("%u poll events on one connection, four callbacks with a %zu byte capture\n\n", POLLS, sizeof(Owner));
+  printf("%-14s %10s %10s %12s\n", "", "ns/event", "sizeof", "heap B");
+  printf("%-14s %10.2f %10zu %12zu\n", "no callback", noneNs, sizeof(AsyncClient), noneHeap);
+  printf("%-14s %10.2f %10zu %12zu\n", "std::function", fnNs, sizeof(AsyncClient), fnHeap);
+  printf("%-14s %10.2f %10zu %12zu\n", "AsyncClientT", tNs, sizeof(AsyncClientT<Counter>), tHeap);
+
+  none->abort();
+  fn->abort();
+  t->abort();
+  delete none;
+  delete fn;
+  delete t;
+  return host_result();
+}
@@ -0,0 +1,80 @@
+/*
+  Accepting connections with and without AsyncServer::setClientPool().
+  KEEP clients stay connected; every new connection resets the oldest,
+  whose onDisconnect deletes it, so KEEP + 1 exist at a time. Reports accepts per second, heap
+  allocations per accept and the heap high-water over the run. The fake
+  stack's own work per connection is measured with no onClient handler
+  and taken off the allocation counts.
+*/
+#include <deque>
+#include "ESPAsyncTCP.h"
+#include "host_test.h"
+
+#define PORT 80
+#define ACCEPTS 200000
+#define KEEP 8
+
+struct Result {
+  double rate;      // accepts per second
+  double allocs;    // per accept
+  size_t peak;      // bytes above the heap in use before begin()
+};
+
+static AsyncClient *accepted;
+
+static Result run(size_t pool, bool clients){
+  host_heap_reset();
+  size_t base = host_heap.bytes;
+  AsyncServer *server = new AsyncServer(PORT);
+  if(clients)
+    server->onClient([](void *, AsyncClient *c){
+      accepted = c;
+      c->onDisconnect([](void *, AsyncClient *c){ delete c; }, NULL);
+    }, NULL);
+  server->setClientPool(pool);
+  server->begin();
+
+  std::deque<struct tcp_pcb*> live;
+  double start = host_seconds();
+  size_t allocs = host_heap.allocs;
+  for(size_t i = 0; i < ACCEPTS; i++){
+    accepted = NULL;
+    struct tcp_pcb *pcb = host_accept(PORT, 0x0100007f, 1024 + i % 60000);
+    if(accepted){
+      live.push_back(pcb);
+      if(live.size() > KEEP){
+        host_reset(live.front());
+        live.pop_front();
+      }
+    }
+  }
+  Result r;
+  r.rate = ACCEPTS / (host_seconds() - start);
+  r.allocs = (double)(host_heap.allocs - allocs) / ACCEPTS;
+  r.peak = host_heap.peak - base;
+  if(clients && server->clientCount() != KEEP){
+    fprintf(stderr, "%zu clients left, expected %u\n", server->clientCount(), KEEP);
+    host_failures++;
+  }
+  while(!live.empty()){
+    host_reset(live.front());
+    live.pop_front();
+  }
+  server->end();
+  delete server;
+  return r;
+}
+
+int main(){
+  Result stack = run(0, false);
+  // warm up the fake stack's containers
+  run(KEEP + 1, true);
+  Result heap = run(0, true);
+  Result pooled = run(KEEP + 1, true);
+  printf("%u accepts, %u clients connected at a time\n\n", ACCEPTS, KEEP);
+  printf("%-12s %12s %14s %12s\n", "", "accepts/s", "allocs/accept", "peak B");
+  printf("%-12s %12.0f %14s %12zu\n", "stack only", stack.rate, "-", stack.peak);
+  printf("%-12s %12.0f %14.2f %12zu\n", "heap", heap.rate, heap.allocs - stack.allocs, heap.peak);
+  printf("%-12s %12.0f %14.2f %12zu\n", "pool", pooled.rate, pooled.allocs - stack.allocs, pooled.peak);
+  return host_result();
+}
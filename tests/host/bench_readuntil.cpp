@@ -0,0 +1,99 @@
+/*
+  Line parsing with AsyncTCPbuffer::readStringUntil(), lines of 1 KB to
+  64 KB arriving in TCP_MSS segments. The reference is the terminator loop
+  of AsyncTCPbuffer 1.2.2: one byte at a time out of a cbuf or the segment,
+  each appended with String += char, on the same AsyncClient.
+*/
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "ESPAsyncTCPbuffer.h"
+#include "host_test.h"
+#include "atb_122.h"
+
+#define PORT 80
+#define TOTAL (16u * 1024 * 1024)
+
+static AsyncClient *accepted = NULL;
+static String line;
+static size_t lines;
+static size_t lineBytes;
+
+static void lineDone(){
+  lines++;
+  lineBytes += line.length();
+  line = String();
+}
+
+static AsyncTCPbuffer *buffer;
+
+static void nextLine(bool ok, void *ret){
+  lineDone();
+  buffer->readStringUntil('\n', &line, nextLine);
+}
+
+struct Result {
+  double seconds;
+  double allocs;
+};
+
+static Result run(bool current, size_t lineLen){
+  accepted = NULL;
+  struct tcp_pcb *pcb = host_accept(PORT, 0x0100007f);
+  AsyncClient *c = accepted;
+  AtbRx122 *loop = NULL;
+  buffer = NULL;
+  line = String();
+  if(current){
+    buffer = new AsyncTCPbuffer(c);
+    buffer->onDisconnect([](AsyncTCPbuffer *){ return false; });
+    buffer->readStringUntil('\n', &line, nextLine);
+  } else {
+    loop = new AtbRx122(c);
+    loop->readStringUntil('\n', &line, [](AtbRx122 *b){
+      lineDone();
+      b->readStringUntil('\n', &line, b->done);
+    });
+  }
+
+  // four lines' worth, repeated
+  std::vector<char> stream(lineLen * 4 + TCP_MSS);
+  for(size_t i = 0; i < stream.size(); i++)
+    stream[i] = ((i + 1) % lineLen) ? 'a' + (i % 26) : '\n';
+  lines = 0;
+  lineBytes = 0;
+  host_heap_reset();
+  double start = host_seconds();
+  size_t pos = 0;
+  for(size_t done = 0; done < TOTAL; done += TCP_MSS){
+    host_recv(pcb, stream.data() + pos, TCP_MSS);
+    pos = (pos + TCP_MSS) % (lineLen * 4);
+  }
+  // one pbuf per segment is the stack's, not the parser's
+  Result r = { host_seconds() - start, (double)(host_heap.allocs - (TOTAL + TCP_MSS - 1) / TCP_MSS) };
+  if(lines == 0 || lineBytes != lines * (lineLen - 1)){
+    fprintf(stderr, "%s: %zu lines, %zu bytes, expected %zu each\n", current ? "current" : "1.2.2", lines, lineBytes, lineLen - 1);
+    host_failures++;
+  }
+  r.allocs = lines ? r.allocs / lines : 0;
+  c->abort();
+  delete buffer;
+  delete loop;
+  return r;
+}
+
+int main(){
+  AsyncServer server(PORT);
+  server.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+  server.begin();
+
+  printf("%u MB of lines in %u byte segments, MB/s and heap allocations per line (pbufs not counted)\n\n", TOTAL >> 20, TCP_MSS);
+  printf("%7s | %10s %10s | %10s %10s\n", "line", "1.2.2 MB/s", "allocs", "now MB/s", "allocs");
+  const size_t sizes[] = { 1024, 4096, 16384, 65536 };
+  for(size_t size : sizes){
+    Result a = run(false, size);
+    Result b = run(true, size);
+    double mb = TOTAL / 1048576.0;
+    printf("%7zu | %10.0f %10.1f | %10.0f %10.1f\n", size, mb / a.seconds, a.allocs, mb / b.seconds, b.allocs);
+  }
+  return host_result();
+}
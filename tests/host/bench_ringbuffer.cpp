@@ -0,0 +1,140 @@
+/*
+  TX path of the wrappers: bytes written by the application, buffered, and
+  handed to tcp_write() as the window opens. Compares the cbuf chain the
+  wrappers used before AsyncRingBuffer (TCP_MSS cbufs chained as they fill,
+  each drain peek()ing into a new[] array, as AsyncTCPbuffer::_sendBuffer()
+  did) against AsyncClient::enqueue(), which queues in an AsyncRingBuffer
+  and passes its spans straight to tcp_write().
+*/
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "cbuf.h"
+#include "host_test.h"
+
+#define PORT 80
+#define TOTAL (32u * 1024 * 1024)
+
+static AsyncClient *accepted = NULL;
+
+static AsyncClient *connect(struct tcp_pcb **pcb){
+  accepted = NULL;
+  *pcb = host_accept(PORT, 0x0100007f);
+  return accepted;
+}
+
+// AsyncTCPbuffer as of 1.2.2, TX side only
+struct CbufChain {
+  AsyncClient *client;
+  cbuf *readBuf;
+  cbuf *writeBuf;
+
+  CbufChain(AsyncClient *c): client(c){
+    readBuf = writeBuf = new (std::nothrow) cbuf(TCP_MSS);
+  }
+  ~CbufChain(){
+    while(readBuf){
+      cbuf *next = readBuf->next;
+      delete readBuf;
+      readBuf = next;
+    }
+  }
+  void sendBuffer(){
+    while(client->space() > 0 && readBuf->available() > 0 && client->canSend()){
+      size_t available = readBuf->available();
+      if(available > client->space())
+        available = client->space();
+      char *out = new (std::nothrow) char[available];
+      if(out == NULL)
+        return;
+      readBuf->peek(out, available);
+      size_t sent = client->write(out, available);
+      readBuf->remove(sent);
+      if(readBuf->available() == 0 && readBuf->next != NULL){
+        cbuf *old = readBuf;
+        readBuf = readBuf->next;
+        delete old;
+      }
+      delete[] out;
+    }
+  }
+  size_t write(const uint8_t *data, size_t len){
+    size_t left = len;
+    while(left){
+      size_t w = writeBuf->write((const char*)data, left);
+      left -= w;
+      data += w;
+      sendBuffer();
+      if(writeBuf->full() && left > 0){
+        cbuf *next = new (std::nothrow) cbuf(TCP_MSS);
+        writeBuf->next = next;
+        writeBuf = next;
+      }
+    }
+    return len;
+  }
+  size_t queued(){
+    size_t n = 0;
+    for(cbuf *b = readBuf; b; b = b->next)
+      n += b->available();
+    return n;
+  }
+};
+
+struct Result {
+  double seconds;
+  size_t allocs;
+  size_t peak;
+};
+
+// The application keeps writing; the peer acks a full window whenever more
+// than `backlog` bytes are waiting, like a link slower than the producer.
+static Result run(bool ring, size_t chunk, size_t backlog){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = connect(&pcb);
+  CbufChain *chain = ring ? NULL : new CbufChain(c);
+  if(chain)
+    c->onAck([](void *arg, AsyncClient *, size_t, uint32_t){ ((CbufChain*)arg)->sendBuffer(); }, chain);
+  std::vector<uint8_t> data(chunk, 'x');
+
+  host_heap_reset();
+  size_t base = host_heap.bytes;
+  double start = host_seconds();
+  for(size_t done = 0; done < TOTAL; done += chunk){
+    if(ring)
+      c->enqueue((const char*)data.data(), chunk);
+    else
+      chain->write(data.data(), chunk);
+    while((ring ? c->queued() : chain->queued()) > backlog)
+      host_ack(pcb, 0);
+  }
+  while((ring ? c->queued() : chain->queued()) > 0 || pcb->unacked_len || pcb->unsent_len)
+    host_ack(pcb, 0);
+  Result r = { host_seconds() - start, host_heap.allocs, host_heap.peak - base };
+  host_sink = pcb->written;
+  delete chain;
+  c->onAck(NULL, NULL);
+  c->abort();
+  return r;
+}
+
+int main(){
+  AsyncServer server(PORT);
+  server.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+  server.begin();
+
+  printf("%u MB written per run, MB/s and heap allocations per MB\n\n", TOTAL >> 20);
+  printf("%7s %7s | %10s %9s %9s | %10s %9s %9s\n", "chunk", "backlog",
+         "cbuf MB/s", "allocs/MB", "peak B", "ring MB/s", "allocs/MB", "peak B");
+  const size_t chunks[] = { 32, 256, 1460, 8192 };
+  const size_t backlogs[] = { TCP_MSS, 8 * TCP_MSS };
+  for(size_t backlog : backlogs){
+    for(size_t chunk : chunks){
+      Result a = run(false, chunk, backlog);
+      Result b = run(true, chunk, backlog);
+      double mb = TOTAL / 1048576.0;
+      printf("%7zu %7zu | %10.0f %9.1f %9zu | %10.0f %9.1f %9zu\n", chunk, backlog,
+             mb / a.seconds, a.allocs / mb, a.peak, mb / b.seconds, b.allocs / mb, b.peak);
+    }
+  }
+  return host_result();
+}
@@ -0,0 +1,147 @@
+/*
+  RX buffer sizing in AsyncTCPbuffer under bursty traffic. Each burst is a
+  run of length prefixed messages, written back to back and cut into
+  TCP_MSS segments; idle gaps follow, during which lwIP polls every 500 ms.
+  The data callback only takes whole messages, so partial ones wait in the
+  RX buffer, which empties at the end of every burst. Compares 1.2.2 (grow
+  by resizeAdd(), back to 100 bytes whenever empty) with the current policy
+  (grow by doubling, shrink after ATB_RX_SHRINK_IDLE or on low heap).
+*/
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "ESPAsyncTCPbuffer.h"
+#include "host_test.h"
+#include "atb_122.h"
+
+#define PORT 80
+#define TOTAL (8u * 1024 * 1024)
+#define HEADER 4
+
+struct Scenario {
+  const char *name;
+  size_t msgMin, msgMax;        // bytes, header included
+  size_t burstMin, burstMax;    // messages
+  uint32_t gapMin, gapMax;      // ms
+};
+
+struct Result {
+  double allocs;    // per MB, pbufs not counted
+  double resizes;   // per MB
+  size_t peak;      // largest buffer
+};
+
+static AsyncClient *accepted = NULL;
+static size_t messages;
+static size_t messageBytes;
+
+static uint32_t seed;
+static uint32_t rnd(uint32_t lo, uint32_t hi){
+  seed = seed * 1103515245 + 12345;
+  return lo + (seed >> 8) % (hi - lo + 1);
+}
+
+// takes every complete message, leaves a partial one for later
+static size_t onMessages(uint8_t *buf, size_t len){
+  size_t used = 0;
+  while(len - used >= HEADER){
+    uint32_t m = buf[used] | (buf[used + 1] << 8) | (buf[used + 2] << 16) | ((uint32_t)buf[used + 3] << 24);
+    if(len - used < m)
+      break;
+    messages++;
+    messageBytes += m;
+    used += m;
+  }
+  return used;
+}
+
+static void message(std::vector<char> &out, size_t len){
+  size_t at = out.size();
+  out.resize(at + len, 'm');
+  out[at] = len & 0xff;
+  out[at + 1] = (len >> 8) & 0xff;
+  out[at + 2] = (len >> 16) & 0xff;
+  out[at + 3] = (len >> 24) & 0xff;
+}
+
+static Result run(const Scenario &s, bool current){
+  accepted = NULL;
+  struct tcp_pcb *pcb = host_accept(PORT, 0x0100007f);
+  AsyncClient *c = accepted;
+  AsyncTCPbuffer *buffer = NULL;
+  AtbRx122 *old = NULL;
+  if(current){
+    buffer = new AsyncTCPbuffer(c);
+    buffer->onDisconnect([](AsyncTCPbuffer *){ return false; });
+    buffer->onData(onMessages);
+  } else {
+    old = new AtbRx122(c);
+    old->onData(onMessages);
+  }
+
+  // same byte stream and timing for both
+  seed = 1;
+  messages = 0;
+  messageBytes = 0;
+  size_t sent = 0, expected = 0, segments = 0;
+  std::vector<char> burst;
+  host_heap_reset();
+  while(sent < TOTAL){
+    burst.clear();
+    size_t count = rnd(s.burstMin, s.burstMax);
+    for(size_t i = 0; i < count; i++)
+      message(burst, rnd(s.msgMin, s.msgMax));
+    for(size_t pos = 0; pos < burst.size(); pos += TCP_MSS){
+      size_t len = burst.size() - pos < TCP_MSS ? burst.size() - pos : TCP_MSS;
+      host_recv(pcb, burst.data() + pos, len);
+      segments++;
+      host_advance(1);
+    }
+    sent += burst.size();
+    expected += count;
+    uint32_t gap = rnd(s.gapMin, s.gapMax);
+    for(uint32_t t = 0; t < gap; t += 500){
+      host_advance(gap - t < 500 ? gap - t : 500);
+      host_poll(pcb);
+    }
+  }
+  // one pbuf per segment is the stack's, not the buffer's
+  size_t allocs = host_heap.allocs - segments;
+  double mb = sent / 1048576.0;
+  Result r;
+  r.allocs = allocs / mb;
+  if(current){
+    r.resizes = buffer->getRxResizes() / mb;
+    r.peak = buffer->getRxPeak();
+  } else {
+    r.resizes = old->resizes / mb;
+    r.peak = old->peak;
+  }
+  if(messages != expected || messageBytes != sent){
+    fprintf(stderr, "%s %s: %zu of %zu messages, %zu of %zu bytes\n", s.name, current ? "current" : "1.2.2", messages, expected, messageBytes, sent);
+    host_failures++;
+  }
+  c->abort();
+  delete buffer;
+  delete old;
+  return r;
+}
+
+int main(){
+  AsyncServer server(PORT);
+  server.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+  server.begin();
+
+  const Scenario scenarios[] = {
+    { "chatty",  16,   256,  1, 20,   20,  200 },
+    { "mixed",   100,  6000, 1,  8,  100, 3000 },
+    { "bulk",    2000, 16000, 1, 8, 1000, 5000 },
+  };
+  printf("%u MB per run, heap allocations and buffer resizes per MB (pbufs not counted)\n\n", TOTAL >> 20);
+  printf("%-7s | %9s %9s %7s | %9s %9s %7s\n", "", "1.2.2", "resizes", "peak", "now", "resizes", "peak");
+  for(const Scenario &s : scenarios){
+    Result a = run(s, false);
+    Result b = run(s, true);
+    printf("%-7s | %9.1f %9.1f %7zu | %9.1f %9.1f %7zu\n", s.name, a.allocs, a.resizes, a.peak, b.allocs, b.resizes, b.peak);
+  }
+  return host_result();
+}
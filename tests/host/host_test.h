@@ -0,0 +1,43 @@
+/*
+  Shared helpers for the host tests and benchmarks.
+*/
+#ifndef HOST_TEST_H_
+#define HOST_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "host_lwip.h"
+
+static int host_failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)){ \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    host_failures++; \
+  } \
+} while(false)
+
+#define RUN(test) do { \
+  int before = host_failures; \
+  test(); \
+  printf("%-40s %s\n", #test, host_failures == before ? "ok" : "FAILED"); \
+} while(false)
+
+static inline int host_result(){
+  if(host_protocol_errors){
+    fprintf(stderr, "%u callbacks broke the ERR_ABRT contract\n", (unsigned)host_protocol_errors);
+    return 1;
+  }
+  return host_failures ? 1 : 0;
+}
+
+// wall clock seconds, for the benchmarks
+static inline double host_seconds(){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// keeps the optimizer from dropping a result
+static volatile size_t host_sink;
+
+#endif
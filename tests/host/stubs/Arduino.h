@@ -0,0 +1,94 @@
+/*
+  Host stand-in for the parts of the ESP8266 Arduino core the library uses.
+  millis() is a counter the tests move with host_advance(), see host_lwip.h.
+*/
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <new>
+#include <functional>
+#include "IPAddress.h"
+#include "lwip/opt.h"
+
+unsigned long millis();
+void delay(unsigned long ms);
+void yield();
+void panic();
+
+// Grows like the core's String: reserve() reallocates to the exact size.
+class String {
+  private:
+    char *_buf;
+    unsigned int _len;
+    unsigned int _cap;
+  public:
+    String(): _buf(NULL), _len(0), _cap(0) {}
+    String(const char *s): _buf(NULL), _len(0), _cap(0) { concat(s); }
+    String(const String &other): _buf(NULL), _len(0), _cap(0) { concat(other.c_str()); }
+    ~String(){ free(_buf); }
+    String &operator=(const String &other){
+      if(this != &other){
+        _len = 0;
+        concat(other.c_str());
+      }
+      return *this;
+    }
+    const char *c_str() const { return _buf ? _buf : ""; }
+    unsigned int length() const { return _len; }
+    unsigned char reserve(unsigned int size){
+      if(_buf && _cap >= size)
+        return 1;
+      char *buf = (char*)realloc(_buf, size + 1);
+      if(!buf)
+        return 0;
+      if(!_buf)
+        buf[0] = 0;
+      _buf = buf;
+      _cap = size;
+      return 1;
+    }
+    unsigned char concat(const char *s, unsigned int n){
+      if(!reserve(_len + n))
+        return 0;
+      memcpy(_buf + _len, s, n);
+      _len += n;
+      _buf[_len] = 0;
+      return 1;
+    }
+    unsigned char concat(const char *s){ return s ? concat(s, strlen(s)) : 0; }
+    String &operator+=(char c){ concat(&c, 1); return *this; }
+    bool operator==(const char *s) const { return strcmp(c_str(), s) == 0; }
+    char operator[](unsigned int i) const { return _buf[i]; }
+};
+
+class Print {
+  public:
+    virtual ~Print(){}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+};
+
+class Stream: public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+struct EspClass {
+  uint32_t getFreeHeap();
+  uint32_t getMaxFreeBlockSize(){ return getFreeHeap(); }
+};
+extern EspClass ESP;
+
+template<class T> T min(T a, T b){ return a < b ? a : b; }
+template<class T> T max(T a, T b){ return a > b ? a : b; }
+
+#endif
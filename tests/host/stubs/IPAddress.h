@@ -0,0 +1,26 @@
+#ifndef HOST_IPADDRESS_H_
+#define HOST_IPADDRESS_H_
+
+#include <stdint.h>
+#include "lwip/ip_addr.h"
+
+class IPAddress {
+  private:
+    ip_addr_t _ip;
+  public:
+    IPAddress(){ _ip.addr = 0; }
+    IPAddress(uint32_t addr){ _ip.addr = addr; }
+    IPAddress(int addr){ _ip.addr = (uint32_t)addr; }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d){ _ip.addr = a | (b << 8) | (c << 16) | ((uint32_t)d << 24); }
+    IPAddress(const ip_addr_t *ip){ _ip.addr = ip ? ip->addr : 0; }
+    IPAddress(const ip_addr_t &ip){ _ip.addr = ip.addr; }
+    operator ip_addr_t*(){ return &_ip; }
+    operator const ip_addr_t*() const { return &_ip; }
+    operator uint32_t() const { return _ip.addr; }
+    uint32_t v4() const { return _ip.addr; }
+    bool operator==(const IPAddress &other) const { return _ip.addr == other._ip.addr; }
+};
+
+#define IP_ANY_TYPE IPAddress()
+
+#endif
@@ -0,0 +1,102 @@
+/*
+  tcp_axtls without the crypto, for the SSL build of the host tests. Records
+  pass through in the clear; the first segment received on a connection
+  completes its handshake.
+*/
+#include <map>
+#include "Arduino.h"
+#include "host_lwip.h"
+extern "C" {
+  #include "lwip/tcp.h"
+}
+#include "tcp_axtls.h"
+
+struct host_ssl {
+  void *arg;
+  tcp_ssl_data_cb_t on_data;
+  tcp_ssl_handshake_cb_t on_handshake;
+  tcp_ssl_error_cb_t on_error;
+  bool server;
+  bool handshaked;
+};
+
+static std::map<struct tcp_pcb*, host_ssl> ssls;
+static SSL_CTX *const host_ctx = (SSL_CTX*)&ssls;
+int host_ssl_new_fail = 0;
+int host_ssl_write_fail = 0;
+
+void ssl_ctx_free(SSL_CTX *ctx){ (void)ctx; }
+
+uint8_t tcp_ssl_has_client(){
+  for(auto &s : ssls)
+    if(!s.second.server)
+      return 1;
+  return 0;
+}
+
+uint8_t tcp_ssl_server_handshakes(){
+  uint8_t n = 0;
+  for(auto &s : ssls)
+    if(s.second.server && !s.second.handshaked)
+      n++;
+  return n;
+}
+
+static int ssl_new(struct tcp_pcb *tcp, bool server){
+  if(host_ssl_new_fail > 0){
+    host_ssl_new_fail--;
+    return -1;
+  }
+  ssls[tcp] = host_ssl{ NULL, NULL, NULL, NULL, server, false };
+  return 0;
+}
+
+int tcp_ssl_new_client(struct tcp_pcb *tcp){ return ssl_new(tcp, false); }
+int tcp_ssl_new_server(struct tcp_pcb *tcp, SSL_CTX *ssl_ctx){ (void)ssl_ctx; return ssl_new(tcp, true); }
+SSL_CTX *tcp_ssl_new_server_ctx(const char *cert, const char *private_key_file, const char *password){ return host_ctx; }
+int tcp_ssl_is_server(struct tcp_pcb *tcp){ return ssls.count(tcp) && ssls[tcp].server; }
+int tcp_ssl_free(struct tcp_pcb *tcp){ ssls.erase(tcp); return 0; }
+bool tcp_ssl_has(struct tcp_pcb *tcp){ return ssls.count(tcp) != 0; }
+SSL *tcp_ssl_get_ssl(struct tcp_pcb *tcp){ return (SSL*)&ssls[tcp]; }
+void tcp_ssl_file(tcp_ssl_file_cb_t cb, void *arg){ (void)cb; (void)arg; }
+void tcp_ssl_arg(struct tcp_pcb *tcp, void *arg){ ssls[tcp].arg = arg; }
+void tcp_ssl_data(struct tcp_pcb *tcp, tcp_ssl_data_cb_t arg){ ssls[tcp].on_data = arg; }
+void tcp_ssl_handshake(struct tcp_pcb *tcp, tcp_ssl_handshake_cb_t arg){ ssls[tcp].on_handshake = arg; }
+void tcp_ssl_err(struct tcp_pcb *tcp, tcp_ssl_error_cb_t arg){ ssls[tcp].on_error = arg; }
+
+int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p){
+  auto it = ssls.find(tcp);
+  if(it == ssls.end())
+    return ERR_TCP_SSL_INVALID_SSL;
+  tcp_recved(tcp, p->tot_len);
+  if(!it->second.handshaked){
+    pbuf_free(p);
+    it->second.handshaked = true;
+    if(it->second.on_handshake)
+      it->second.on_handshake(it->second.arg, tcp, (SSL*)&it->second);
+    return 0;
+  }
+  int total = p->tot_len;
+  host_ssl s = it->second;
+  for(struct pbuf *q = p; q; q = q->next){
+    if(s.on_data)
+      s.on_data(s.arg, tcp, (uint8_t*)q->payload, q->len);
+    if(!tcp_ssl_has(tcp))
+      break;
+  }
+  pbuf_free(p);
+  return total;
+}
+
+int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len){
+  if(host_ssl_write_fail > 0){
+    host_ssl_write_fail--;
+    return -1;
+  }
+  if(len > tcp_sndbuf(tcp))
+    len = tcp_sndbuf(tcp);
+  if(tcp_write(tcp, data, len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+    return -1;
+  tcp_output(tcp);
+  return len;
+}
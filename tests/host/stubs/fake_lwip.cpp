@@ -0,0 +1,514 @@
+/*
+  Minimal lwIP raw API, os_timer and core functions for the host tests.
+*/
+#include <set>
+#include <map>
+#include <vector>
+#include <malloc.h>
+#include "Arduino.h"
+#include "host_lwip.h"
+extern "C" {
+  #include "osapi.h"
+  #include "lwip/dns.h"
+}
+
+// lwIP keeps a closed pcb until the FIN handshake is over; here it goes at
+// the end of the callback it was closed from.
+static std::vector<struct tcp_pcb*> closing;
+static std::set<const struct tcp_pcb*> aborted;
+static int depth;
+
+struct host_call {
+  host_call(){ depth++; }
+  ~host_call(){
+    if(--depth)
+      return;
+    for(struct tcp_pcb *pcb : closing)
+      free(pcb);
+    closing.clear();
+    aborted.clear();
+  }
+};
+
+EspClass ESP;
+uint32_t host_free_heap = 40000;
+uint32_t EspClass::getFreeHeap(){ return host_free_heap; }
+
+static uint32_t host_ms = 1000;
+uint32_t host_timer_fires = 0;
+unsigned long millis(){ return host_ms; }
+void yield(){}
+void panic(){ abort(); }
+
+// os_timer
+
+static os_timer_t *timers = NULL;
+
+extern "C" void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg){
+  os_timer_disarm(t);
+  t->func = fn;
+  t->arg = arg;
+}
+
+extern "C" void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat){
+  os_timer_disarm(t);
+  t->expire = host_ms + ms;
+  t->period = repeat ? ms : 0;
+  t->armed = true;
+  t->next = timers;
+  timers = t;
+}
+
+extern "C" void os_timer_disarm(os_timer_t *t){
+  for(os_timer_t **p = &timers; *p; p = &(*p)->next){
+    if(*p == t){
+      *p = t->next;
+      break;
+    }
+  }
+  t->armed = false;
+  t->next = NULL;
+}
+
+static os_timer_t *next_due(uint32_t until){
+  os_timer_t *due = NULL;
+  for(os_timer_t *t = timers; t; t = t->next){
+    if((int32_t)(until - t->expire) >= 0 && (!due || (int32_t)(due->expire - t->expire) > 0))
+      due = t;
+  }
+  return due;
+}
+
+void host_advance(uint32_t ms){
+  host_call call;
+  uint32_t until = host_ms + ms;
+  os_timer_t *t;
+  while((t = next_due(until)) != NULL){
+    if((int32_t)(t->expire - host_ms) > 0)
+      host_ms = t->expire;
+    os_timer_disarm(t);
+    if(t->period)
+      os_timer_arm(t, t->period, true);
+    host_timer_fires++;
+    t->func(t->arg);
+  }
+  host_ms = until;
+}
+
+void delay(unsigned long ms){ host_advance(ms); }
+
+// heap
+
+host_heap_stats host_heap;
+
+void host_heap_reset(){
+  host_heap.allocs = 0;
+  host_heap.frees = 0;
+  host_heap.peak = host_heap.bytes;
+}
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+static void *counted(void *p){
+  if(p){
+    host_heap.allocs++;
+    host_heap.bytes += malloc_usable_size(p);
+    if(host_heap.bytes > host_heap.peak)
+      host_heap.peak = host_heap.bytes;
+  }
+  return p;
+}
+
+void *__wrap_malloc(size_t size){ return counted(__real_malloc(size)); }
+void *__wrap_calloc(size_t n, size_t size){ return counted(__real_calloc(n, size)); }
+
+void __wrap_free(void *p){
+  if(!p)
+    return;
+  host_heap.frees++;
+  host_heap.bytes -= malloc_usable_size(p);
+  __real_free(p);
+}
+
+void *__wrap_realloc(void *p, size_t size){
+  size_t old = p ? malloc_usable_size(p) : 0;
+  void *r = __real_realloc(p, size);
+  if(r){
+    host_heap.allocs++;
+    host_heap.bytes += malloc_usable_size(r) - old;
+    if(host_heap.bytes > host_heap.peak)
+      host_heap.peak = host_heap.bytes;
+  }
+  return r;
+}
+}
+
+void *operator new(size_t size){ void *p = malloc(size); if(!p) throw std::bad_alloc(); return p; }
+void *operator new[](size_t size){ void *p = malloc(size); if(!p) throw std::bad_alloc(); return p; }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return malloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return malloc(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// pbuf
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type){
+  (void)layer;
+  (void)type;
+  struct pbuf *p = (struct pbuf*)malloc(sizeof(struct pbuf) + length);
+  if(!p)
+    return NULL;
+  p->next = NULL;
+  p->payload = (uint8_t*)p + sizeof(struct pbuf);
+  p->tot_len = length;
+  p->len = length;
+  p->type = PBUF_RAM;
+  p->flags = 0;
+  p->ref = 1;
+  return p;
+}
+
+u8_t pbuf_free(struct pbuf *p){
+  u8_t count = 0;
+  while(p){
+    if(--p->ref > 0)
+      break;
+    struct pbuf *next = p->next;
+    free(p);
+    count++;
+    p = next;
+  }
+  return count;
+}
+
+void pbuf_ref(struct pbuf *p){ p->ref++; }
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail){
+  struct pbuf *p = head;
+  for(; p->next; p = p->next)
+    p->tot_len += tail->tot_len;
+  p->tot_len += tail->tot_len;
+  p->next = tail;
+}
+
+void pbuf_chain(struct pbuf *head, struct pbuf *tail){
+  pbuf_cat(head, tail);
+  pbuf_ref(tail);
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset){
+  u16_t copied = 0;
+  for(; p && copied < len; p = p->next){
+    if(offset >= p->len){
+      offset -= p->len;
+      continue;
+    }
+    u16_t n = p->len - offset;
+    if(n > len - copied)
+      n = len - copied;
+    memcpy((uint8_t*)dataptr + copied, (uint8_t*)p->payload + offset, n);
+    copied += n;
+    offset = 0;
+  }
+  return copied;
+}
+
+struct pbuf *pbuf_coalesce(struct pbuf *p, pbuf_layer layer){
+  if(p->next == NULL)
+    return p;
+  struct pbuf *q = pbuf_alloc(layer, p->tot_len, PBUF_RAM);
+  if(!q)
+    return p;
+  pbuf_copy_partial(p, q->payload, p->tot_len, 0);
+  q->flags = p->flags;
+  pbuf_free(p);
+  return q;
+}
+
+// tcp
+
+static std::set<const struct tcp_pcb*> live;
+static std::map<uint16_t, struct tcp_pcb*> listeners;
+int host_write_fail = 0;
+uint32_t host_protocol_errors = 0;
+uint32_t host_fins_lost = 0;
+
+struct tcp_pcb *host_last_pcb = NULL;
+
+static struct tcp_pcb *pcb_new(){
+  struct tcp_pcb *pcb = (struct tcp_pcb*)calloc(1, sizeof(struct tcp_pcb));
+  host_last_pcb = pcb;
+  pcb->prio = TCP_PRIO_NORMAL;
+  pcb->mss = TCP_MSS;
+  pcb->snd_buf = TCP_SND_BUF;
+  pcb->rto = 6;
+  live.insert(pcb);
+  return pcb;
+}
+
+static void pcb_release(struct tcp_pcb *pcb){
+  live.erase(pcb);
+  for(auto it = listeners.begin(); it != listeners.end(); ++it){
+    if(it->second == pcb){
+      listeners.erase(it);
+      break;
+    }
+  }
+  if(pcb->refused)
+    pbuf_free(pcb->refused);
+  pcb->refused = NULL;
+}
+
+static void pcb_free(struct tcp_pcb *pcb){
+  pcb_release(pcb);
+  free(pcb);
+}
+
+bool host_live(const struct tcp_pcb *pcb){ return live.count(pcb) != 0; }
+size_t host_live_pcbs(){ return live.size(); }
+
+struct tcp_pcb *tcp_new(void){ return pcb_new(); }
+struct tcp_pcb *tcp_new_ip_type(u8_t type){ (void)type; return pcb_new(); }
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio){ pcb->prio = prio; }
+void tcp_arg(struct tcp_pcb *pcb, void *arg){ pcb->callback_arg = arg; }
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv){ pcb->recv = recv; }
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent){ pcb->sent = sent; }
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err){ pcb->errf = err; }
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval){ pcb->poll = poll; pcb->pollinterval = interval; }
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept){ pcb->accept = accept; }
+void tcp_backlog_delayed(struct tcp_pcb *pcb){ pcb->delayed = 1; }
+void tcp_backlog_accepted(struct tcp_pcb *pcb){ pcb->delayed = 0; }
+void tcp_recved(struct tcp_pcb *pcb, u16_t len){ pcb->recved += len; }
+
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port){
+  pcb->local_ip.addr = ipaddr ? ipaddr->addr : 0;
+  pcb->local_port = port;
+  return ERR_OK;
+}
+
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb){
+  // like lwIP, hand back a new (smaller) pcb and free the old one
+  struct tcp_pcb *lpcb = pcb_new();
+  lpcb->local_ip = pcb->local_ip;
+  lpcb->local_port = pcb->local_port;
+  lpcb->callback_arg = pcb->callback_arg;
+  lpcb->state = LISTEN;
+  pcb_free(pcb);
+  listeners[lpcb->local_port] = lpcb;
+  return lpcb;
+}
+
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected){
+  pcb->remote_ip = *ipaddr;
+  pcb->remote_port = port;
+  pcb->connected = connected;
+  pcb->state = SYN_SENT;
+  return ERR_OK;
+}
+
+err_t tcp_close(struct tcp_pcb *pcb){
+  if(!depth){
+    pcb_free(pcb);
+    return ERR_OK;
+  }
+  pcb_release(pcb);
+  pcb->state = (pcb->state == CLOSE_WAIT) ? LAST_ACK : FIN_WAIT_1;
+  closing.push_back(pcb);
+  return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb *pcb){
+  tcp_err_fn errf = pcb->errf;
+  void *arg = pcb->callback_arg;
+  if(depth)
+    aborted.insert(pcb);
+  pcb_free(pcb);
+  if(errf)
+    errf(arg, ERR_ABRT);
+}
+
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags){
+  (void)dataptr;
+  (void)apiflags;
+  if(host_write_fail > 0){
+    host_write_fail--;
+    return ERR_MEM;
+  }
+  if(pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT)
+    return ERR_CONN;
+  if(len > pcb->snd_buf)
+    return ERR_MEM;
+  pcb->snd_buf -= len;
+  pcb->snd_queuelen++;
+  pcb->snd_lbb += len;
+  pcb->unsent_len += len;
+  pcb->written += len;
+  pcb->unsent = pcb;
+  return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb *pcb){
+  pcb->unacked_len += pcb->unsent_len;
+  pcb->unsent_len = 0;
+  pcb->unsent = NULL;
+  if(pcb->unacked_len)
+    pcb->unacked = pcb;
+  return ERR_OK;
+}
+
+err_t dns_gethostbyname(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg){
+  (void)name;
+  (void)addr;
+  (void)found;
+  (void)arg;
+  return ERR_ARG;
+}
+
+// driver
+
+struct tcp_pcb *host_listener(uint16_t port){
+  auto it = listeners.find(port);
+  return it == listeners.end() ? NULL : it->second;
+}
+
+// A callback has to return ERR_ABRT if it aborted its pcb, and only then.
+static err_t checked(struct tcp_pcb *pcb, err_t err){
+  if((aborted.count(pcb) != 0) != (err == ERR_ABRT))
+    host_protocol_errors++;
+  return err;
+}
+
+struct tcp_pcb *host_accept(uint16_t port, uint32_t remote_ip, uint16_t remote_port){
+  host_call call;
+  struct tcp_pcb *lpcb = host_listener(port);
+  if(!lpcb || !lpcb->accept)
+    return NULL;
+  struct tcp_pcb *pcb = pcb_new();
+  pcb->state = ESTABLISHED;
+  pcb->local_port = port;
+  pcb->remote_ip.addr = remote_ip;
+  pcb->remote_port = remote_port;
+  err_t err = checked(pcb, lpcb->accept(lpcb->callback_arg, pcb, ERR_OK));
+  if(err == ERR_ABRT)
+    return NULL;
+  if(err != ERR_OK){
+    tcp_abort(pcb);
+    return NULL;
+  }
+  return host_live(pcb) ? pcb : NULL;
+}
+
+void host_connected(struct tcp_pcb *pcb){
+  host_call call;
+  pcb->state = ESTABLISHED;
+  if(pcb->connected)
+    checked(pcb, pcb->connected(pcb->callback_arg, pcb, ERR_OK));
+}
+
+static err_t deliver(struct tcp_pcb *pcb, struct pbuf *pb){
+  if(!pcb->recv){
+    if(pb){
+      tcp_recved(pcb, pb->tot_len);
+      pbuf_free(pb);
+    }
+    return ERR_OK;
+  }
+  err_t err = checked(pcb, pcb->recv(pcb->callback_arg, pcb, pb, ERR_OK));
+  if(err == ERR_ABRT)
+    return err;
+  if(err != ERR_OK && host_live(pcb)){
+    if(pb)
+      pcb->refused = pb;
+    else
+      host_fins_lost++;
+  }
+  return err;
+}
+
+err_t host_recv(struct tcp_pcb *pcb, const void *data, size_t len, bool push){
+  host_call call;
+  if(pcb->refused)
+    return ERR_MEM;
+  struct pbuf *pb = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+  memcpy(pb->payload, data, len);
+  if(push)
+    pb->flags |= PBUF_FLAG_PUSH;
+  return deliver(pcb, pb);
+}
+
+err_t host_recv_chain(struct tcp_pcb *pcb, const void *data, size_t len, size_t seg){
+  host_call call;
+  if(pcb->refused)
+    return ERR_MEM;
+  struct pbuf *head = NULL, **link = &head, *last = NULL;
+  for(size_t off = 0; off < len; off += seg){
+    size_t n = (len - off < seg) ? len - off : seg;
+    struct pbuf *pb = pbuf_alloc(PBUF_RAW, n, PBUF_RAM);
+    memcpy(pb->payload, (const char*)data + off, n);
+    pb->tot_len = len - off;
+    *link = last = pb;
+    link = &pb->next;
+  }
+  last->flags |= PBUF_FLAG_PUSH;
+  return deliver(pcb, head);
+}
+
+err_t host_fin(struct tcp_pcb *pcb){
+  host_call call;
+  pcb->state = CLOSE_WAIT;
+  return deliver(pcb, NULL);
+}
+
+void host_fasttmr(){
+  host_call call;
+  std::set<const struct tcp_pcb*> pcbs(live);
+  for(const struct tcp_pcb *c : pcbs){
+    struct tcp_pcb *pcb = (struct tcp_pcb*)c;
+    if(host_live(pcb) && pcb->refused){
+      struct pbuf *pb = pcb->refused;
+      pcb->refused = NULL;
+      deliver(pcb, pb);
+    }
+  }
+}
+
+err_t host_ack(struct tcp_pcb *pcb, size_t len){
+  host_call call;
+  tcp_output(pcb);
+  if(len == 0 || len > pcb->unacked_len)
+    len = pcb->unacked_len;
+  if(len == 0)
+    return ERR_OK;
+  pcb->unacked_len -= len;
+  if(!pcb->unacked_len)
+    pcb->unacked = NULL;
+  pcb->snd_buf += len;
+  pcb->lastack += len;
+  if(pcb->snd_queuelen)
+    pcb->snd_queuelen--;
+  if(!pcb->sent)
+    return ERR_OK;
+  return checked(pcb, pcb->sent(pcb->callback_arg, pcb, len));
+}
+
+err_t host_poll(struct tcp_pcb *pcb){
+  host_call call;
+  if(!pcb->poll)
+    return ERR_OK;
+  return checked(pcb, pcb->poll(pcb->callback_arg, pcb));
+}
+
+void host_reset(struct tcp_pcb *pcb, err_t err){
+  host_call call;
+  tcp_err_fn errf = pcb->errf;
+  void *arg = pcb->callback_arg;
+  pcb_free(pcb);
+  if(errf)
+    errf(arg, err);
+}
@@ -0,0 +1,51 @@
+/*
+  Driver side of the fake lwIP/os_timer/heap used by the host tests: the
+  test plays the network and the clock, the library runs unchanged on top.
+  The fake frees a pcb in tcp_close() and tcp_abort() right away, so with
+  -fsanitize=address any later use by the library is reported.
+*/
+#ifndef HOST_LWIP_H_
+#define HOST_LWIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lwip/tcp.h"
+
+// clock, os_timer
+void host_advance(uint32_t ms);         // move millis(), fire due os_timers
+extern uint32_t host_timer_fires;       // os_timer callbacks run so far
+
+// heap, counted through malloc/free and operator new/delete
+struct host_heap_stats {
+  size_t allocs;        // calls that returned memory
+  size_t frees;
+  size_t bytes;         // in use
+  size_t peak;          // high-water of bytes since host_heap_reset()
+};
+extern host_heap_stats host_heap;
+void host_heap_reset();                 // counters to 0, peak to the current use
+extern uint32_t host_free_heap;         // what ESP.getFreeHeap() reports
+
+// network
+struct tcp_pcb *host_listener(uint16_t port);   // the listening pcb on port
+struct tcp_pcb *host_accept(uint16_t port, uint32_t remote_ip, uint16_t remote_port = 40000);
+bool host_live(const struct tcp_pcb *pcb);
+size_t host_live_pcbs();
+extern struct tcp_pcb *host_last_pcb;   // the pcb made last, e.g. by AsyncClient::connect()
+err_t host_recv(struct tcp_pcb *pcb, const void *data, size_t len, bool push = true);
+err_t host_recv_chain(struct tcp_pcb *pcb, const void *data, size_t len, size_t seg); // one chain of seg byte pbufs, PSH on the last
+err_t host_fin(struct tcp_pcb *pcb);
+err_t host_ack(struct tcp_pcb *pcb, size_t len);    // ack len in-flight bytes, all when 0
+err_t host_poll(struct tcp_pcb *pcb);
+void host_fasttmr();                                // redeliver refused data
+void host_reset(struct tcp_pcb *pcb, err_t err = ERR_RST);
+void host_connected(struct tcp_pcb *pcb);
+extern int host_write_fail;             // tcp_write() returns ERR_MEM while > 0, counts down
+extern uint32_t host_protocol_errors;   // callbacks that freed their pcb but did not return ERR_ABRT
+extern uint32_t host_fins_lost;         // refused FINs, lwIP does not keep them
+
+// tcp_axtls, SSL build only
+extern int host_ssl_new_fail;           // tcp_ssl_new_*() fail while > 0, counts down
+extern int host_ssl_write_fail;         // tcp_ssl_write() fails while > 0, counts down
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_SSL_H_
+#define HOST_SSL_H_
+#include <stdint.h>
+typedef struct SSL_ SSL;
+typedef struct SSL_CTX_ SSL_CTX;
+#define SSL_CLOSE_NOTIFY -3
+void ssl_ctx_free(SSL_CTX *ctx);
+#endif
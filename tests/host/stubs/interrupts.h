@@ -0,0 +1 @@
+void ets_intr_lock(); void ets_intr_unlock();
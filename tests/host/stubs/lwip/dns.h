@@ -0,0 +1,13 @@
+#ifndef HOST_LWIP_DNS_H_
+#define HOST_LWIP_DNS_H_
+#include "lwip/ip_addr.h"
+#include "lwip/err.h"
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *arg);
+#ifdef __cplusplus
+extern "C" {
+#endif
+err_t dns_gethostbyname(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1 @@
+#define LWIP_VERSION_MAJOR 2
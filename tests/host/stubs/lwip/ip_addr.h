@@ -0,0 +1,7 @@
+#ifndef HOST_LWIP_IP_ADDR_H_
+#define HOST_LWIP_IP_ADDR_H_
+#include <stdint.h>
+typedef struct ip_addr { uint32_t addr; } ip_addr_t;
+#define IPADDR_TYPE_ANY 46
+#define ip_addr_cmp(a, b) ((a)->addr == (b)->addr)
+#endif
@@ -0,0 +1,11 @@
+#ifndef HOST_LWIP_OPT_H_
+#define HOST_LWIP_OPT_H_
+#define LWIP_NETIF_TX_SINGLE_PBUF 1
+#define TCP_LISTEN_BACKLOG 1
+#define TCP_SLOW_INTERVAL 500
+#ifndef TCP_MSS
+#define TCP_MSS 1460
+#endif
+#define TCP_WND (4 * TCP_MSS)
+#define TCP_SND_BUF (2 * TCP_MSS)
+#endif
@@ -0,0 +1,29 @@
+#ifndef HOST_LWIP_PBUF_H_
+#define HOST_LWIP_PBUF_H_
+#include "lwip/err.h"
+struct pbuf {
+  struct pbuf *next;
+  void *payload;
+  u16_t tot_len;
+  u16_t len;
+  u8_t type;
+  u8_t flags;
+  u16_t ref;
+};
+#define PBUF_FLAG_PUSH 0x01
+typedef enum { PBUF_TRANSPORT, PBUF_IP, PBUF_LINK, PBUF_RAW_TX, PBUF_RAW } pbuf_layer;
+typedef enum { PBUF_RAM, PBUF_ROM, PBUF_REF, PBUF_POOL } pbuf_type;
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+void pbuf_chain(struct pbuf *head, struct pbuf *tail);
+struct pbuf *pbuf_coalesce(struct pbuf *p, pbuf_layer layer);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+#ifdef __cplusplus
+}
+#endif
+#endif
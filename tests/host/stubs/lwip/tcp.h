@@ -0,0 +1,88 @@
+#ifndef HOST_LWIP_TCP_H_
+#define HOST_LWIP_TCP_H_
+#include "lwip/opt.h"
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip_addr.h"
+
+typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *tpcb, u16_t len);
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
+typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
+
+enum tcp_state {
+  CLOSED = 0, LISTEN = 1, SYN_SENT = 2, SYN_RCVD = 3, ESTABLISHED = 4,
+  FIN_WAIT_1 = 5, FIN_WAIT_2 = 6, CLOSE_WAIT = 7, CLOSING = 8, LAST_ACK = 9, TIME_WAIT = 10
+};
+
+struct tcp_pcb {
+  ip_addr_t local_ip, remote_ip;
+  int state;
+  u8_t prio;
+  u16_t local_port, remote_port;
+  s16_t sa, sv;
+  s16_t rto;
+  u32_t snd_lbb, lastack;
+  u16_t snd_queuelen;
+  u16_t mss;
+  void *unsent;
+  void *unacked;
+  u16_t snd_buf;
+  // callbacks as lwIP keeps them
+  void *callback_arg;
+  tcp_recv_fn recv;
+  tcp_sent_fn sent;
+  tcp_poll_fn poll;
+  tcp_err_fn errf;
+  tcp_accept_fn accept;
+  tcp_connected_fn connected;
+  u8_t pollinterval;
+  // host bookkeeping, see host_lwip.h
+  struct pbuf *refused;
+  u32_t unsent_len;
+  u32_t unacked_len;
+  u32_t written;
+  u32_t recved;
+  u8_t delayed;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio);
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected);
+struct tcp_pcb *tcp_new(void);
+struct tcp_pcb *tcp_new_ip_type(u8_t type);
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags);
+err_t tcp_output(struct tcp_pcb *pcb);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+void tcp_backlog_delayed(struct tcp_pcb *pcb);
+void tcp_backlog_accepted(struct tcp_pcb *pcb);
+#ifdef __cplusplus
+}
+#endif
+
+#define TCP_PRIO_MIN 1
+#define TCP_PRIO_NORMAL 64
+#define TCP_PRIO_MAX 127
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+#define tcp_sndbuf(pcb) ((pcb)->snd_buf)
+#define tcp_sndqueuelen(pcb) ((pcb)->snd_queuelen)
+#define tcp_mss(pcb) ((pcb)->mss)
+#define tcp_nagle_disable(pcb) (void)0
+#define tcp_nagle_enable(pcb) (void)0
+#define tcp_nagle_disabled(pcb) (0)
+#endif
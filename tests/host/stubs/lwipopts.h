@@ -0,0 +1 @@
+#define LWIP_RAW 1
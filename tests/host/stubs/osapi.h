@@ -0,0 +1,28 @@
+#ifndef HOST_OSAPI_H_
+#define HOST_OSAPI_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef void os_timer_func_t(void *arg);
+
+typedef struct _os_timer_t {
+  struct _os_timer_t *next;
+  uint32_t expire;
+  uint32_t period;
+  os_timer_func_t *func;
+  void *arg;
+  bool armed;
+} os_timer_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg);
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat);
+void os_timer_disarm(os_timer_t *t);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
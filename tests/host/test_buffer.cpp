@@ -0,0 +1,142 @@
+/*
+  AsyncTCPbuffer RX handling against the fake stack.
+*/
+#include <string>
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "ESPAsyncTCPbuffer.h"
+#include "host_test.h"
+
+#define PORT 80
+#define RECORD 30
+
+static AsyncClient *accepted;
+
+// Fixed size records, the callback only ever takes whole ones. The third
+// segment leaves a record split across the end of the RX ring.
+static void test_free_mode_record_across_wrap(){
+  accepted = NULL;
+  struct tcp_pcb *pcb = host_accept(PORT, 0x0100007f);
+  CHECK(accepted != NULL);
+  AsyncTCPbuffer *buffer = new AsyncTCPbuffer(accepted);
+  static size_t records;
+  records = 0;
+  buffer->onData([](uint8_t *payload, size_t len) -> size_t {
+    records += len / RECORD;
+    return len - len % RECORD;
+  });
+
+  char data[70];
+  memset(data, 'r', sizeof(data));
+  host_recv(pcb, data, 40);
+  host_recv(pcb, data, 40);
+  host_recv(pcb, data, 70);
+  CHECK(records == 150 / RECORD);
+  // deletes the client and the buffer
+  accepted->close(true);
+}
+
+static std::vector<std::string> frames;
+static bool disconnected;
+
+// Two byte big endian headers, frames of up to maxSize bytes.
+static void frameBuffer(struct tcp_pcb **pcb, size_t maxSize){
+  accepted = NULL;
+  *pcb = host_accept(PORT, 0x0100007f);
+  CHECK(accepted != NULL);
+  AsyncTCPbuffer *buffer = new AsyncTCPbuffer(accepted);
+  frames.clear();
+  disconnected = false;
+  buffer->onDisconnect([](AsyncTCPbuffer *b) -> bool { disconnected = true; return true; });
+  buffer->onFrame([](uint8_t *payload, size_t len){ frames.push_back(std::string((char *) payload, len)); }, 2, true, maxSize);
+}
+
+// Closing the connection deletes the client and the buffer.
+static void closeFrames(){
+  accepted->close(true);
+  CHECK(disconnected);
+}
+
+static std::string frame(size_t len, char c){
+  std::string f(2, 0);
+  f[0] = (char)(len >> 8);
+  f[1] = (char)len;
+  return f + std::string(len, c);
+}
+
+static void test_frame_header_split(){
+  struct tcp_pcb *pcb;
+  frameBuffer(&pcb, 100);
+  std::string f = frame(20, 'h');
+  host_recv(pcb, f.data(), 1);
+  host_recv(pcb, f.data() + 1, 1);
+  CHECK(frames.empty());
+  host_recv(pcb, f.data() + 2, f.size() - 2);
+  CHECK(frames.size() == 1 && frames[0] == std::string(20, 'h'));
+  closeFrames();
+}
+
+// Several frames in one segment, a zero length one among them, and one split
+// off at its end.
+static void test_frame_several_in_one_pbuf(){
+  struct tcp_pcb *pcb;
+  frameBuffer(&pcb, 100);
+  std::string next = frame(30, 'd');
+  std::string data = frame(10, 'a') + frame(0, 'b') + frame(5, 'c') + next.substr(0, 7);
+  host_recv(pcb, data.data(), data.size());
+  CHECK(frames.size() == 3);
+  CHECK(frames[0] == std::string(10, 'a') && frames[1].empty() && frames[2] == std::string(5, 'c'));
+  host_recv(pcb, next.data() + 7, next.size() - 7);
+  CHECK(frames.size() == 4 && frames[3] == std::string(30, 'd'));
+  closeFrames();
+}
+
+// The staged part of the second frame starts at 84 of the 100 byte ring, its
+// end wraps to the front and is made one piece in place.
+static void test_frame_across_wrap(){
+  struct tcp_pcb *pcb;
+  frameBuffer(&pcb, 100);
+  std::string a = frame(82, 'a');
+  std::string b = frame(40, 'b');
+  std::string data = a + b;
+  host_recv(pcb, data.data(), 80);
+  host_recv(pcb, data.data() + 80, 14);
+  CHECK(frames.size() == 1 && frames[0] == std::string(82, 'a'));
+  host_recv(pcb, data.data() + 94, data.size() - 94);
+  CHECK(frames.size() == 2 && frames[1] == std::string(40, 'b'));
+  closeFrames();
+}
+
+// A frame of maxSize is delivered, a header announcing more closes the
+// connection, whether the header arrives whole or is staged first.
+static void test_frame_max_size(){
+  struct tcp_pcb *pcb;
+  frameBuffer(&pcb, 50);
+  std::string ok = frame(50, 'm');
+  host_recv(pcb, ok.data(), ok.size());
+  CHECK(frames.size() == 1 && frames[0].size() == 50);
+  std::string big = frame(51, 'x');
+  host_recv(pcb, big.data(), big.size());
+  CHECK(frames.size() == 1);
+  host_poll(pcb);
+  CHECK(disconnected && !host_live(pcb));
+
+  frameBuffer(&pcb, 50);
+  host_recv(pcb, big.data(), 1);
+  host_recv(pcb, big.data() + 1, 1);
+  CHECK(frames.empty());
+  host_poll(pcb);
+  CHECK(disconnected && !host_live(pcb));
+}
+
+int main(){
+  AsyncServer server(PORT);
+  server.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+  server.begin();
+  RUN(test_free_mode_record_across_wrap);
+  RUN(test_frame_header_split);
+  RUN(test_frame_several_in_one_pbuf);
+  RUN(test_frame_across_wrap);
+  RUN(test_frame_max_size);
+  return host_result();
+}
@@ -0,0 +1,1101 @@
+/*
+  AsyncClient behaviour against the fake stack.
+*/
+#include <string>
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "ESPAsyncTCPbuffer.h"
+#include "SyncClient.h"
+#include "host_test.h"
+
+#define PORT 80
+#define IP(n) (0x0000000a | ((uint32_t)(n) << 24))
+
+static AsyncServer *server;
+static AsyncClient *accepted;
+static size_t deliveries;
+static size_t delivered;
+
+// Accepts a connection and, on the SSL build, completes its handshake.
+static AsyncClient *open(struct tcp_pcb **pcb, uint32_t ip = IP(1)){
+  accepted = NULL;
+  *pcb = host_accept(PORT, ip);
+#if ASYNC_TCP_SSL_ENABLED
+  if(*pcb)
+    host_recv(*pcb, "hello", 5);
+#endif
+  if(accepted){
+    deliveries = 0;
+    delivered = 0;
+    accepted->onData([](void *, AsyncClient *, void *, size_t len){ deliveries++; delivered += len; }, NULL);
+  }
+  return accepted;
+}
+
+static void close(AsyncClient *c){
+  c->abort();
+  delete c;
+}
+
+static size_t released[3];
+
+static void fragments(AcSendFragment *frags, const char *data){
+  for(size_t i = 0; i < 3; i++){
+    released[i] = 0;
+    frags[i].data = data;
+    frags[i].len = 100 * (i + 1);
+    frags[i].flags = 0;
+    frags[i].release = [](void *arg, const char *, size_t){ released[(size_t)arg]++; };
+    frags[i].release_arg = (void*)i;
+  }
+}
+
+#if !ASYNC_TCP_SSL_ENABLED
+// Without a time limit only PSH or the byte threshold hand the data over.
+static void test_coalesce_bytes_only(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->setRecvCoalesce(1000);
+  std::vector<char> data(300, 'c');
+  for(int i = 0; i < 3; i++)
+    host_recv(pcb, data.data(), data.size(), false);
+  host_advance(10000);
+  CHECK(deliveries == 0);
+  host_recv(pcb, data.data(), data.size(), false);
+  CHECK(deliveries == 1);
+  CHECK(delivered == 1200);
+  c->abort();
+  delete c;
+}
+
+static void test_coalesce_time_limit(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->setRecvCoalesce(1000, 50);
+  std::vector<char> data(300, 'c');
+  host_recv(pcb, data.data(), data.size(), false);
+  host_advance(40);
+  CHECK(deliveries == 0);
+  host_advance(20);
+  CHECK(deliveries == 1);
+  CHECK(delivered == 300);
+  c->abort();
+  delete c;
+}
+
+// A limit past the window would stall a window limited peer that sends no
+// PSH, so it is capped a segment short of TCP_WND.
+static void test_coalesce_capped_below_window(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->setRecvCoalesce(2 * TCP_WND);
+  std::vector<char> data(TCP_MSS, 'c');
+  for(int i = 0; i < 3; i++)
+    host_recv(pcb, data.data(), data.size(), false);
+  CHECK(deliveries == 1);
+  CHECK(delivered == 3 * TCP_MSS);
+  CHECK(pcb->recved == 3 * TCP_MSS);
+  c->abort();
+  delete c;
+}
+
+static char first_byte;
+
+// Held data is delivered ahead of later segments once coalescing is turned
+// off or onPacket() takes over, and without waiting for more data.
+static void test_coalesce_off_releases_hold(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->onData([](void *, AsyncClient *, void *data, size_t len){
+    if(!delivered)
+      first_byte = *(char*)data;
+    deliveries++;
+    delivered += len;
+  }, NULL);
+  c->setRecvCoalesce(1000);
+  host_recv(pcb, "aaa", 3, false);
+  c->setRecvCoalesce(0);
+  host_recv(pcb, "bb", 2, false);
+  CHECK(delivered == 5 && first_byte == 'a');
+
+  delivered = 0;
+  c->setRecvCoalesce(1000);
+  host_recv(pcb, "ccc", 3, false);
+  c->setRecvCoalesce(0);
+  host_advance(20);
+  CHECK(delivered == 3 && first_byte == 'c');
+
+  static size_t packets;
+  packets = 0;
+  c->setRecvCoalesce(1000);
+  host_recv(pcb, "ddd", 3, false);
+  c->onPacket([](void *, AsyncClient *c, struct pbuf *pb){ packets += pb->tot_len; c->ackPacket(pb); }, NULL);
+  host_advance(20);
+  CHECK(packets == 3);
+  c->abort();
+  delete c;
+}
+
+// Each referenced fragment is released once, by the ack that covers its
+// last byte; what is still unacked is released when the connection goes.
+static void test_addv_release_on_ack(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  std::vector<char> data(300, 'v');
+  AcSendFragment frags[3];
+  fragments(frags, data.data());
+  CHECK(c->writev(frags, 3) == 600);
+  CHECK(released[0] == 0 && released[1] == 0 && released[2] == 0);
+  host_ack(pcb, 99);
+  CHECK(released[0] == 0);
+  host_ack(pcb, 1);
+  CHECK(released[0] == 1 && released[1] == 0);
+  host_ack(pcb, 250);
+  CHECK(released[0] == 1 && released[1] == 1 && released[2] == 0);
+  host_ack(pcb, 0);
+  CHECK(released[0] == 1 && released[1] == 1 && released[2] == 1);
+
+  fragments(frags, data.data());
+  CHECK(c->writev(frags, 3) == 600);
+  host_ack(pcb, 150);
+  CHECK(released[0] == 1 && released[1] == 0);
+  close(c);
+  CHECK(released[0] == 1 && released[1] == 1 && released[2] == 1);
+}
+
+// Corked sends below a full MSS are held and counted; reaching the MSS,
+// flush(), the end of the callback, the next timer tick after a send from
+// loop() and turning cork off all push them out.
+static void test_cork(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  std::vector<char> data(TCP_MSS, 'k');
+  c->setCork(true);
+  CHECK(c->getCork());
+  c->write(data.data(), 100);
+  c->write(data.data(), 100);
+  CHECK(pcb->unsent_len == 200 && c->getCorkSaved() == 2);
+  c->write(data.data(), TCP_MSS - 200);
+  CHECK(pcb->unsent_len == 0 && c->getCorkSaved() == 2);
+
+  c->write(data.data(), 100);
+  CHECK(c->flush());
+  CHECK(pcb->unsent_len == 0 && c->getCorkSaved() == 3);
+
+  c->write(data.data(), 100);
+  CHECK(pcb->unsent_len == 100);
+  host_advance(2 * ASYNC_TIMER_TICK);
+  CHECK(pcb->unsent_len == 0);
+
+  c->onData([](void *, AsyncClient *c, void *, size_t){ c->write("reply", 5); }, NULL);
+  host_recv(pcb, "req", 3);
+  CHECK(pcb->unsent_len == 0 && c->getCorkSaved() == 5);
+
+  c->write(data.data(), 100);
+  c->setCork(false);
+  CHECK(pcb->unsent_len == 0 && !c->getCork());
+  close(c);
+}
+
+static struct tcp_pcb *vec_pcb;
+static std::vector<size_t> vec_counts;
+static std::vector<u32_t> vec_recved;
+static std::string vec_data;
+
+static void vecReset(){
+  vec_counts.clear();
+  vec_recved.clear();
+  vec_data.clear();
+}
+
+static void vecCollect(const AcDataVec *vec, size_t count, size_t total){
+  size_t len = 0;
+  for(size_t i = 0; i < count; i++){
+    vec_data.append(vec[i].data, vec[i].len);
+    len += vec[i].len;
+  }
+  CHECK(len == total);
+  vec_counts.push_back(count);
+  vec_recved.push_back(vec_pcb->recved);
+}
+
+// A chain goes to onDataVec() as views into its pbufs, split over several
+// calls past ASYNC_RX_VEC_MAX, and the window is updated once afterwards.
+static void test_data_vec_chain(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  vec_pcb = pcb;
+  c->onDataVec([](void *, AsyncClient *, const AcDataVec *vec, size_t count, size_t total){ vecCollect(vec, count, total); }, NULL);
+  std::string data(1000, 0);
+  for(size_t i = 0; i < data.size(); i++)
+    data[i] = (char)(i % 251);
+
+  vecReset();
+  u32_t start = pcb->recved;
+  host_recv_chain(pcb, data.data(), 1000, 250);
+  CHECK(vec_counts.size() == 1 && vec_counts[0] == 4);
+  CHECK(vec_data == data && vec_recved[0] == start);
+  CHECK(pcb->recved - start == 1000 && deliveries == 0);
+
+  vecReset();
+  start = pcb->recved;
+  host_recv_chain(pcb, data.data(), 600, 50);
+  CHECK(vec_counts.size() == 2 && vec_counts[0] == ASYNC_RX_VEC_MAX && vec_counts[1] == 12 - ASYNC_RX_VEC_MAX);
+  CHECK(vec_data == data.substr(0, 600));
+  CHECK(vec_recved[0] == start && vec_recved[1] == start);
+  CHECK(pcb->recved - start == 600);
+
+  // ackLater() leaves the whole chain to ack()
+  c->onDataVec([](void *, AsyncClient *c, const AcDataVec *vec, size_t count, size_t total){ vecCollect(vec, count, total); c->ackLater(); }, NULL);
+  vecReset();
+  start = pcb->recved;
+  host_recv_chain(pcb, data.data(), 300, 100);
+  CHECK(vec_data == data.substr(0, 300) && pcb->recved == start);
+  CHECK(c->ack(1000) == 300 && pcb->recved - start == 300);
+  close(c);
+}
+
+// onPacketChain() gets the chain as lwIP delivered it and owns it until
+// ackPackets(), which frees it and returns its window in one go.
+static void test_packet_chain_deferred_ack(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  static std::vector<struct pbuf*> chains;
+  chains.clear();
+  chains.reserve(4);
+  c->onPacketChain([](void *, AsyncClient *, struct pbuf *pb){ chains.push_back(pb); }, NULL);
+  std::vector<char> data(900, 'c');
+  u32_t start = pcb->recved;
+  size_t heap = host_heap.bytes;
+  host_recv_chain(pcb, data.data(), 900, 300);
+  host_recv_chain(pcb, data.data(), 400, 200);
+  CHECK(chains.size() == 2 && deliveries == 0);
+  CHECK(chains[0]->tot_len == 900 && chains[0]->next && chains[0]->next->next);
+  CHECK(chains[1]->tot_len == 400 && chains[1]->next && !chains[1]->next->next);
+  CHECK(pcb->recved == start && c->isRecvPush());
+  c->ackPackets(chains[1]);
+  CHECK(pcb->recved - start == 400);
+  c->ackPackets(chains[0]);
+  CHECK(pcb->recved - start == 1300);
+  CHECK(host_heap.bytes == heap);
+
+  c->onPacketChain(NULL, NULL);
+  host_recv_chain(pcb, data.data(), 600, 300);
+  CHECK(chains.size() == 2 && deliveries == 2 && delivered == 600);
+  CHECK(pcb->recved - start == 1900);
+  close(c);
+}
+
+// The ack timeout runs from the oldest unacked send: a later send gets a
+// mark of its own, and once every mark is acked the bytes add()ed without
+// a send(), which lwIP sends along with the ack, are timed from then.
+static void test_ack_timeout_marks(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  static int timeouts;
+  timeouts = 0;
+  c->onTimeout([](void *, AsyncClient *, uint32_t){ timeouts++; }, NULL);
+  c->setAckTimeout(1000);
+  std::vector<char> data(100, 't');
+  c->write(data.data(), 100);
+  host_advance(400);
+  c->write(data.data(), 100);
+  host_advance(400);
+  host_ack(pcb, 100);
+  host_advance(500);
+  CHECK(timeouts == 0);
+  host_advance(200);
+  CHECK(timeouts == 1);
+  host_ack(pcb, 0);
+
+  c->write(data.data(), 100);
+  host_advance(400);
+  c->write(data.data(), 100);
+  CHECK(c->add(data.data(), 50) == 50);
+  host_advance(500);
+  host_ack(pcb, 200);
+  CHECK(c->outstanding() == 50);
+  host_advance(800);
+  CHECK(timeouts == 1);
+  host_advance(300);
+  CHECK(timeouts == 2);
+  close(c);
+}
+
+// With a receive budget the window is only reopened for what stays within
+// it; the rest is acked as consume() brings the held total back under.
+static void test_recv_budget(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->setRxBufferLimit(1000);
+  std::vector<char> data(600, 'b');
+  u32_t start = pcb->recved;
+  host_recv(pcb, data.data(), data.size());
+  CHECK(pcb->recved - start == 600 && c->rxHeld() == 600);
+  host_recv(pcb, data.data(), data.size());
+  CHECK(pcb->recved - start == 1000 && c->rxHeld() == 1200);
+  CHECK(c->consume(100) == 100);
+  CHECK(pcb->recved - start == 1100);
+  CHECK(c->consume(100) == 100);
+  CHECK(pcb->recved - start == 1200);
+  CHECK(c->consume(5000) == 1000 && c->rxHeld() == 0);
+  CHECK(pcb->recved - start == 1200);
+  host_recv(pcb, data.data(), data.size());
+  host_recv(pcb, data.data(), data.size());
+  CHECK(pcb->recved - start == 2200);
+  c->setRxBufferLimit(0);
+  CHECK(pcb->recved - start == 2400 && c->rxHeld() == 0);
+  close(c);
+}
+
+// ackLater() data is left to ack(), which goes straight to tcp_recved()
+// without counting against the budget.
+static void test_recv_budget_manual_ack(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->onData([](void *, AsyncClient *c, void *, size_t len){ c->ackLater(); delivered += len; }, NULL);
+  c->setRxBufferLimit(100);
+  std::vector<char> data(500, 'm');
+  u32_t start = pcb->recved;
+  host_recv(pcb, data.data(), data.size());
+  CHECK(delivered == 500 && pcb->recved == start);
+  CHECK(c->ack(200) == 200);
+  CHECK(pcb->recved - start == 200);
+  CHECK(c->ack(1000) == 300);
+  CHECK(pcb->recved - start == 500 && c->rxHeld() == 0);
+  close(c);
+}
+
+#endif
+
+
+// Owns heap memory, so a handler that is never destroyed shows up as a leak.
+struct Counted : AsyncClientHandler {
+  static int live;
+  std::vector<char> state;
+  Counted(): state(64) { live++; }
+  Counted(const Counted &other): state(other.state) { live++; }
+  ~Counted(){ live--; }
+  void onData(AsyncClient *c, void *data, size_t len){ deliveries++; delivered += len; }
+};
+int Counted::live = 0;
+
+// Deletes its own client through an AsyncClient pointer from onDisconnect.
+struct SelfDeleting : Counted {
+  static int disconnects;
+  void onDisconnect(AsyncClient *c){
+    CHECK(state.size() == 64);
+    disconnects++;
+    delete c;
+  }
+};
+int SelfDeleting::disconnects = 0;
+
+// Takes the events the table gained besides the original eight.
+struct Extended : AsyncClientHandler {
+  size_t vecs, vecBytes, progress, writable;
+  Extended(): vecs(0), vecBytes(0), progress(0), writable(0) {}
+  void onDataVec(AsyncClient *c, const AcDataVec *vec, size_t count, size_t total){ vecs++; vecBytes += total; }
+  void onProgress(AsyncClient *c, size_t len, uint32_t time){ progress += len; }
+  void onWritable(AsyncClient *c){ writable++; }
+};
+
+struct PollOnly : AsyncClientHandler {
+  void onPoll(AsyncClient *c){ (void)c; }
+};
+
+// ~AsyncClient() is virtual, ~AsyncClientT() destroys the handler.
+static void test_handler_deleted_through_base(){
+  deliveries = 0;
+  delivered = 0;
+  AsyncClientT<Counted> *t = new AsyncClientT<Counted>();
+  CHECK(Counted::live == 1);
+  // the handler takes the event, the std::function is the fallback
+  t->onData([](void *, AsyncClient *, void *, size_t){ CHECK(false); }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  CHECK(t->connect(IPAddress(IP(9)), PORT, false));
+#else
+  CHECK(t->connect(IPAddress(IP(9)), PORT));
+#endif
+  struct tcp_pcb *pcb = host_last_pcb;
+  host_connected(pcb);
+  host_recv(pcb, "data", 4);
+  CHECK(deliveries == 1 && delivered == 4);
+  AsyncClient *base = t;
+  delete base;
+  CHECK(Counted::live == 0);
+  CHECK(!host_live(pcb));
+
+  // and from its own onDisconnect, with the handler still alive there
+  AsyncClientT<SelfDeleting> *s = new AsyncClientT<SelfDeleting>();
+#if ASYNC_TCP_SSL_ENABLED
+  CHECK(s->connect(IPAddress(IP(9)), PORT, false));
+#else
+  CHECK(s->connect(IPAddress(IP(9)), PORT));
+#endif
+  pcb = host_last_pcb;
+  host_connected(pcb);
+  CHECK(Counted::live == 1);
+  s->close(true);
+  CHECK(SelfDeleting::disconnects == 1);
+  CHECK(Counted::live == 0);
+}
+
+static void test_handler_extended_events(){
+  AsyncClientT<Extended> *t = new AsyncClientT<Extended>();
+  Extended &h = t->handler();
+#if ASYNC_TCP_SSL_ENABLED
+  CHECK(t->connect(IPAddress(IP(9)), PORT, false));
+#else
+  CHECK(t->connect(IPAddress(IP(9)), PORT));
+#endif
+  struct tcp_pcb *pcb = host_last_pcb;
+  host_connected(pcb);
+  host_recv(pcb, "data", 4);
+  CHECK(h.vecs == 1 && h.vecBytes == 4);
+  // thresholds without a std::function callback
+  t->onWritable(NULL, NULL, 100, 200);
+  std::vector<char> data(300, 'w');
+  CHECK(t->write(data.data(), data.size()) == data.size());
+  host_ack(pcb, 150);
+  CHECK(h.progress == 150 && h.writable == 0);
+  host_ack(pcb, 0);
+  CHECK(h.progress == 300 && h.writable == 1);
+  close(t);
+}
+
+// The dispatch table is one pointer in every AsyncClient, AsyncClientT only
+// adds the handler. It does not shrink the client, the std::function members
+// stay in AsyncClient.
+static void test_handler_size(){
+  CHECK(sizeof(AsyncClientT<PollOnly>) - sizeof(AsyncClient) <= alignof(AsyncClient));
+  CHECK(sizeof(AsyncClientT<Counted>) - sizeof(AsyncClient) <= sizeof(Counted) + alignof(AsyncClient));
+}
+
+// Request/response traffic and the SyncClient and AsyncTCPbuffer wrappers
+// leave the optional state unallocated.
+static void test_no_side_tables(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  size_t before = host_heap.bytes;
+  for(int i = 0; i < 3; i++){
+    CHECK(c->write("request", 7) == 7);
+    host_ack(pcb, 0);
+    host_recv(pcb, "response", 8);
+  }
+  CHECK(host_heap.bytes == before);
+  {
+    SyncClient sync(c);
+    CHECK(host_heap.bytes - before == sizeof(int));  // its reference count
+  }
+  CHECK(!host_live(pcb));
+
+  c = open(&pcb);
+  CHECK(c != NULL);
+  before = host_heap.bytes;
+  AsyncTCPbuffer *buffer = new AsyncTCPbuffer(c);
+  CHECK(host_heap.bytes - before <= sizeof(AsyncTCPbuffer) + sizeof(AsyncRingBuffer) + ATB_RX_BUFFER_SIZE);
+  host_reset(pcb);
+  (void)buffer;  // deleted with the client
+}
+
+// end() and the destructor only stop listening, like they did before the
+// server tracked its clients; closeAll() is there to drop them.
+static void test_end_keeps_clients(){
+  struct tcp_pcb *pcb;
+  {
+    AsyncServer other(PORT + 2);
+    other.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+    other.begin();
+    accepted = NULL;
+    pcb = host_accept(PORT + 2, IP(1));
+    CHECK(accepted != NULL);
+    other.end();
+    CHECK(host_live(pcb) && accepted->connected());
+  }
+  CHECK(host_live(pcb) && accepted->connected());
+  host_recv(pcb, "data", 4);
+  close(accepted);
+}
+
+// Clients short of space get a broadcast through their send queue, behind
+// what is queued already, by reference to the one shared copy, so a
+// payload larger than TCP_SND_BUF reaches everyone for the memory of one.
+static void test_broadcast_through_queue(){
+  struct tcp_pcb *pa, *pb;
+  AsyncClient *a = open(&pa, IP(1));
+  AsyncClient *b = open(&pb, IP(2));
+  CHECK(a != NULL && b != NULL);
+  std::vector<char> data(2 * TCP_SND_BUF + 100, 'b');
+  size_t first = TCP_SND_BUF + 300;
+  u32_t writtenA = pa->written;
+  u32_t writtenB = pb->written;
+  CHECK(b->enqueue(data.data(), first) == first);
+  CHECK(b->queued() > 0);
+  size_t before = host_heap.bytes;
+  host_heap_reset();
+  CHECK(server->broadcast(data.data(), data.size(), 0) == 2);
+  // one copy, plus the send state a takes on for its first queued data
+  CHECK(host_heap.peak - before < data.size() + sizeof(ac_client_tx) + 256);
+  CHECK(a->outstanding() == data.size() && a->queued() > 0);
+  CHECK(b->outstanding() == data.size() + first);
+  for(int i = 0; i < 10 && (a->outstanding() || b->outstanding()); i++){
+    host_ack(pa, 0);
+    host_ack(pb, 0);
+  }
+  CHECK(a->outstanding() == 0 && b->outstanding() == 0);
+  CHECK(pa->written - writtenA == data.size());
+  CHECK(pb->written - writtenB == data.size() + first);
+  CHECK(host_heap.bytes <= before + sizeof(ac_client_tx));
+  close(a);
+  close(b);
+}
+
+// With the default limit a client that stops acking is skipped once its
+// backlog would pass ASYNC_BROADCAST_MAX_OUTSTANDING, or closed with
+// dropLagging. One with nothing outstanding always gets the payload.
+static void test_broadcast_lag_limit(){
+  struct tcp_pcb *pa, *pb;
+  AsyncClient *a = open(&pa, IP(1));
+  AsyncClient *b = open(&pb, IP(2));
+  CHECK(a != NULL && b != NULL);
+  std::vector<char> data(ASYNC_BROADCAST_MAX_OUTSTANDING / 2 + 1, 'l');
+  CHECK(server->broadcast(data.data(), data.size()) == 2);
+  for(int i = 0; i < 10 && a->outstanding(); i++)
+    host_ack(pa, 0);
+  CHECK(server->broadcast(data.data(), data.size()) == 1);
+  CHECK(b->outstanding() == data.size());
+  std::vector<char> big(ASYNC_BROADCAST_MAX_OUTSTANDING + 1, 'l');
+  for(int i = 0; i < 10 && a->outstanding(); i++)
+    host_ack(pa, 0);
+  CHECK(server->broadcast(big.data(), big.size(), ASYNC_BROADCAST_MAX_OUTSTANDING, true) == 1);
+  CHECK(a->outstanding() == big.size());
+  CHECK(!b->connected());
+  close(a);
+  close(b);
+}
+
+// onWritable() fires once when outstanding() falls to the low mark after
+// reaching the high one, and is not armed by sends that stay below high.
+// onProgress() sees every ack.
+static void test_writable_watermarks(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  static size_t writables, progressed;
+  writables = 0;
+  progressed = 0;
+  c->onWritable([](void *, AsyncClient *){ writables++; }, NULL, 500, 2000);
+  c->onProgress([](void *, AsyncClient *, size_t len, uint32_t){ progressed += len; }, NULL);
+  std::vector<char> data(3000, 'w');
+  CHECK(c->enqueue(data.data(), data.size()) == data.size());
+  host_ack(pcb, 1000);
+  CHECK(c->outstanding() == 2000 && writables == 0);
+  host_ack(pcb, 1000);
+  CHECK(writables == 0);
+  host_ack(pcb, 600);
+  CHECK(c->outstanding() == 400 && writables == 1);
+  host_ack(pcb, 0);
+  CHECK(writables == 1);
+
+  CHECK(c->write(data.data(), 1500) == 1500);
+  host_ack(pcb, 0);
+  CHECK(writables == 1);
+  CHECK(c->write(data.data(), 2000) == 2000);
+  host_ack(pcb, 1000);
+  CHECK(writables == 1);
+  host_ack(pcb, 0);
+  CHECK(writables == 2);
+  CHECK(progressed == 6500);
+  close(c);
+}
+
+// Weighted shares within a class: in one round a weight 2 connection gets
+// twice the quantum of a weight 1 one. A connection that empties its queue
+// leaves the round and is served again when it queues more.
+static void test_scheduler_weights(){
+  struct tcp_pcb *pa, *pb;
+  AsyncClient *a = open(&pa, IP(1));
+  AsyncClient *b = open(&pb, IP(2));
+  CHECK(a != NULL && b != NULL);
+  a->setPriority(AC_PRIO_NORMAL, 1);
+  b->setPriority(AC_PRIO_NORMAL, 2);
+  std::vector<char> data(12 * TCP_MSS, 's');
+  // one byte of budget: a takes it and both wait for the next round
+  AsyncSendScheduler::setBudget(1);
+  a->enqueue(data.data(), data.size());
+  b->enqueue(data.data(), data.size());
+  CHECK(AsyncSendScheduler::inFlight() == 1);
+  u32_t startA = pa->written;
+  u32_t startB = pb->written;
+  AsyncSendScheduler::setBudget(3 * ASYNC_SCHED_QUANTUM + 1);
+  host_ack(pa, 0);
+  u32_t sentA = pa->written - startA;
+  u32_t sentB = pb->written - startB;
+  CHECK(sentA >= ASYNC_SCHED_QUANTUM);
+  CHECK(sentB >= sentA * 3 / 2);
+  CHECK(AsyncSendScheduler::inFlight() == sentA + sentB);
+
+  // b drains and leaves, a has the budget to itself, b rejoins
+  for(int i = 0; i < 40 && b->queued(); i++){
+    host_ack(pa, 0);
+    host_ack(pb, 0);
+  }
+  CHECK(b->queued() == 0 && a->queued() > 0);
+  host_ack(pb, 0);
+  u32_t before = pa->written;
+  host_ack(pa, 0);
+  CHECK(pa->written > before);
+  startB = pb->written;
+  b->enqueue(data.data(), 4 * TCP_MSS);
+  host_ack(pa, 0);
+  CHECK(pb->written - startB > ASYNC_SCHED_QUANTUM);
+  for(int i = 0; i < 10 && b->queued(); i++){
+    host_ack(pa, 0);
+    host_ack(pb, 0);
+  }
+  CHECK(b->queued() == 0);
+  AsyncSendScheduler::setBudget(0);
+  close(a);
+  close(b);
+  CHECK(AsyncSendScheduler::inFlight() == 0);
+}
+
+// Higher classes are served first: bulk gets nothing while control has data
+// queued.
+static void test_scheduler_class_order(){
+  struct tcp_pcb *pa, *pc;
+  AsyncClient *bulk = open(&pa, IP(1));
+  AsyncClient *control = open(&pc, IP(2));
+  CHECK(bulk != NULL && control != NULL);
+  AsyncSendScheduler::setBudget(ASYNC_SCHED_QUANTUM);
+  bulk->setPriority(AC_PRIO_BULK);
+  control->setPriority(AC_PRIO_CONTROL);
+  std::vector<char> data(8 * TCP_MSS, 'p');
+  bulk->enqueue(data.data(), data.size());
+  control->enqueue(data.data(), data.size());
+  u32_t bulkSent = pa->written;
+  host_ack(pa, 0);
+  for(int i = 0; i < 20 && control->queued(); i++){
+    CHECK(pa->written == bulkSent);
+    host_ack(pc, 0);
+  }
+  CHECK(control->queued() == 0);
+  host_ack(pc, 0);
+  CHECK(pa->written > bulkSent);
+  AsyncSendScheduler::setBudget(0);
+  close(bulk);
+  close(control);
+}
+
+// Acks of bytes written directly do not give the scheduler budget back, and
+// an unused deficit is not saved up past one quantum.
+static void test_scheduler_mixed_traffic(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  AsyncSendScheduler::setBudget(ASYNC_SCHED_QUANTUM);
+  CHECK(c->write("direct", 6) == 6);
+  std::vector<char> data(4 * TCP_MSS, 'm');
+  c->enqueue(data.data(), data.size());
+  CHECK(AsyncSendScheduler::inFlight() == ASYNC_SCHED_QUANTUM);
+  u32_t before = pcb->written;
+  host_ack(pcb, 6);
+  CHECK(pcb->written == before);
+  CHECK(AsyncSendScheduler::inFlight() == ASYNC_SCHED_QUANTUM);
+  host_ack(pcb, 0);
+  CHECK(AsyncSendScheduler::inFlight() == ASYNC_SCHED_QUANTUM);
+  CHECK(pcb->written - before == ASYNC_SCHED_QUANTUM);
+  AsyncSendScheduler::setBudget(0);
+  close(c);
+}
+
+// The bucket starts full: one burst goes out at once, then the rate refills
+// it and the queue drains from _sent() and _poll(). Tokens do not pile up
+// past the burst while idle.
+static void test_rate_limit(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  c->setRateLimit(1000, TCP_MSS);
+  CHECK(c->getRateLimit() == 1000);
+  std::vector<char> data(8 * TCP_MSS, 'r');
+  u32_t start = pcb->written;
+  CHECK(c->enqueue(data.data(), data.size()) == data.size());
+  CHECK(pcb->written - start == TCP_MSS);
+  host_ack(pcb, 0);
+  CHECK(pcb->written - start == TCP_MSS);
+  host_advance(500);
+  host_poll(pcb);
+  CHECK(pcb->written - start == TCP_MSS + 500);
+  host_advance(300);
+  host_ack(pcb, 0);
+  CHECK(pcb->written - start == TCP_MSS + 800);
+  host_advance(60000);
+  host_poll(pcb);
+  CHECK(pcb->written - start == 2 * TCP_MSS + 800);
+  c->setRateLimit(0);
+  CHECK(c->getRateLimit() == 0);
+  host_ack(pcb, 0);
+  CHECK(pcb->written - start > 3 * TCP_MSS);
+  close(c);
+}
+
+// The server's bucket is shared by its clients on top of their own: a
+// client gets the smaller of the two and the others split the rest.
+static void test_server_rate_limit(){
+  struct tcp_pcb *pa, *pb;
+  AsyncClient *a = open(&pa, IP(1));
+  AsyncClient *b = open(&pb, IP(2));
+  CHECK(a != NULL && b != NULL);
+  server->setRateLimit(1000, TCP_MSS);
+  a->setRateLimit(100);
+  std::vector<char> data(4 * TCP_MSS, 'r');
+  u32_t startA = pa->written;
+  u32_t startB = pb->written;
+  a->enqueue(data.data(), data.size());
+  b->enqueue(data.data(), data.size());
+  CHECK((pa->written - startA) + (pb->written - startB) == TCP_MSS);
+  host_ack(pa, 0);
+  host_ack(pb, 0);
+  startA = pa->written;
+  startB = pb->written;
+  host_advance(1000);
+  host_poll(pa);
+  host_poll(pb);
+  CHECK(pa->written - startA == 100);
+  CHECK(pb->written - startB == 900);
+  server->setRateLimit(0);
+  CHECK(server->getRateLimit() == 0);
+  close(a);
+  close(b);
+}
+
+// The wheel's os_timer is armed for the next slot with work, not every tick,
+// so timers far off cost a few wakeups and still fire on time.
+static size_t timer_fired;
+
+static void count_timer(AsyncTimer *timer, void *arg){
+  timer_fired++;
+}
+
+static void test_timer_wakeups(){
+  AsyncTimer near(&count_timer, NULL);
+  AsyncTimer far(&count_timer, NULL);
+  CHECK(AsyncTimerWheel::armed() == 0);
+  timer_fired = 0;
+  // Run off any wakeup left from timers cancelled by the earlier tests.
+  host_advance(50 * 60 * 1000);
+
+  uint32_t fires = host_timer_fires;
+  far.arm(5000);
+  host_advance(4990);
+  CHECK(timer_fired == 0 && far.armed());
+  host_advance(20);
+  CHECK(timer_fired == 1);
+  CHECK(host_timer_fires - fires == 1);
+
+  fires = host_timer_fires;
+  far.arm(60000);
+  near.arm(25);
+  host_advance(30);
+  CHECK(timer_fired == 2);
+  host_advance(59960);
+  CHECK(timer_fired == 2 && far.armed());
+  host_advance(20);
+  CHECK(timer_fired == 3);
+  CHECK(host_timer_fires - fires <= 6);
+
+  // Past the end of the wheel
+  fires = host_timer_fires;
+  far.arm(50 * 60 * 1000);
+  host_advance(50 * 60 * 1000 - 10);
+  CHECK(timer_fired == 3);
+  host_advance(20);
+  CHECK(timer_fired == 4);
+  CHECK(host_timer_fires - fires <= 8);
+
+  // A cancelled timer leaves at most the one wakeup already armed.
+  fires = host_timer_fires;
+  far.arm(60000);
+  far.cancel();
+  host_advance(120000);
+  CHECK(host_timer_fires - fires <= 1);
+  CHECK(timer_fired == 4 && AsyncTimerWheel::armed() == 0);
+}
+
+// A FIN refused by the recv callback is gone for good: a delayed connection
+// the remote closes has to be dropped, not left in CLOSE_WAIT.
+static void test_delayed_fin(){
+  server->setMaxClients(1);
+  server->setAdmitPolicy(AS_ADMIT_DELAY);
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  accepted = NULL;
+  struct tcp_pcb *waiting = host_accept(PORT, IP(2));
+  CHECK(waiting != NULL && accepted == NULL);
+  uint32_t lost = host_fins_lost;
+  host_fin(waiting);
+  CHECK(host_fins_lost == lost);
+  CHECK(!host_live(waiting));
+  CHECK(server->getAdmitStats().refused == 1);
+  close(c);
+  server->setMaxClients(0);
+  server->setAdmitPolicy(AS_ADMIT_REFUSE);
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+// tcp_ssl_write() encrypts into its own buffer, so nothing is referenced
+// past addv().
+static void test_addv_release_ssl(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  std::vector<char> data(300, 'v');
+  AcSendFragment frags[3];
+  fragments(frags, data.data());
+  CHECK(c->writev(frags, 3) == 600);
+  CHECK(released[0] == 1 && released[1] == 1 && released[2] == 1);
+  host_ack(pcb, 0);
+  close(c);
+  CHECK(released[0] == 1 && released[1] == 1 && released[2] == 1);
+}
+
+// Connections queued for a handshake slot are admitted already and count
+// against the limits.
+static void test_pending_count_against_limits(){
+  server->setMaxHandshakes(1);
+  server->setMaxClients(2);
+  accepted = NULL;
+  struct tcp_pcb *a = host_accept(PORT, IP(1));
+  struct tcp_pcb *b = host_accept(PORT, IP(2));
+  CHECK(a != NULL && b != NULL);
+  CHECK(server->getSslStats().depth == 1);
+  CHECK(host_accept(PORT, IP(3)) == NULL);
+
+  server->setMaxClients(0);
+  server->setMaxClientsPerIP(2);
+  struct tcp_pcb *c = host_accept(PORT, IP(2));
+  CHECK(c != NULL);
+  CHECK(server->getSslStats().depth == 2);
+  CHECK(host_accept(PORT, IP(2)) == NULL);
+
+  host_reset(c);
+  host_reset(b);
+  host_reset(a);
+  CHECK(server->getSslStats().depth == 0);
+  server->setMaxClientsPerIP(0);
+  server->setMaxHandshakes(ASYNC_SSL_MAX_HANDSHAKES);
+}
+
+static std::vector<AsyncClient*> handshaken;
+
+// Past ASYNC_SSL_MAX_HANDSHAKES connections wait and are started in arrival
+// order, when a handshake finishes or a client in its handshake goes away,
+// whether or not they sent anything while waiting.
+static void test_pending_fifo(){
+  handshaken.clear();
+  server->onClient([](void *, AsyncClient *c){ handshaken.push_back(c); }, NULL);
+  AsSslStats before = server->getSslStats();
+  struct tcp_pcb *started[ASYNC_SSL_MAX_HANDSHAKES];
+  for(int i = 0; i < ASYNC_SSL_MAX_HANDSHAKES; i++)
+    started[i] = host_accept(PORT, IP(i + 1));
+  struct tcp_pcb *first = host_accept(PORT, IP(10));
+  struct tcp_pcb *second = host_accept(PORT, IP(11));
+  CHECK(first != NULL && second != NULL);
+  CHECK(server->getSslStats().depth == 2);
+  CHECK(server->getSslStats().queued - before.queued == 2);
+  host_recv(second, "hello", 5);
+
+  // a finished handshake starts the oldest, which has sent nothing yet
+  host_recv(started[0], "hello", 5);
+  CHECK(handshaken.size() == 1);
+  host_advance(2 * ASYNC_TIMER_TICK);
+  CHECK(server->getSslStats().depth == 1);
+  CHECK(server->getSslStats().promoted - before.promoted == 1);
+  CHECK(handshaken.size() == 1);
+
+  // one still in its handshake goes away, the other one gets its slot and
+  // the data it sent while waiting
+  host_reset(started[ASYNC_SSL_MAX_HANDSHAKES - 1]);
+  host_advance(2 * ASYNC_TIMER_TICK);
+  CHECK(server->getSslStats().depth == 0);
+  CHECK(handshaken.size() == 2 && (uint32_t)handshaken[1]->remoteIP() == IP(11));
+  host_recv(first, "hello", 5);
+  CHECK(handshaken.size() == 3 && (uint32_t)handshaken[2]->remoteIP() == IP(10));
+
+  for(int i = 1; i < ASYNC_SSL_MAX_HANDSHAKES - 1; i++)
+    host_reset(started[i]);
+  for(AsyncClient *c : handshaken)
+    close(c);
+  server->onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+}
+
+// Data past ASYNC_SSL_PENDING_MAX is refused and retried by lwIP; the
+// connection counts as throttled once, and gets all of it when started.
+static void test_pending_throttled_once(){
+  server->setMaxHandshakes(1);
+  AsSslStats before = server->getSslStats();
+  struct tcp_pcb *busy = host_accept(PORT, IP(1));
+  struct tcp_pcb *waiting = host_accept(PORT, IP(2));
+  CHECK(busy != NULL && waiting != NULL);
+  CHECK(server->getSslStats().depth == 1);
+  std::vector<char> data(ASYNC_SSL_PENDING_MAX, 'p');
+  data[0] = 'h';
+  CHECK(host_recv(waiting, data.data(), data.size()) == ERR_OK);
+  CHECK(host_recv(waiting, "more", 4) == ERR_MEM);
+  host_fasttmr();
+  host_fasttmr();
+  CHECK(server->getSslStats().throttled - before.throttled == 1);
+
+  accepted = NULL;
+  deliveries = 0;
+  host_reset(busy);
+  host_advance(2 * ASYNC_TIMER_TICK);
+  CHECK(accepted != NULL && server->getSslStats().depth == 0);
+  accepted->onData([](void *, AsyncClient *, void *, size_t len){ deliveries++; delivered += len; }, NULL);
+  delivered = 0;
+  host_fasttmr();
+  CHECK(delivered == 4);
+  CHECK(server->getSslStats().throttled - before.throttled == 1);
+  close(accepted);
+  server->setMaxHandshakes(ASYNC_SSL_MAX_HANDSHAKES);
+}
+
+// A client whose TLS setup fails is closed before anyone sees it, its pool
+// slot has to come back.
+static void test_ssl_setup_failure_returns_pool_slot(){
+  AsyncServer pooled(PORT + 1);
+  pooled.setClientPool(1);
+  pooled.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+  pooled.beginSecure("cert", "key", NULL);
+  CHECK(pooled.getClientPool() != NULL);
+  host_ssl_new_fail = 1;
+  accepted = NULL;
+  CHECK(host_accept(PORT + 1, IP(1)) == NULL || accepted == NULL);
+  CHECK(pooled.getClientPool()->used() == 0);
+  CHECK(pooled.clientCount() == 0);
+
+  struct tcp_pcb *pcb = host_accept(PORT + 1, IP(1));
+  host_recv(pcb, "hello", 5);
+  CHECK(accepted != NULL);
+  CHECK(pooled.getClientPool()->used() == 1);
+  close(accepted);
+  pooled.end();
+}
+#endif
+
+static AsyncClient *openPooled(){
+  accepted = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+  struct tcp_pcb *pcb = host_accept(PORT + 2, IP(1));
+  if(pcb)
+    host_recv(pcb, "hello", 5);
+#else
+  host_accept(PORT + 2, IP(1));
+#endif
+  return accepted;
+}
+
+// The last slot freed is the first one handed out again, a full pool falls
+// back to the heap and heap clients are deleted as before.
+static void test_pool_slot_reuse(){
+  AsyncServer pooled(PORT + 2);
+  pooled.setClientPool(2);
+  pooled.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  pooled.beginSecure("cert", "key", NULL);
+#else
+  pooled.begin();
+#endif
+  const AsyncClientPool *pool = pooled.getClientPool();
+  CHECK(pool != NULL);
+  size_t heap = host_heap.bytes;
+
+  AsyncClient *a = openPooled();
+  AsyncClient *b = openPooled();
+  CHECK(a && b && a != b);
+  CHECK(pool->used() == 2 && pool->misses() == 0);
+  AsyncClient *c = openPooled();
+  CHECK(c != NULL);
+  CHECK(pool->misses() == 1);
+  CHECK(host_heap.bytes > heap);
+
+  close(a);
+  CHECK(pool->used() == 1);
+  CHECK(openPooled() == a);
+  CHECK(pool->used() == 2 && pool->misses() == 1);
+
+  close(c);
+  CHECK(pool->used() == 2);
+  close(b);
+  close(a);
+  CHECK(openPooled() == a);
+  CHECK(openPooled() == b);
+  CHECK(pool->used() == 2 && pool->highWater() == 2);
+  close(a);
+  close(b);
+  CHECK(pool->used() == 0);
+  CHECK(host_heap.bytes == heap);
+  pooled.end();
+}
+
+int main(){
+  AsyncServer s(PORT);
+  server = &s;
+  s.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  s.beginSecure("cert", "key", NULL);
+#else
+  s.begin();
+  RUN(test_coalesce_bytes_only);
+  RUN(test_coalesce_time_limit);
+  RUN(test_coalesce_capped_below_window);
+  RUN(test_coalesce_off_releases_hold);
+  RUN(test_data_vec_chain);
+  RUN(test_packet_chain_deferred_ack);
+  RUN(test_cork);
+  RUN(test_addv_release_on_ack);
+  RUN(test_ack_timeout_marks);
+  RUN(test_recv_budget);
+  RUN(test_recv_budget_manual_ack);
+#endif
+  RUN(test_delayed_fin);
+  RUN(test_handler_deleted_through_base);
+  RUN(test_handler_extended_events);
+  RUN(test_handler_size);
+  RUN(test_no_side_tables);
+  RUN(test_end_keeps_clients);
+  RUN(test_broadcast_through_queue);
+  RUN(test_broadcast_lag_limit);
+  RUN(test_writable_watermarks);
+  RUN(test_scheduler_weights);
+  RUN(test_scheduler_class_order);
+  RUN(test_scheduler_mixed_traffic);
+  RUN(test_rate_limit);
+  RUN(test_server_rate_limit);
+  RUN(test_pool_slot_reuse);
+  RUN(test_timer_wakeups);
+#if ASYNC_TCP_SSL_ENABLED
+  RUN(test_addv_release_ssl);
+  RUN(test_pending_count_against_limits);
+  RUN(test_pending_fifo);
+  RUN(test_pending_throttled_once);
+  RUN(test_ssl_setup_failure_returns_pool_slot);
+#endif
+  s.end();
+  return host_result();
+}
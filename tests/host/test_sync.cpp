@@ -0,0 +1,112 @@
+/*
+  SyncClient receive queue against the fake stack.
+*/
+#include <string>
+#include "ESPAsyncTCP.h"
+#include "SyncClient.h"
+#include "host_test.h"
+
+#define PORT 80
+
+static AsyncClient *accepted;
+
+static struct tcp_pcb *open(){
+  accepted = NULL;
+  struct tcp_pcb *pcb = host_accept(PORT, 0x0100007f);
+#if ASYNC_TCP_SSL_ENABLED
+  if(pcb)
+    host_recv(pcb, "hello", 5);
+#endif
+  CHECK(accepted != NULL);
+  return pcb;
+}
+
+static std::string payload(size_t len){
+  std::string s(len, 0);
+  for(size_t i = 0; i < len; i++)
+    s[i] = (char)(i % 251);
+  return s;
+}
+
+// Three segments read in pieces that do not line up with them. A plain
+// connection gets the window of each pbuf back once it has been read in
+// full; SSL records are acked by tcp_axtls as they arrive and their data is
+// read from our own copies.
+static void test_read_across_pbufs(){
+  struct tcp_pcb *pcb = open();
+  SyncClient sync(accepted);
+  std::string data = payload(350);
+  uint8_t buf[400];
+
+  // the queue stays allocated once there was data
+  host_recv(pcb, "q", 1);
+  CHECK(sync.read() == 'q');
+  size_t heap = host_heap.bytes;
+  u32_t start = pcb->recved;
+
+  host_recv(pcb, data.data(), 100);
+  host_recv(pcb, data.data() + 100, 50);
+  host_recv(pcb, data.data() + 150, 200);
+  CHECK(sync.available() == 350);
+  CHECK(host_heap.bytes > heap + 350);
+#if ASYNC_TCP_SSL_ENABLED
+  CHECK(pcb->recved - start == 350);
+#else
+  CHECK(pcb->recved == start);
+#endif
+
+  CHECK(sync.read(buf, 30) == 30);
+  CHECK(std::string((char*)buf, 30) == data.substr(0, 30));
+#if !ASYNC_TCP_SSL_ENABLED
+  CHECK(pcb->recved == start);
+#endif
+  CHECK(sync.read(buf, 100) == 100);
+  CHECK(std::string((char*)buf, 100) == data.substr(30, 100));
+#if !ASYNC_TCP_SSL_ENABLED
+  CHECK(pcb->recved - start == 100);
+#endif
+  CHECK(sync.peek() == (uint8_t)data[130]);
+  CHECK(sync.read(buf, 20) == 20);
+  CHECK(std::string((char*)buf, 20) == data.substr(130, 20));
+#if !ASYNC_TCP_SSL_ENABLED
+  CHECK(pcb->recved - start == 150);
+#endif
+  CHECK(sync.available() == 200);
+  CHECK(sync.read(buf, sizeof(buf)) == 200);
+  CHECK(std::string((char*)buf, 200) == data.substr(150));
+  CHECK(pcb->recved - start == 350);
+  CHECK(sync.available() == 0 && sync.read() == -1);
+  CHECK(host_heap.bytes == heap);
+}
+
+// What was received before the connection closed can still be read; the
+// pbufs are freed without a window update.
+static void test_read_after_close(){
+  struct tcp_pcb *pcb = open();
+  SyncClient sync(accepted);
+  std::string data = payload(80);
+  host_recv(pcb, data.data(), 50);
+  host_recv(pcb, data.data() + 50, 30);
+  accepted->close(true);
+  CHECK(!host_live(pcb));
+  CHECK(!sync.connected() && sync.available() == 80);
+  uint8_t buf[80];
+  CHECK(sync.read(buf, 60) == 60);
+  CHECK(sync.read(buf + 60, 20) == 20);
+  CHECK(std::string((char*)buf, 80) == data);
+  CHECK(sync.available() == 0);
+}
+
+int main(){
+  AsyncServer server(PORT);
+  server.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  server.beginSecure("cert", "key", NULL);
+#else
+  server.begin();
+#endif
+  RUN(test_read_across_pbufs);
+  RUN(test_read_after_close);
+  server.end();
+  return host_result();
+}
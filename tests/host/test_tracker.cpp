@@ -0,0 +1,424 @@
+/*
+  Client lifetime: the library has to notice when a client is deleted from
+  inside one of its own callbacks and stop touching it. The fake stack frees
+  pcbs and the sanitizers report any later use of the client or the pcb.
+  Every callback deletes its client once below, and walks over several
+  clients (forEachClient(), broadcast(), the send scheduler) have clients
+  other than the current one deleted under them.
+*/
+#include <vector>
+#include "ESPAsyncTCP.h"
+#include "host_test.h"
+
+#define PORT 80
+#define IP(n) (0x0000000a | ((uint32_t)(n) << 24))
+
+static AsyncServer *server;
+static AsyncClient *accepted;
+static size_t disconnects;
+
+// Accepts a connection and, on the SSL build, completes its handshake.
+static AsyncClient *open(struct tcp_pcb **pcb, uint32_t ip = IP(1)){
+  accepted = NULL;
+  *pcb = host_accept(PORT, ip);
+#if ASYNC_TCP_SSL_ENABLED
+  if(*pcb)
+    host_recv(*pcb, "hello", 5);
+#endif
+  return accepted;
+}
+
+static std::vector<char> payload(size_t len){
+  return std::vector<char>(len, 'q');
+}
+
+static size_t deleted;
+
+static void kill(AsyncClient *c){
+  deleted++;
+  delete c;
+}
+
+// The pcb is gone once the driver call that deleted its client returns.
+static void checkKilled(struct tcp_pcb *pcb){
+  CHECK(deleted == 1);
+  CHECK(!host_live(pcb));
+}
+
+static void test_delete_in_connect(){
+  deleted = 0;
+  AsyncClient *c = new AsyncClient();
+  c->onConnect([](void *, AsyncClient *c){ kill(c); }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  CHECK(c->connect(IPAddress(IP(9)), PORT, false));
+#else
+  CHECK(c->connect(IPAddress(IP(9)), PORT));
+#endif
+  struct tcp_pcb *pcb = host_last_pcb;
+  host_connected(pcb);
+  checkKilled(pcb);
+}
+
+static void test_delete_in_data(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onData([](void *, AsyncClient *c, void *, size_t){ kill(c); }, NULL);
+  host_recv(pcb, "data", 4);
+  checkKilled(pcb);
+}
+
+#if !ASYNC_TCP_SSL_ENABLED
+static void test_delete_in_packet(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onPacket([](void *, AsyncClient *c, struct pbuf *pb){ c->ackPacket(pb); kill(c); }, NULL);
+  host_recv(pcb, "data", 4);
+  checkKilled(pcb);
+}
+
+static void test_delete_in_packet_chain(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onPacketChain([](void *, AsyncClient *c, struct pbuf *pb){ c->ackPackets(pb); kill(c); }, NULL);
+  host_recv(pcb, "data", 4);
+  checkKilled(pcb);
+}
+
+static void test_delete_in_data_vec(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onDataVec([](void *, AsyncClient *c, const AcDataVec *, size_t, size_t){ kill(c); }, NULL);
+  host_recv(pcb, "data", 4);
+  checkKilled(pcb);
+}
+
+// held by setRecvCoalesce() and handed over from the connection timer
+static void test_delete_in_coalesced_data(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->setRecvCoalesce(1000, 20);
+  c->onData([](void *, AsyncClient *c, void *, size_t){ kill(c); }, NULL);
+  host_recv(pcb, "data", 4, false);
+  CHECK(deleted == 0);
+  host_advance(30);
+  checkKilled(pcb);
+}
+#endif
+
+static void test_delete_in_ack(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onAck([](void *, AsyncClient *c, size_t, uint32_t){ kill(c); }, NULL);
+  c->write("data", 4);
+  host_ack(pcb, 0);
+  checkKilled(pcb);
+}
+
+static void test_delete_in_writable(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onWritable([](void *, AsyncClient *c){ kill(c); }, NULL, 0, TCP_SND_BUF);
+  std::vector<char> data = payload(2 * TCP_SND_BUF);
+  c->enqueue(data.data(), data.size());
+  for(int i = 0; i < 4 && deleted == 0; i++)
+    host_ack(pcb, 0);
+  checkKilled(pcb);
+}
+
+static void test_delete_in_poll(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onPoll([](void *, AsyncClient *c){ kill(c); }, NULL);
+  host_poll(pcb);
+  checkKilled(pcb);
+}
+
+#if !ASYNC_TCP_SSL_ENABLED
+// secure clients leave the ack timeout to the TLS layer
+static void test_delete_in_timeout(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->setAckTimeout(100);
+  c->onTimeout([](void *, AsyncClient *c, uint32_t){ kill(c); }, NULL);
+  c->write("data", 4);
+  host_advance(200);
+  checkKilled(pcb);
+}
+#endif
+
+static void test_delete_in_error(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onError([](void *, AsyncClient *c, err_t){ kill(c); }, NULL);
+  host_reset(pcb);
+  CHECK(deleted == 1);
+}
+
+static void test_delete_in_disconnect_on_fin(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onDisconnect([](void *, AsyncClient *c){ kill(c); }, NULL);
+  host_fin(pcb);
+  checkKilled(pcb);
+}
+
+// rx timeout closes the connection from the connection timer
+static void test_delete_in_disconnect_on_rx_timeout(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->setRxTimeoutMs(100);
+  c->onDisconnect([](void *, AsyncClient *c){ kill(c); }, NULL);
+  host_advance(200);
+  checkKilled(pcb);
+}
+
+// close() from onData runs onDisconnect inside the recv callback
+static void test_delete_in_disconnect_from_data(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  deleted = 0;
+  c->onDisconnect([](void *, AsyncClient *c){ kill(c); }, NULL);
+  c->onData([](void *, AsyncClient *c, void *, size_t){ c->close(true); }, NULL);
+  host_recv(pcb, "data", 4);
+  checkKilled(pcb);
+}
+
+// The callback deletes the client being visited and the next one, and a
+// nested walk deletes another one still ahead of the outer walk.
+static void test_delete_in_client_walks(){
+  static std::vector<AsyncClient*> clients;
+  static size_t visits;
+  AsyncServer *s = server;
+  struct tcp_pcb *pcbs[6];
+  clients.clear();
+  for(int i = 0; i < 6; i++)
+    clients.push_back(open(&pcbs[i], IP(10 + i)));
+  CHECK(s != NULL);
+  size_t before = s->clientCount();
+  visits = 0;
+  deleted = 0;
+  // clients are visited newest first
+  s->forEachClient([](void *, AsyncClient *c){
+    visits++;
+    if(c == clients[5]){
+      kill(clients[4]);
+      server->forEachClient([](void *, AsyncClient *c){
+        if(c == clients[3] || c == clients[2])
+          kill(c);
+      });
+      kill(c);
+    } else if(c == clients[1]){
+      kill(c);
+      kill(clients[0]);
+    }
+  });
+  CHECK(visits == 2);
+  CHECK(deleted == 6);
+  CHECK(s->clientCount() == before - 6);
+  for(int i = 0; i < 6; i++)
+    CHECK(!host_live(pcbs[i]));
+}
+
+// A lagging client is closed by broadcast(), its onDisconnect deletes it
+// and the client the walk goes to next.
+static void test_delete_in_broadcast(){
+  static AsyncClient *clients[3];
+  struct tcp_pcb *pcbs[3];
+  for(int i = 0; i < 3; i++)
+    clients[i] = open(&pcbs[i], IP(20 + i));
+  AsyncServer *s = server;
+  deleted = 0;
+  std::vector<char> data = payload(100);
+  clients[2]->write(data.data(), data.size());
+  clients[2]->onDisconnect([](void *, AsyncClient *c){
+    kill(c);
+    kill(clients[1]);
+  }, NULL);
+  CHECK(s->broadcast(data.data(), data.size(), 150, true) == 1);
+  CHECK(deleted == 2);
+  CHECK(!host_live(pcbs[2]));
+  CHECK(!host_live(pcbs[1]));
+  CHECK(host_live(pcbs[0]));
+  host_ack(pcbs[0], 0);
+  kill(clients[0]);
+}
+
+// Clients waiting in the send scheduler are deleted from another client's
+// onProgress, between its ack and the scheduler run that follows, and by
+// acks after that.
+static void test_delete_in_scheduler_walk(){
+  static AsyncClient *clients[3];
+  struct tcp_pcb *pcbs[3];
+  AsyncSendScheduler::setBudget(TCP_SND_BUF);
+  for(int i = 0; i < 3; i++)
+    clients[i] = open(&pcbs[i], IP(30 + i));
+  deleted = 0;
+  std::vector<char> data = payload(2 * TCP_SND_BUF);
+  for(int i = 0; i < 3; i++)
+    clients[i]->enqueue(data.data(), data.size());
+  CHECK(clients[1]->queued() > 0 && clients[2]->queued() > 0);
+  clients[0]->onProgress([](void *, AsyncClient *c, size_t, uint32_t){
+    if(deleted)
+      return;
+    kill(clients[1]);
+    kill(clients[2]);
+  }, NULL);
+  for(int i = 0; i < 8 && clients[0]->queued(); i++)
+    host_ack(pcbs[0], 0);
+  CHECK(deleted == 2);
+  CHECK(clients[0]->queued() == 0);
+  kill(clients[0]);
+  for(int i = 0; i < 3; i++)
+    CHECK(!host_live(pcbs[i]));
+  CHECK(AsyncSendScheduler::inFlight() == 0);
+  AsyncSendScheduler::setBudget(0);
+}
+
+// The ack refills the window from the send queue, then the progress
+// callback deletes the client.
+static void test_delete_in_progress_with_queue(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  disconnects = 0;
+  std::vector<char> data = payload(3 * TCP_SND_BUF);
+  c->enqueue(data.data(), data.size());
+  c->onProgress([](void *, AsyncClient *c, size_t, uint32_t){ disconnects++; delete c; }, NULL);
+  host_ack(pcb, 0);
+  CHECK(disconnects == 1);
+  CHECK(!host_live(pcb));
+}
+
+#if ASYNC_TCP_SSL_ENABLED
+static void deleteOnDisconnect(AsyncClient *c){
+  c->onDisconnect([](void *, AsyncClient *c){ disconnects++; delete c; }, NULL);
+}
+
+// A failed tcp_ssl_write() closes the connection and the discard callback
+// deletes the client, in the middle of draining the send queue.
+static void test_ssl_write_failure_in_enqueue(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  deleteOnDisconnect(c);
+  disconnects = 0;
+  host_ssl_write_fail = 1;
+  std::vector<char> data = payload(100);
+  CHECK(c->enqueue(data.data(), data.size()) == 0);
+  CHECK(disconnects == 1);
+  CHECK(!host_live(pcb));
+}
+
+static void test_ssl_write_failure_in_sent(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  deleteOnDisconnect(c);
+  disconnects = 0;
+  std::vector<char> data = payload(3 * TCP_SND_BUF);
+  CHECK(c->enqueue(data.data(), data.size()) == data.size());
+  CHECK(c->queued() > 0);
+  host_ssl_write_fail = 1;
+  host_ack(pcb, 0);
+  CHECK(disconnects == 1);
+  CHECK(!host_live(pcb));
+}
+
+// Paced: the queue is only drained again from poll once tokens are back.
+static void test_ssl_write_failure_in_poll(){
+  struct tcp_pcb *pcb;
+  AsyncClient *c = open(&pcb);
+  CHECK(c != NULL);
+  deleteOnDisconnect(c);
+  disconnects = 0;
+  c->setRateLimit(1000, 1000);
+  std::vector<char> data = payload(3000);
+  c->enqueue(data.data(), data.size());
+  host_ack(pcb, 0);
+  CHECK(c->queued() > 0);
+  host_advance(1000);
+  host_ssl_write_fail = 1;
+  host_poll(pcb);
+  CHECK(disconnects == 1);
+  CHECK(!host_live(pcb));
+}
+
+// Same through the send scheduler: the failing client is drained from
+// another client's _sent().
+static void test_ssl_write_failure_in_scheduler(){
+  AsyncSendScheduler::setBudget(TCP_SND_BUF);
+  struct tcp_pcb *pa, *pb;
+  AsyncClient *a = open(&pa, IP(2));
+  AsyncClient *b = open(&pb, IP(3));
+  CHECK(a && b);
+  deleteOnDisconnect(a);
+  deleteOnDisconnect(b);
+  disconnects = 0;
+  std::vector<char> data = payload(2 * TCP_SND_BUF);
+  a->enqueue(data.data(), 1000);
+  b->enqueue(data.data(), data.size());
+  CHECK(a->queued() == 0);
+  CHECK(b->queued() > 0);
+  host_ssl_write_fail = 1;
+  host_ack(pa, 0);
+  CHECK(disconnects == 1);
+  CHECK(!host_live(pb));
+  CHECK(host_live(pa));
+  a->close(true);
+  CHECK(disconnects == 2);
+  AsyncSendScheduler::setBudget(0);
+}
+#endif
+
+int main(){
+  AsyncServer s(PORT);
+  server = &s;
+  s.onClient([](void *, AsyncClient *c){ accepted = c; }, NULL);
+#if ASYNC_TCP_SSL_ENABLED
+  s.beginSecure("cert", "key", NULL);
+#else
+  s.begin();
+#endif
+  RUN(test_delete_in_progress_with_queue);
+  RUN(test_delete_in_connect);
+  RUN(test_delete_in_data);
+#if !ASYNC_TCP_SSL_ENABLED
+  RUN(test_delete_in_packet);
+  RUN(test_delete_in_packet_chain);
+  RUN(test_delete_in_data_vec);
+  RUN(test_delete_in_coalesced_data);
+#endif
+  RUN(test_delete_in_ack);
+  RUN(test_delete_in_writable);
+  RUN(test_delete_in_poll);
+#if !ASYNC_TCP_SSL_ENABLED
+  RUN(test_delete_in_timeout);
+#endif
+  RUN(test_delete_in_error);
+  RUN(test_delete_in_disconnect_on_fin);
+  RUN(test_delete_in_disconnect_on_rx_timeout);
+  RUN(test_delete_in_disconnect_from_data);
+  RUN(test_delete_in_client_walks);
+  RUN(test_delete_in_broadcast);
+  RUN(test_delete_in_scheduler_walk);
+#if ASYNC_TCP_SSL_ENABLED
+  RUN(test_ssl_write_failure_in_enqueue);
+  RUN(test_ssl_write_failure_in_sent);
+  RUN(test_ssl_write_failure_in_poll);
+  RUN(test_ssl_write_failure_in_scheduler);
+#endif
+  s.end();
+  return host_result();
+}